@@ -1,9 +1,15 @@
 /* MiniOS kernel: VGA console, keyboard polling, minimal shell */
+#include "config.h" /* CONFIG_* feature switches, generated from Kconfig (make config.h) */
 
 typedef unsigned int uint32_t;
 typedef int int32_t;
 typedef unsigned short uint16_t;
+typedef short int16_t;
 typedef unsigned char uint8_t;
+typedef unsigned long long uint64_t;
+typedef long long int64_t;
+typedef __UINTPTR_TYPE__ uintptr_t;
+typedef __SIZE_TYPE__ size_t;
 
 /* I/O ports */
 static inline void outb(uint16_t port, uint8_t val) {
@@ -16,313 +22,5591 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+/* Freestanding memory helpers (GCC may also emit calls to these).
+   Written with string instructions so the compiler can't turn them back into calls.
+   memcpy, memset and kmemmem have variants per CPU feature; cpu_select()
+   points them at the best one once at boot, and they start out on the
+   baseline. The SSE2 variants are built with target("sse2") (SIMD_FN) so
+   the rest of the kernel stays free of vector registers. Interrupt handlers
+   reach them too (klog, the console), so the stubs in boot/irq*.S
+   fxsave/fxrstor around every handler once irq_fxsave is set. */
+#ifdef __x86_64__
+#define SIMD_FN(isa) __attribute__((target(isa)))
+#else
+/* nothing keeps the i386 stack 16-byte aligned for vector spills */
+#define SIMD_FN(isa) __attribute__((target(isa), force_align_arg_pointer))
+#endif
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef char v16i8 __attribute__((vector_size(16)));
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+static void *memcpy_movsl(void *dst, const void *src, size_t n) {
+    void *d = dst;
+    size_t words = n / 4, bytes = n % 4;
+    __asm__ volatile ("rep movsl\n\tmov %3, %2\n\trep movsb" : "+D"(d), "+S"(src), "+c"(words) : "r"(bytes) : "memory");
+    return dst;
+}
+
+/* Enhanced REP MOVSB: the microcode picks the copy width itself */
+static void *memcpy_erms(void *dst, const void *src, size_t n) {
+    void *d = dst;
+    __asm__ volatile ("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+    return dst;
+}
+
+SIMD_FN("sse2") static void *memcpy_sse2(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t blocks = n / 64;
+    if (blocks)
+        __asm__ volatile ("1:\n\t"
+                          "movdqu (%1), %%xmm0\n\tmovdqu 16(%1), %%xmm1\n\tmovdqu 32(%1), %%xmm2\n\tmovdqu 48(%1), %%xmm3\n\t"
+                          "movdqu %%xmm0, (%0)\n\tmovdqu %%xmm1, 16(%0)\n\tmovdqu %%xmm2, 32(%0)\n\tmovdqu %%xmm3, 48(%0)\n\t"
+                          "add $64, %1\n\tadd $64, %0\n\tdec %2\n\tjnz 1b"
+                          : "+r"(d), "+r"(s), "+r"(blocks) : : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+    memcpy_movsl(d, s, n % 64);
+    return dst;
+}
+
+static void *(*memcpy_impl)(void *, const void *, size_t) = memcpy_movsl;
+
+void *memcpy(void *dst, const void *src, size_t n) { return memcpy_impl(dst, src, n); }
+
+/* Overlap-safe copy, a word at a time where it can */
+void *memmove(void *dst, const void *src, size_t n) {
+    size_t words = n / 4, bytes = n % 4;
+    if ((uintptr_t)dst <= (uintptr_t)src || (uintptr_t)dst >= (uintptr_t)src + n) {
+        void *d = dst;
+        __asm__ volatile ("rep movsl\n\tmov %3, %2\n\trep movsb"
+                          : "+D"(d), "+S"(src), "+c"(words) : "r"(bytes) : "memory");
+    } else {
+        /* backwards: the odd tail bytes first, then whole words */
+        uint8_t *d = (uint8_t *)dst + n - 1;
+        const uint8_t *s = (const uint8_t *)src + n - 1;
+        __asm__ volatile ("std\n\trep movsb\n\tsub $3, %0\n\tsub $3, %1\n\tmov %3, %2\n\trep movsl\n\tcld"
+                          : "+D"(d), "+S"(s), "+c"(bytes) : "r"(words) : "memory");
+    }
+    return dst;
+}
+
+static void *memset_stosl(void *dst, int c, size_t n) {
+    void *d = dst;
+    size_t words = n / 4, bytes = n % 4;
+    uint32_t v = (uint8_t)c * 0x01010101u;
+    __asm__ volatile ("rep stosl\n\tmov %2, %1\n\trep stosb" : "+D"(d), "+c"(words) : "r"(bytes), "a"(v) : "memory");
+    return dst;
+}
+
+static void *memset_erms(void *dst, int c, size_t n) {
+    void *d = dst;
+    __asm__ volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+    return dst;
+}
+
+static void *(*memset_impl)(void *, int, size_t) = memset_stosl;
+
+void *memset(void *dst, int c, size_t n) { return memset_impl(dst, c, n); }
+
+int memcmp(const void *a, const void *b, size_t n) {
+    const uint8_t *x = (const uint8_t *)a, *y = (const uint8_t *)b;
+    for (size_t i = 0; i < n; ++i) if (x[i] != y[i]) return x[i] - y[i];
+    return 0;
+}
+
+/* First occurrence of pat (plen > 0 bytes) in hay, or 0 */
+static const char *memmem_generic(const char *hay, uint32_t hlen, const char *pat, uint32_t plen) {
+    for (uint32_t i = 0; i + plen <= hlen; ++i)
+        if (hay[i] == pat[0] && memcmp(hay + i, pat, plen) == 0) return hay + i;
+    return 0;
+}
+
+/* 16 candidate positions per step: only those where both the first and the
+   last byte of pat match get a full compare */
+SIMD_FN("sse2") static const char *memmem_sse2(const char *hay, uint32_t hlen, const char *pat, uint32_t plen) {
+    const v16u8 first = (v16u8){0} + (uint8_t)pat[0], last = (v16u8){0} + (uint8_t)pat[plen - 1];
+    uint32_t i = 0;
+    for (; i + plen - 1 + 16 <= hlen; i += 16) {
+        v16u8 a, b;
+        __builtin_memcpy(&a, hay + i, 16);
+        __builtin_memcpy(&b, hay + i + plen - 1, 16);
+        uint32_t mask = (uint32_t)__builtin_ia32_pmovmskb128((v16i8)((a == first) & (b == last)));
+        while (mask) {
+            uint32_t bit = (uint32_t)__builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pat + 1, plen - 1) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return memmem_generic(hay + i, hlen - i, pat, plen);
+}
+
+static const char *(*kmemmem)(const char *hay, uint32_t hlen, const char *pat, uint32_t plen) = memmem_generic;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+    __asm__ volatile ("wrmsr" :: "c"(msr), "a"((uint32_t)v), "d"((uint32_t)(v >> 32)));
+}
+
+/* --- CPU features ---
+   Probed once at boot into a bitmap; cpu_has() is what the rest of the
+   kernel asks. SSE is switched on in CR0/CR4 here when the CPU has it, so
+   the SSE feature bits mean "usable", not just "present". */
+enum {
+    CPUF_BASE,  /* always set: the baseline variant of a code path */
+    CPUF_FPU, CPUF_TSC, CPUF_CX8, CPUF_APIC, CPUF_CMOV, CPUF_CLFLUSH, CPUF_MMX, CPUF_FXSR,
+    CPUF_SSE, CPUF_SSE2, CPUF_HTT, CPUF_SSE3, CPUF_PCLMUL, CPUF_SSSE3, CPUF_CX16, CPUF_SSE41,
+    CPUF_SSE42, CPUF_X2APIC, CPUF_MOVBE, CPUF_POPCNT, CPUF_AES, CPUF_XSAVE, CPUF_AVX, CPUF_RDRAND,
+    CPUF_HYPERVISOR, CPUF_BMI1, CPUF_AVX2, CPUF_BMI2, CPUF_ERMS, CPUF_FSRM, CPUF_NX, CPUF_LM,
+    CPUF_INVTSC,
+    CPUF_COUNT
+};
+
+static const char *const cpu_feature_names[CPUF_COUNT] = {
+    "", "fpu", "tsc", "cx8", "apic", "cmov", "clflush", "mmx", "fxsr",
+    "sse", "sse2", "htt", "sse3", "pclmul", "ssse3", "cx16", "sse4.1",
+    "sse4.2", "x2apic", "movbe", "popcnt", "aes", "xsave", "avx", "rdrand",
+    "hypervisor", "bmi1", "avx2", "bmi2", "erms", "fsrm", "nx", "lm",
+    "invtsc",
+};
+
+static uint32_t cpu_features[(CPUF_COUNT + 31) / 32];
+static char cpu_vendor[13];
+static char cpu_brand[49];
+static uint32_t cpu_family, cpu_model, cpu_stepping;
+
+static int cpu_has(int f) { return (cpu_features[f / 32] >> (f % 32)) & 1; }
+
+static void cpu_set(int f, uint32_t reg, int bit) {
+    if ((reg >> bit) & 1) cpu_features[f / 32] |= 1u << (f % 32);
+}
+
+/* CPUID returns strings as little-endian register contents */
+static void cpu_regs_str(char *dst, const uint32_t *regs, int n) {
+    for (int i = 0; i < n * 4; ++i) dst[i] = (char)(regs[i / 4] >> (8 * (i % 4)));
+}
+
+/* The ID flag in EFLAGS can only be toggled if CPUID exists (486 and later) */
+static int cpuid_present(void) {
+#ifdef __x86_64__
+    return 1;
+#else
+    uint32_t a, b;
+    __asm__ volatile ("pushfl\n\tpushfl\n\tpopl %0\n\tmovl %0, %1\n\txorl $0x200000, %0\n\tpushl %0\n\tpopfl\n\t"
+                      "pushfl\n\tpopl %0\n\tpopfl" : "=&r"(a), "=&r"(b));
+    return ((a ^ b) & 0x200000) != 0;
+#endif
+}
+
+/* read by the interrupt stubs: nonzero once FXSAVE/SSE is enabled */
+uint8_t irq_fxsave = 0;
+
+static void cpu_probe(void) {
+    cpu_features[0] = 1u << CPUF_BASE;
+    if (!cpuid_present()) return;
+    uint32_t a, b, c, d, max;
+    cpuid(0, &max, &b, &c, &d);
+    const uint32_t vendor[3] = { b, d, c };
+    cpu_regs_str(cpu_vendor, vendor, 3);
+    if (max >= 1) {
+        cpuid(1, &a, &b, &c, &d);
+        cpu_family = (a >> 8) & 0xF;
+        cpu_model = (a >> 4) & 0xF;
+        cpu_stepping = a & 0xF;
+        if (cpu_family == 0xF) cpu_family += (a >> 20) & 0xFF;
+        if (cpu_family >= 6) cpu_model |= ((a >> 16) & 0xF) << 4;
+        cpu_set(CPUF_FPU, d, 0); cpu_set(CPUF_TSC, d, 4); cpu_set(CPUF_CX8, d, 8); cpu_set(CPUF_APIC, d, 9);
+        cpu_set(CPUF_CMOV, d, 15); cpu_set(CPUF_CLFLUSH, d, 19); cpu_set(CPUF_MMX, d, 23); cpu_set(CPUF_FXSR, d, 24);
+        cpu_set(CPUF_SSE, d, 25); cpu_set(CPUF_SSE2, d, 26); cpu_set(CPUF_HTT, d, 28);
+        cpu_set(CPUF_SSE3, c, 0); cpu_set(CPUF_PCLMUL, c, 1); cpu_set(CPUF_SSSE3, c, 9); cpu_set(CPUF_CX16, c, 13);
+        cpu_set(CPUF_SSE41, c, 19); cpu_set(CPUF_SSE42, c, 20); cpu_set(CPUF_X2APIC, c, 21); cpu_set(CPUF_MOVBE, c, 22);
+        cpu_set(CPUF_POPCNT, c, 23); cpu_set(CPUF_AES, c, 25); cpu_set(CPUF_XSAVE, c, 26); cpu_set(CPUF_AVX, c, 28);
+        cpu_set(CPUF_RDRAND, c, 30); cpu_set(CPUF_HYPERVISOR, c, 31);
+    }
+    if (max >= 7) {
+        cpuid(7, &a, &b, &c, &d);
+        cpu_set(CPUF_BMI1, b, 3); cpu_set(CPUF_AVX2, b, 5); cpu_set(CPUF_BMI2, b, 8); cpu_set(CPUF_ERMS, b, 9);
+        cpu_set(CPUF_FSRM, d, 4);
+    }
+    cpuid(0x80000000, &max, &b, &c, &d);
+    if (max >= 0x80000001) {
+        cpuid(0x80000001, &a, &b, &c, &d);
+        cpu_set(CPUF_NX, d, 20); cpu_set(CPUF_LM, d, 29);
+    }
+    if (max >= 0x80000004) {
+        uint32_t w[12];
+        for (uint32_t leaf = 0; leaf < 3; ++leaf) cpuid(0x80000002 + leaf, &w[leaf * 4], &w[leaf * 4 + 1], &w[leaf * 4 + 2], &w[leaf * 4 + 3]);
+        cpu_regs_str(cpu_brand, w, 12);
+    }
+    if (max >= 0x80000007) {
+        cpuid(0x80000007, &a, &b, &c, &d);
+        cpu_set(CPUF_INVTSC, d, 8);
+    }
+    /* SSE needs FXSAVE support to be enabled (the interrupt stubs then
+       save the XMM registers too); AVX state (XCR0) is never
+       enabled, so the AVX bits only say what the CPU has */
+    if (cpu_has(CPUF_FXSR) && cpu_has(CPUF_SSE)) {
+        uintptr_t cr0, cr4;
+        __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+        cr0 = (cr0 & ~(uintptr_t)(1 << 2)) | (1 << 1); /* no x87 emulation, monitor coprocessor */
+        __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
+        __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= (1 << 9) | (1 << 10); /* OSFXSR, OSXMMEXCPT */
+        __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+        irq_fxsave = 1;
+    } else {
+        static const uint8_t sse[] = { CPUF_SSE, CPUF_SSE2, CPUF_SSE3, CPUF_SSSE3, CPUF_SSE41, CPUF_SSE42 };
+        for (uint32_t i = 0; i < sizeof(sse); ++i) cpu_features[sse[i] / 32] &= ~(1u << (sse[i] % 32));
+    }
+}
+
+/* 64-by-32 division; the i386 kernel is linked without libgcc's __udivdi3 */
+static uint64_t div64_32(uint64_t n, uint32_t d) {
+#ifdef __x86_64__
+    return n / d;
+#else
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t qhi = hi / d, r = hi % d, qlo;
+    __asm__ ("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)qhi << 32) | qlo;
+#endif
+}
+
+/* --- Multiboot --- */
+#define MULTIBOOT_MAGIC 0x2BADB002
+#define MB_INFO_MEMORY (1 << 0)
+#define MB_INFO_CMDLINE (1 << 2)
+#define MB_INFO_MODS (1 << 3)
+#define MB_INFO_FRAMEBUFFER (1 << 12)
+#define MB_FB_TYPE_RGB 1
+
+struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower, mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count, mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length, mmap_addr;
+    uint32_t drives_length, drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info, vbe_mode_info;
+    uint16_t vbe_mode, vbe_interface_seg, vbe_interface_off, vbe_interface_len;
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch, framebuffer_width, framebuffer_height;
+    uint8_t framebuffer_bpp, framebuffer_type;
+    uint8_t red_pos, red_size, green_pos, green_size, blue_pos, blue_size;
+} __attribute__((packed));
+
+struct multiboot_module {
+    uint32_t mod_start, mod_end;
+    uint32_t string;
+    uint32_t reserved;
+};
+
+/* --- Kernel memory ---
+   A bump allocator over the RAM above the kernel image, for tables sized
+   at boot from the tunables. Nothing is freed. The boot loader may have
+   put the Multiboot structures there, so allocation starts above them. */
+extern char __kernel_end[]; /* linker script */
+static uintptr_t kmem_start, kmem_next, kmem_limit;
+
+static void kprintf(const char *fmt, ...);
+
+static void kmem_reserve(uintptr_t end) {
+    if (end > kmem_next) kmem_next = (end + 15) & ~(uintptr_t)15;
+}
+
+static void kmem_init(const struct multiboot_info *mbi) {
+    kmem_next = (uintptr_t)__kernel_end;
+    kmem_limit = 16u << 20; /* no memory size from the loader: assume 16 MiB */
+    if (mbi) {
+        if (mbi->flags & MB_INFO_MEMORY) {
+            uint64_t top = 0x100000 + (uint64_t)mbi->mem_upper * 1024;
+            kmem_limit = top > 0xFFFFF000u ? 0xFFFFF000u : (uintptr_t)top;
+        }
+        kmem_reserve((uintptr_t)mbi + sizeof(*mbi));
+        if (mbi->flags & MB_INFO_MODS) {
+            const struct multiboot_module *m = (const struct multiboot_module *)(uintptr_t)mbi->mods_addr;
+            kmem_reserve((uintptr_t)(m + mbi->mods_count));
+            for (uint32_t i = 0; i < mbi->mods_count; ++i) kmem_reserve(m[i].mod_end);
+        }
+    }
+    kmem_start = kmem_next;
+}
+
+/* Zeroed, 16-byte aligned. Running out at boot means the command line asked
+   for more than the machine has, and there is nothing sensible to fall back to. */
+static void *kmem_alloc(uint32_t size, const char *what) {
+    uintptr_t p = kmem_next;
+    if (p > kmem_limit || size > kmem_limit - p) {
+        kprintf("kmem: no room for %s (%u bytes, %u free); lower it on the kernel command line\n",
+                what, size, (uint32_t)(p < kmem_limit ? kmem_limit - p : 0));
+        for (;;) __asm__ volatile ("cli; hlt");
+    }
+    kmem_next = (p + size + 15) & ~(uintptr_t)15;
+    memset((void *)p, 0, size);
+    return (void *)p;
+}
+
+/* Console displays.
+   The console is a grid of con_cols x con_rows cells (VGA attribute byte
+   in the high half, character in the low half). A display draws that grid:
+   either VGA text memory or a linear framebuffer set up by the boot loader. */
+#define CON_MAX_COLS 160
+#define CON_MAX_ROWS 64
+static int con_cols = 80;
+static int con_rows = 25;
+
+struct con_display {
+    void (*span)(int row, int col, const uint16_t *cells, int n);
+    void (*scroll)(const uint16_t *last); /* move everything up a row, then draw the new last row */
+    void (*cursor)(int row, int col);     /* row < 0 hides it */
+};
+
 /* VGA text mode */
-enum { VGA_WIDTH = 80, VGA_HEIGHT = 25 };
 static uint16_t *vga_buffer = (uint16_t *)0xB8000;
-static uint8_t term_row = 0;
-static uint8_t term_col = 0;
-static uint8_t term_color = 0x07; /* light gray on black */
 
-static void update_cursor(void) {
-    uint16_t pos = term_row * VGA_WIDTH + term_col;
+static void vga_span(int row, int col, const uint16_t *cells, int n) {
+    memcpy(&vga_buffer[row * con_cols + col], cells, n * 2);
+}
+
+static void vga_scroll_up(const uint16_t *last) {
+    memmove(vga_buffer, vga_buffer + con_cols, (con_rows - 1) * con_cols * 2);
+    vga_span(con_rows - 1, 0, last, con_cols);
+}
+
+static void vga_cursor(int row, int col) {
+    /* park the hardware cursor off screen to hide it */
+    uint16_t pos = row < 0 ? con_rows * con_cols : row * con_cols + col;
     outb(0x3D4, 0x0F);
     outb(0x3D5, (uint8_t)(pos & 0xFF));
     outb(0x3D4, 0x0E);
     outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
 }
 
-static void vga_putat(char c, uint8_t color, uint8_t row, uint8_t col) {
-    const uint16_t idx = row * VGA_WIDTH + col;
-    vga_buffer[idx] = (uint16_t)c | ((uint16_t)color << 8);
+static const struct con_display vga_display = { vga_span, vga_scroll_up, vga_cursor };
+static const struct con_display *con_display = &vga_display;
+
+/* Linear framebuffer.
+   Glyphs come from a built-in 8x8 font drawn at double height in 8x16
+   cells. They are rasterized once per colour pair straight into the
+   framebuffer's pixel format, so drawing a text row is a run of 32-bit
+   copies per scanline and scrolling is one memmove of the whole screen. */
+#define FONT_W 8
+#define FONT_H 16
+#define FB_CACHE_SLOTS 4 /* colour pairs with rasterized glyphs */
+#define FB_GLYPHS 96     /* ' '..'~' plus a box for anything else */
+
+static const uint8_t font8x8[95][8] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* space */
+    {0x30, 0x30, 0x30, 0x30, 0x30, 0x00, 0x30, 0x00}, /* '!' */
+    {0x6C, 0x6C, 0x48, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '"' */
+    {0x6C, 0x6C, 0xFE, 0x6C, 0xFE, 0x6C, 0x6C, 0x00}, /* '#' */
+    {0x10, 0x7C, 0x90, 0x78, 0x14, 0xF8, 0x10, 0x00}, /* '$' */
+    {0xC2, 0xC4, 0x08, 0x10, 0x20, 0x46, 0x86, 0x00}, /* '%' */
+    {0x30, 0x48, 0x30, 0x74, 0x88, 0x8C, 0x72, 0x00}, /* '&' */
+    {0x30, 0x30, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00}, /* ''' */
+    {0x18, 0x30, 0x60, 0x60, 0x60, 0x30, 0x18, 0x00}, /* '(' */
+    {0x60, 0x30, 0x18, 0x18, 0x18, 0x30, 0x60, 0x00}, /* ')' */
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, /* '*' */
+    {0x00, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x00, 0x00}, /* '+' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x30}, /* ',' */
+    {0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x00}, /* '-' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00}, /* '.' */
+    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x00}, /* '/' */
+    {0x7C, 0xC6, 0xCE, 0xDE, 0xF6, 0xE6, 0x7C, 0x00}, /* '0' */
+    {0x18, 0x38, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00}, /* '1' */
+    {0x7C, 0xC6, 0x06, 0x1C, 0x70, 0xC0, 0xFE, 0x00}, /* '2' */
+    {0x7C, 0xC6, 0x06, 0x3C, 0x06, 0xC6, 0x7C, 0x00}, /* '3' */
+    {0x0E, 0x1E, 0x36, 0x66, 0xFE, 0x06, 0x06, 0x00}, /* '4' */
+    {0xFE, 0xC0, 0xFC, 0x06, 0x06, 0xC6, 0x7C, 0x00}, /* '5' */
+    {0x3C, 0x60, 0xC0, 0xFC, 0xC6, 0xC6, 0x7C, 0x00}, /* '6' */
+    {0xFE, 0x06, 0x0C, 0x18, 0x30, 0x30, 0x30, 0x00}, /* '7' */
+    {0x7C, 0xC6, 0xC6, 0x7C, 0xC6, 0xC6, 0x7C, 0x00}, /* '8' */
+    {0x7C, 0xC6, 0xC6, 0x7E, 0x06, 0x0C, 0x78, 0x00}, /* '9' */
+    {0x00, 0x18, 0x18, 0x00, 0x00, 0x18, 0x18, 0x00}, /* ':' */
+    {0x00, 0x18, 0x18, 0x00, 0x00, 0x18, 0x18, 0x30}, /* ';' */
+    {0x0C, 0x18, 0x30, 0x60, 0x30, 0x18, 0x0C, 0x00}, /* '<' */
+    {0x00, 0x00, 0x7E, 0x00, 0x7E, 0x00, 0x00, 0x00}, /* '=' */
+    {0x60, 0x30, 0x18, 0x0C, 0x18, 0x30, 0x60, 0x00}, /* '>' */
+    {0x7C, 0xC6, 0x06, 0x1C, 0x18, 0x00, 0x18, 0x00}, /* '?' */
+    {0x7C, 0xC6, 0xDE, 0xDE, 0xDC, 0xC0, 0x7C, 0x00}, /* '@' */
+    {0x38, 0x6C, 0xC6, 0xC6, 0xFE, 0xC6, 0xC6, 0x00}, /* 'A' */
+    {0xFC, 0xC6, 0xC6, 0xFC, 0xC6, 0xC6, 0xFC, 0x00}, /* 'B' */
+    {0x7C, 0xC6, 0xC0, 0xC0, 0xC0, 0xC6, 0x7C, 0x00}, /* 'C' */
+    {0xF8, 0xCC, 0xC6, 0xC6, 0xC6, 0xCC, 0xF8, 0x00}, /* 'D' */
+    {0xFE, 0xC0, 0xC0, 0xF8, 0xC0, 0xC0, 0xFE, 0x00}, /* 'E' */
+    {0xFE, 0xC0, 0xC0, 0xF8, 0xC0, 0xC0, 0xC0, 0x00}, /* 'F' */
+    {0x7C, 0xC6, 0xC0, 0xDE, 0xC6, 0xC6, 0x7E, 0x00}, /* 'G' */
+    {0xC6, 0xC6, 0xC6, 0xFE, 0xC6, 0xC6, 0xC6, 0x00}, /* 'H' */
+    {0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00}, /* 'I' */
+    {0x1E, 0x06, 0x06, 0x06, 0xC6, 0xC6, 0x7C, 0x00}, /* 'J' */
+    {0xC6, 0xCC, 0xD8, 0xF0, 0xD8, 0xCC, 0xC6, 0x00}, /* 'K' */
+    {0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xFE, 0x00}, /* 'L' */
+    {0xC6, 0xEE, 0xFE, 0xD6, 0xC6, 0xC6, 0xC6, 0x00}, /* 'M' */
+    {0xC6, 0xE6, 0xF6, 0xDE, 0xCE, 0xC6, 0xC6, 0x00}, /* 'N' */
+    {0x7C, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00}, /* 'O' */
+    {0xFC, 0xC6, 0xC6, 0xFC, 0xC0, 0xC0, 0xC0, 0x00}, /* 'P' */
+    {0x7C, 0xC6, 0xC6, 0xC6, 0xD6, 0xCC, 0x76, 0x00}, /* 'Q' */
+    {0xFC, 0xC6, 0xC6, 0xFC, 0xD8, 0xCC, 0xC6, 0x00}, /* 'R' */
+    {0x7C, 0xC6, 0xC0, 0x7C, 0x06, 0xC6, 0x7C, 0x00}, /* 'S' */
+    {0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00}, /* 'T' */
+    {0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00}, /* 'U' */
+    {0xC6, 0xC6, 0xC6, 0xC6, 0x6C, 0x38, 0x10, 0x00}, /* 'V' */
+    {0xC6, 0xC6, 0xC6, 0xD6, 0xFE, 0xEE, 0xC6, 0x00}, /* 'W' */
+    {0xC6, 0xC6, 0x6C, 0x38, 0x6C, 0xC6, 0xC6, 0x00}, /* 'X' */
+    {0x66, 0x66, 0x66, 0x3C, 0x18, 0x18, 0x18, 0x00}, /* 'Y' */
+    {0xFE, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFE, 0x00}, /* 'Z' */
+    {0x78, 0x60, 0x60, 0x60, 0x60, 0x60, 0x78, 0x00}, /* '[' */
+    {0xC0, 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x00}, /* '\' */
+    {0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0x78, 0x00}, /* ']' */
+    {0x10, 0x38, 0x6C, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* '^' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, /* '_' */
+    {0x30, 0x18, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '`' */
+    {0x00, 0x00, 0x7C, 0x06, 0x7E, 0xC6, 0x7E, 0x00}, /* 'a' */
+    {0xC0, 0xC0, 0xFC, 0xC6, 0xC6, 0xC6, 0xFC, 0x00}, /* 'b' */
+    {0x00, 0x00, 0x7C, 0xC0, 0xC0, 0xC6, 0x7C, 0x00}, /* 'c' */
+    {0x06, 0x06, 0x7E, 0xC6, 0xC6, 0xC6, 0x7E, 0x00}, /* 'd' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xFE, 0xC0, 0x7C, 0x00}, /* 'e' */
+    {0x1C, 0x30, 0x7C, 0x30, 0x30, 0x30, 0x30, 0x00}, /* 'f' */
+    {0x00, 0x00, 0x7E, 0xC6, 0xC6, 0x7E, 0x06, 0x7C}, /* 'g' */
+    {0xC0, 0xC0, 0xFC, 0xC6, 0xC6, 0xC6, 0xC6, 0x00}, /* 'h' */
+    {0x18, 0x00, 0x38, 0x18, 0x18, 0x18, 0x3C, 0x00}, /* 'i' */
+    {0x06, 0x00, 0x0E, 0x06, 0x06, 0x06, 0xC6, 0x7C}, /* 'j' */
+    {0xC0, 0xC0, 0xCC, 0xD8, 0xF0, 0xD8, 0xCC, 0x00}, /* 'k' */
+    {0x38, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00}, /* 'l' */
+    {0x00, 0x00, 0xD8, 0xFE, 0xD6, 0xD6, 0xC6, 0x00}, /* 'm' */
+    {0x00, 0x00, 0xFC, 0xC6, 0xC6, 0xC6, 0xC6, 0x00}, /* 'n' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xC6, 0x7C, 0x00}, /* 'o' */
+    {0x00, 0x00, 0xFC, 0xC6, 0xC6, 0xFC, 0xC0, 0xC0}, /* 'p' */
+    {0x00, 0x00, 0x7E, 0xC6, 0xC6, 0x7E, 0x06, 0x06}, /* 'q' */
+    {0x00, 0x00, 0xDC, 0xE0, 0xC0, 0xC0, 0xC0, 0x00}, /* 'r' */
+    {0x00, 0x00, 0x7E, 0xC0, 0x7C, 0x06, 0xFC, 0x00}, /* 's' */
+    {0x30, 0x30, 0x7C, 0x30, 0x30, 0x30, 0x1C, 0x00}, /* 't' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0xC6, 0x7E, 0x00}, /* 'u' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0x6C, 0x38, 0x00}, /* 'v' */
+    {0x00, 0x00, 0xC6, 0xD6, 0xD6, 0xFE, 0x6C, 0x00}, /* 'w' */
+    {0x00, 0x00, 0xC6, 0x6C, 0x38, 0x6C, 0xC6, 0x00}, /* 'x' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0x7E, 0x06, 0x7C}, /* 'y' */
+    {0x00, 0x00, 0xFE, 0x0C, 0x38, 0x60, 0xFE, 0x00}, /* 'z' */
+    {0x0E, 0x18, 0x18, 0x70, 0x18, 0x18, 0x0E, 0x00}, /* '{' */
+    {0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00}, /* '|' */
+    {0x70, 0x18, 0x18, 0x0E, 0x18, 0x18, 0x70, 0x00}, /* '}' */
+    {0x76, 0xDC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '~' */
+};
+
+static uint8_t *fb_base;
+static uint32_t fb_pitch, fb_width, fb_height, fb_bytespp;
+static uint32_t fb_palette[16]; /* VGA colours in framebuffer pixel format */
+static uint32_t fb_glyph_dwords; /* one glyph scanline, in 32-bit words */
+static uint32_t fb_glyphs[FB_CACHE_SLOTS][FB_GLYPHS][FONT_H][FONT_W]; /* sized for 32 bpp */
+static int fb_slot_attr[FB_CACHE_SLOTS] = { -1, -1, -1, -1 };
+static int fb_slot_next = 0;
+static uint32_t fb_rasterized = 0; /* glyph sets built so far */
+static int fb_cur_row = -1, fb_cur_col = 0; /* where the cursor underline is drawn */
+
+static const uint8_t vga_rgb[16][3] = {
+    {0x00,0x00,0x00}, {0x00,0x00,0xAA}, {0x00,0xAA,0x00}, {0x00,0xAA,0xAA},
+    {0xAA,0x00,0x00}, {0xAA,0x00,0xAA}, {0xAA,0x55,0x00}, {0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55}, {0x55,0x55,0xFF}, {0x55,0xFF,0x55}, {0x55,0xFF,0xFF},
+    {0xFF,0x55,0x55}, {0xFF,0x55,0xFF}, {0xFF,0xFF,0x55}, {0xFF,0xFF,0xFF},
+};
+
+static void fb_store_pixel(uint8_t *p, uint32_t px) {
+    for (uint32_t i = 0; i < fb_bytespp; ++i) p[i] = (uint8_t)(px >> (8 * i));
+}
+
+/* Rasterize every glyph in one colour pair into a cache slot */
+static int fb_slot_for(uint8_t attr) {
+    for (int s = 0; s < FB_CACHE_SLOTS; ++s) if (fb_slot_attr[s] == attr) return s;
+    int s = fb_slot_next;
+    fb_slot_next = (fb_slot_next + 1) % FB_CACHE_SLOTS;
+    uint32_t fg = fb_palette[attr & 0x0F], bg = fb_palette[attr >> 4];
+    for (int g = 0; g < FB_GLYPHS; ++g) {
+        for (int y = 0; y < FONT_H; ++y) {
+            uint8_t bits;
+            if (g < 95) bits = font8x8[g][y / 2];
+            else bits = (y == 1 || y == FONT_H - 3) ? 0x7E : (y > 1 && y < FONT_H - 3) ? 0x42 : 0;
+            uint8_t *p = (uint8_t *)fb_glyphs[s][g][y];
+            for (int x = 0; x < FONT_W; ++x, p += fb_bytespp) fb_store_pixel(p, (bits & (0x80 >> x)) ? fg : bg);
+        }
+    }
+    fb_slot_attr[s] = attr;
+    ++fb_rasterized;
+    return s;
+}
+
+static const uint32_t *fb_glyph(uint16_t cell) {
+    static int last_attr = -1, last_slot;
+    int attr = cell >> 8;
+    if (attr != last_attr) { last_slot = fb_slot_for((uint8_t)attr); last_attr = attr; }
+    uint8_t ch = (uint8_t)cell;
+    int g = (ch >= 32 && ch < 127) ? ch - 32 : FB_GLYPHS - 1;
+    return fb_glyphs[last_slot][g][0];
+}
+
+static void fb_copy_row(uint32_t *dst, const uint32_t *src) {
+    for (uint32_t i = 0; i < fb_glyph_dwords; ++i) dst[i] = src[i];
+}
+
+/* Flip the two underline scanlines of a cell */
+static void fb_invert_cursor(int row, int col) {
+    for (int y = FONT_H - 2; y < FONT_H; ++y) {
+        uint32_t *p = (uint32_t *)(fb_base + (row * FONT_H + y) * fb_pitch + col * FONT_W * fb_bytespp);
+        for (uint32_t i = 0; i < fb_glyph_dwords; ++i) p[i] ^= 0xFFFFFFFF;
+    }
+}
+
+static void fb_hide_cursor(void) {
+    if (fb_cur_row >= 0) fb_invert_cursor(fb_cur_row, fb_cur_col);
+    fb_cur_row = -1;
+}
+
+/* Draw a run of cells on one text row, scanline by scanline */
+static void fb_span(int row, int col, const uint16_t *cells, int n) {
+    const uint32_t *glyph[CON_MAX_COLS];
+    if (row == fb_cur_row && fb_cur_col >= col && fb_cur_col < col + n) fb_cur_row = -1; /* the redraw erases it */
+    /* a run with more colour pairs than cache slots can evict glyphs gathered
+       earlier in it; gather again, and draw cell by cell if that still happens */
+    for (int pass = 0; ; ++pass) {
+        uint32_t built = fb_rasterized;
+        for (int c = 0; c < n; ++c) glyph[c] = fb_glyph(cells[c]);
+        if (built == fb_rasterized) break;
+        if (pass) {
+            for (int c = 0; c < n; ++c) fb_span(row, col + c, &cells[c], 1);
+            return;
+        }
+    }
+    uint32_t cell_stride = FONT_W * fb_bytespp / 4;
+    uint8_t *line = fb_base + row * FONT_H * fb_pitch + col * FONT_W * fb_bytespp;
+    for (int y = 0; y < FONT_H; ++y, line += fb_pitch) {
+        uint32_t *dst = (uint32_t *)line;
+        for (int c = 0; c < n; ++c, dst += cell_stride) fb_copy_row(dst, glyph[c] + y * FONT_W);
+    }
+}
+
+static void fb_scroll_up(const uint16_t *last) {
+    fb_hide_cursor();
+    memmove(fb_base, fb_base + FONT_H * fb_pitch, (con_rows - 1) * FONT_H * fb_pitch);
+    fb_span(con_rows - 1, 0, last, con_cols);
+}
+
+static void fb_cursor(int row, int col) {
+    if (row == fb_cur_row && col == fb_cur_col) return;
+    fb_hide_cursor();
+    if (row < 0) return;
+    fb_invert_cursor(row, col);
+    fb_cur_row = row;
+    fb_cur_col = col;
+}
+
+static const struct con_display fb_display = { fb_span, fb_scroll_up, fb_cursor };
+
+static uint32_t fb_pack(uint8_t v, uint8_t pos, uint8_t size) {
+    return ((uint32_t)v >> (8 - size)) << pos;
+}
+
+/* Switch the console to the boot loader's framebuffer, if it gave us an RGB one */
+static int fb_init(const struct multiboot_info *mbi) {
+    if (!mbi || !(mbi->flags & MB_INFO_FRAMEBUFFER) || mbi->framebuffer_type != MB_FB_TYPE_RGB) return -1;
+    if (mbi->framebuffer_addr >> 32) return -1;
+    uint32_t bpp = mbi->framebuffer_bpp;
+    if (bpp != 16 && bpp != 24 && bpp != 32) return -1;
+    fb_base = (uint8_t *)(uintptr_t)mbi->framebuffer_addr;
+    fb_pitch = mbi->framebuffer_pitch;
+    fb_width = mbi->framebuffer_width;
+    fb_height = mbi->framebuffer_height;
+    fb_bytespp = bpp / 8;
+    fb_glyph_dwords = FONT_W * fb_bytespp / 4;
+    for (int i = 0; i < 16; ++i)
+        fb_palette[i] = fb_pack(vga_rgb[i][0], mbi->red_pos, mbi->red_size)
+                      | fb_pack(vga_rgb[i][1], mbi->green_pos, mbi->green_size)
+                      | fb_pack(vga_rgb[i][2], mbi->blue_pos, mbi->blue_size);
+    con_cols = fb_width / FONT_W;
+    con_rows = fb_height / FONT_H;
+    if (con_cols > CON_MAX_COLS) con_cols = CON_MAX_COLS;
+    if (con_rows > CON_MAX_ROWS) con_rows = CON_MAX_ROWS;
+    con_display = &fb_display;
+    return 0;
+}
+
+/* VT100/ANSI escape sequences.
+   One table-driven parser serves the terminals' output and the serial
+   console's input: each byte is classified, and (state, class) gives the
+   next state plus what to do with the byte. The parser only collects CSI
+   parameters; acting on a sequence is up to the caller. */
+#define VTP_MAX_PARAMS 8
+
+enum { VTP_GROUND, VTP_ESC, VTP_CSI, VTP_CSI_IGNORE, VTP_STATES };
+enum { CC_CTRL, CC_ESC, CC_PRINT, CC_INTER, CC_DIGIT, CC_SEMI, CC_PRIV, CC_LBRACKET, CC_FINAL, CC_DEL, CC_CLASSES };
+enum { VTA_NONE, VTA_PRINT, VTA_EXEC, VTA_CSI_START, VTA_PARAM, VTA_SEP, VTA_PRIVATE, VTA_DISPATCH, VTA_ESC_DISPATCH };
+
+struct vtp_entry { uint8_t next, action; };
+
+static const struct vtp_entry vtp_table[VTP_STATES][CC_CLASSES] = {
+    [VTP_GROUND] = {
+        [CC_CTRL] = { VTP_GROUND, VTA_EXEC },      [CC_ESC] = { VTP_ESC, VTA_NONE },
+        [CC_PRINT] = { VTP_GROUND, VTA_PRINT },    [CC_INTER] = { VTP_GROUND, VTA_PRINT },
+        [CC_DIGIT] = { VTP_GROUND, VTA_PRINT },    [CC_SEMI] = { VTP_GROUND, VTA_PRINT },
+        [CC_PRIV] = { VTP_GROUND, VTA_PRINT },     [CC_LBRACKET] = { VTP_GROUND, VTA_PRINT },
+        [CC_FINAL] = { VTP_GROUND, VTA_PRINT },    [CC_DEL] = { VTP_GROUND, VTA_NONE },
+    },
+    [VTP_ESC] = {
+        [CC_CTRL] = { VTP_ESC, VTA_EXEC },         [CC_ESC] = { VTP_ESC, VTA_NONE },
+        [CC_PRINT] = { VTP_GROUND, VTA_NONE },     [CC_INTER] = { VTP_GROUND, VTA_NONE },
+        [CC_DIGIT] = { VTP_GROUND, VTA_ESC_DISPATCH }, [CC_SEMI] = { VTP_GROUND, VTA_NONE },
+        [CC_PRIV] = { VTP_GROUND, VTA_NONE },      [CC_LBRACKET] = { VTP_CSI, VTA_CSI_START },
+        [CC_FINAL] = { VTP_GROUND, VTA_ESC_DISPATCH }, [CC_DEL] = { VTP_ESC, VTA_NONE },
+    },
+    [VTP_CSI] = {
+        [CC_CTRL] = { VTP_CSI, VTA_EXEC },         [CC_ESC] = { VTP_ESC, VTA_NONE },
+        [CC_PRINT] = { VTP_CSI_IGNORE, VTA_NONE }, [CC_INTER] = { VTP_CSI_IGNORE, VTA_NONE },
+        [CC_DIGIT] = { VTP_CSI, VTA_PARAM },       [CC_SEMI] = { VTP_CSI, VTA_SEP },
+        [CC_PRIV] = { VTP_CSI, VTA_PRIVATE },      [CC_LBRACKET] = { VTP_GROUND, VTA_DISPATCH },
+        [CC_FINAL] = { VTP_GROUND, VTA_DISPATCH }, [CC_DEL] = { VTP_CSI, VTA_NONE },
+    },
+    [VTP_CSI_IGNORE] = {
+        [CC_CTRL] = { VTP_CSI_IGNORE, VTA_EXEC },  [CC_ESC] = { VTP_ESC, VTA_NONE },
+        [CC_PRINT] = { VTP_CSI_IGNORE, VTA_NONE }, [CC_INTER] = { VTP_CSI_IGNORE, VTA_NONE },
+        [CC_DIGIT] = { VTP_CSI_IGNORE, VTA_NONE }, [CC_SEMI] = { VTP_CSI_IGNORE, VTA_NONE },
+        [CC_PRIV] = { VTP_CSI_IGNORE, VTA_NONE },  [CC_LBRACKET] = { VTP_GROUND, VTA_NONE },
+        [CC_FINAL] = { VTP_GROUND, VTA_NONE },     [CC_DEL] = { VTP_CSI_IGNORE, VTA_NONE },
+    },
+};
+
+static uint8_t vtp_classes[256];
+
+static void vtp_init(void) {
+    for (int c = 0; c < 256; ++c) {
+        uint8_t k;
+        if (c == 0x1B) k = CC_ESC;
+        else if (c < 0x20) k = CC_CTRL;
+        else if (c == 0x7F) k = CC_DEL;
+        else if (c >= 0x80) k = CC_PRINT;
+        else if (c < 0x30 || c == ':') k = CC_INTER;
+        else if (c <= '9') k = CC_DIGIT;
+        else if (c == ';') k = CC_SEMI;
+        else if (c < 0x40) k = CC_PRIV;
+        else if (c == '[') k = CC_LBRACKET;
+        else k = CC_FINAL;
+        vtp_classes[c] = k;
+    }
+}
+
+struct vt_parser {
+    uint8_t state;
+    uint8_t priv;    /* private marker ('?' etc.), 0 if none */
+    uint8_t nparams; /* index of the parameter being collected */
+    uint16_t params[VTP_MAX_PARAMS];
+};
+
+/* Feed one byte; returns the action left for the caller (PRINT, EXEC, DISPATCH, ESC_DISPATCH or NONE) */
+static uint8_t vtp_feed(struct vt_parser *p, uint8_t c) {
+    const struct vtp_entry e = vtp_table[p->state][vtp_classes[c]];
+    p->state = e.next;
+    switch (e.action) {
+    case VTA_CSI_START:
+        p->priv = 0; p->nparams = 0; p->params[0] = 0;
+        return VTA_NONE;
+    case VTA_PARAM:
+        if (p->nparams < VTP_MAX_PARAMS && p->params[p->nparams] < 10000) p->params[p->nparams] = p->params[p->nparams] * 10 + (c - '0');
+        return VTA_NONE;
+    case VTA_SEP:
+        if (p->nparams < VTP_MAX_PARAMS) ++p->nparams;
+        if (p->nparams < VTP_MAX_PARAMS) p->params[p->nparams] = 0;
+        return VTA_NONE;
+    case VTA_PRIVATE:
+        p->priv = c;
+        return VTA_NONE;
+    default:
+        return e.action;
+    }
+}
+
+/* Parameter i of the last CSI sequence; 0 or missing means the default */
+static uint32_t vtp_param(const struct vt_parser *p, int i, uint32_t def) {
+    if (i > p->nparams || i >= VTP_MAX_PARAMS || !p->params[i]) return def;
+    return p->params[i];
+}
+
+/* Virtual terminals.
+   Each virtual terminal keeps its text in a ring of con_lines lines in RAM;
+   its live screen is the last con_rows lines of the ring (starting at top)
+   and everything above it is scrollback. Only the active terminal is drawn
+   on the display, and only while it shows the live screen: background
+   terminals and scrolled-back views just update the ring, so each new line
+   costs O(1). Switching terminals (Alt+F1..F4) or moving the view
+   (Shift+PgUp/PgDn) redraws one screenful from the ring. The rings come
+   from kmem at vt_init, sized by con.scrollback; until then the first
+   terminal writes into a static screenful with no scrollback. */
+#define CON_SCROLLBACK 200 /* lines kept above the live screen (default of con.scrollback) */
+#define CON_SCROLL_STEP (con_rows / 2)
+#define NUM_VTS 4
+#define KBUF_SIZE 256  /* per-terminal input queue (default of kbd.queue) */
+#define INPUT_BUF 128  /* shell line length (default of shell.line) */
+#define INPUT_MAX 512  /* largest shell.line; line buffers on the stack use it */
+static uint32_t kbuf_size = KBUF_SIZE, input_buf = INPUT_BUF;
+static uint32_t con_scrollback = CON_SCROLLBACK;
+static uint32_t con_lines = CON_MAX_ROWS; /* ring size: con_scrollback + CON_MAX_ROWS after vt_init */
+#define CON_HISTORY_MAX (con_lines - CON_MAX_ROWS)
+
+struct vt {
+    uint16_t (*lines)[CON_MAX_COLS]; /* con_lines lines */
+    uint32_t top;     /* ring index of the live screen's first line */
+    uint32_t history; /* scrollback lines available above top */
+    uint32_t view;    /* lines scrolled back; 0 = live */
+    uint8_t row, col;
+    uint8_t wrap;                 /* last column written; the next character starts a new line */
+    uint8_t color;                /* attribute for new cells, derived from the SGR state */
+    uint8_t fg, bg, bold, reverse; /* SGR state */
+    uint8_t cursor_hidden;
+    uint8_t saved_row, saved_col;
+    struct vt_parser parser;
+    /* input queue, filled by the keyboard IRQ while this terminal is active */
+    volatile char *kbuf; /* kbuf_size bytes */
+    volatile int kbuf_head, kbuf_tail;
+    /* shell line being typed (input_buf bytes) and whether a command is running */
+    char *line;
+    int line_len;
+    int busy;
+};
+static uint16_t con_boot_lines[CON_MAX_ROWS][CON_MAX_COLS];
+static struct vt vts[NUM_VTS] = { { .lines = con_boot_lines } };
+static struct vt *vt_out = &vts[0];    /* terminal console output goes to */
+static struct vt *vt_active = &vts[0]; /* terminal on the screen */
+static volatile int vt_input = 0;      /* terminal receiving keys; set by the keyboard IRQ */
+static volatile int con_scroll_req = 0; /* pending view movement from the keyboard IRQ */
+
+static uint16_t *vt_line(struct vt *t, uint32_t screen_row) {
+    return t->lines[(t->top + screen_row) % con_lines];
+}
+
+static void vt_blank(struct vt *t, uint16_t *line) {
+    const uint16_t blank = (uint16_t)' ' | ((uint16_t)t->color << 8);
+    for (int c = 0; c < CON_MAX_COLS; ++c) line[c] = blank;
+}
+
+static void update_cursor(void) {
+    struct vt *t = vt_active;
+    /* no cursor while browsing history */
+    if (t->view || t->cursor_hidden) con_display->cursor(-1, 0);
+    else con_display->cursor(t->row, t->col);
+}
+
+static int vt_shown(struct vt *t) { return t == vt_active && !t->view; }
+
+/* Line of the active terminal's window (live screen or scrollback) on a screen row */
+static uint16_t *con_view_line(int row) {
+    struct vt *t = vt_active;
+    return t->lines[(t->top + con_lines - t->view + row) % con_lines];
+}
+
+/* Mouse pointer and selection. They are drawn over the active terminal's
+   window by inverting cell colours on the display only; the terminal's own
+   cells are never touched. Positions are row * con_cols + col. */
+static int ptr_pos = -1;            /* pointer cell, -1 while hidden */
+static int sel_active = 0;          /* a selection is shown */
+static int sel_anchor, sel_end;
+
+static int sel_lo(void) { return sel_anchor < sel_end ? sel_anchor : sel_end; }
+static int sel_hi(void) { return sel_anchor < sel_end ? sel_end : sel_anchor; }
+
+static uint16_t con_invert(uint16_t cell) {
+    uint8_t attr = cell >> 8;
+    return (cell & 0xFF) | (uint16_t)(((attr << 4) | (attr >> 4)) & 0xFF) << 8;
+}
+
+/* Draw cells with the pointer and selection laid over them */
+static void con_span(int row, int col, const uint16_t *cells, int n) {
+    int first = row * con_cols + col, last = first + n - 1;
+    int on_ptr = ptr_pos >= first && ptr_pos <= last;
+    int on_sel = sel_active && sel_lo() <= last && sel_hi() >= first;
+    if (!on_ptr && !on_sel) { con_display->span(row, col, cells, n); return; }
+    uint16_t tmp[CON_MAX_COLS];
+    for (int i = 0; i < n; ++i) {
+        int pos = first + i;
+        int inv = on_sel && pos >= sel_lo() && pos <= sel_hi();
+        if (pos == ptr_pos) inv = !inv;
+        tmp[i] = inv ? con_invert(cells[i]) : cells[i];
+    }
+    con_display->span(row, col, tmp, n);
+}
+
+static void con_redraw_rows(int from, int to) {
+    for (int r = from; r <= to && r < con_rows; ++r) if (r >= 0) con_span(r, 0, con_view_line(r), con_cols);
+}
+
+/* Draw the active terminal's window */
+static void con_render(void) {
+    struct vt *t = vt_active;
+    sel_active = 0; /* the selection belonged to the old window */
+    for (int r = 0; r < con_rows; ++r) con_span(r, 0, con_view_line(r), con_cols);
+    /* "[-N]" marker in the top right corner while scrolled back */
+    if (t->view) {
+        uint16_t mark[16];
+        char digits[10]; int d = 0, n = 0;
+        for (uint32_t v = t->view; v; v /= 10) digits[d++] = '0' + v % 10;
+        mark[n++] = '['; mark[n++] = '-';
+        while (d) mark[n++] = digits[--d];
+        mark[n++] = ']';
+        for (int i = 0; i < n; ++i) mark[i] |= 0x7000;
+        con_span(0, con_cols - n, mark, n);
+    }
+    update_cursor();
+}
+
+static void con_scroll_view(int delta) {
+    struct vt *t = vt_active;
+    int v = (int)t->view + delta;
+    if (v < 0) v = 0;
+    if (v > (int)t->history) v = (int)t->history;
+    if ((uint32_t)v == t->view) return;
+    t->view = (uint32_t)v;
+    con_render();
+}
+
+/* Apply terminal switches and view movement requested from the keyboard IRQ */
+static void con_poll(void) {
+    if (vt_active != &vts[vt_input]) {
+        vt_active = &vts[vt_input];
+        con_render();
+    }
+    if (!con_scroll_req) return;
+    __asm__ volatile ("cli");
+    int delta = con_scroll_req;
+    con_scroll_req = 0;
+    __asm__ volatile ("sti");
+    con_scroll_view(delta);
+}
+
+static void vga_scroll(struct vt *t) {
+    /* take the pointer and selection off before their pixels move with the text */
+    int ptr = -1;
+    if (vt_shown(t) && (ptr_pos >= 0 || sel_active)) {
+        int from = sel_active ? sel_lo() / con_cols : con_rows, to = sel_active ? sel_hi() / con_cols : -1;
+        ptr = ptr_pos;
+        ptr_pos = -1;
+        sel_active = 0;
+        if (ptr >= 0) con_redraw_rows(ptr / con_cols, ptr / con_cols);
+        con_redraw_rows(from, to);
+    }
+    t->top = (t->top + 1) % con_lines;
+    if (t->history < CON_HISTORY_MAX) ++t->history;
+    vt_blank(t, vt_line(t, con_rows - 1));
+    if (t != vt_active) return;
+    if (t->view) {
+        /* keep the same text on view; nothing to redraw */
+        if (t->view < t->history) ++t->view;
+        else con_render(); /* the window reached the oldest kept line */
+        return;
+    }
+    con_display->scroll(vt_line(t, con_rows - 1));
+    if (ptr >= 0) {
+        ptr_pos = ptr;
+        con_redraw_rows(ptr / con_cols, ptr / con_cols);
+    }
+}
+
+static void vga_newline(struct vt *t) {
+    t->col = 0;
+    t->wrap = 0;
+    if (++t->row == con_rows) { t->row = con_rows - 1; vga_scroll(t); }
+}
+
+/* Put a run of plain characters at the cursor; the run must fit in the row.
+   Filling the last column only marks a pending wrap, as on a VT100, so a
+   full-screen program can draw the bottom right cell without scrolling. */
+static void vt_print(struct vt *t, const char *s, int n) {
+    uint16_t *line = vt_line(t, t->row) + t->col;
+    const uint16_t attr = (uint16_t)t->color << 8;
+    for (int i = 0; i < n; ++i) line[i] = (uint8_t)s[i] | attr;
+    if (vt_shown(t)) con_span(t->row, t->col, line, n);
+    t->col += n;
+    if (t->col >= con_cols) { t->col = con_cols - 1; t->wrap = 1; }
+}
+
+/* Blank columns [from, to) of a screen row with the current colours */
+static void vt_erase(struct vt *t, int row, int from, int to) {
+    uint16_t *line = vt_line(t, row);
+    const uint16_t blank = (uint16_t)' ' | ((uint16_t)t->color << 8);
+    for (int c = from; c < to; ++c) line[c] = blank;
+    if (to > from && vt_shown(t)) con_span(row, from, line + from, to - from);
+}
+
+static void vt_exec(struct vt *t, char c) {
+    t->wrap = 0;
+    if (c == '\n') {
+        vga_newline(t);
+        con_poll();
+    } else if (c == '\r') {
+        t->col = 0;
+    } else if (c == '\b') {
+        if (t->col > 0) --t->col;
+    } else if (c == '\t') {
+        t->col = (t->col + 8) & ~7;
+        if (t->col >= con_cols) t->col = con_cols - 1;
+    }
+}
+
+static const uint8_t ansi_to_vga[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+static void vt_sgr(struct vt *t) {
+    const struct vt_parser *p = &t->parser;
+    int n = p->nparams < VTP_MAX_PARAMS ? p->nparams + 1 : VTP_MAX_PARAMS;
+    for (int i = 0; i < n; ++i) {
+        uint32_t v = p->params[i];
+        if (v == 0) { t->fg = 7; t->bg = 0; t->bold = t->reverse = 0; }
+        else if (v == 1) t->bold = 1;
+        else if (v == 22) t->bold = 0;
+        else if (v == 7) t->reverse = 1;
+        else if (v == 27) t->reverse = 0;
+        else if (v >= 30 && v <= 37) t->fg = ansi_to_vga[v - 30];
+        else if (v == 39) t->fg = 7;
+        else if (v >= 40 && v <= 47) t->bg = ansi_to_vga[v - 40];
+        else if (v == 49) t->bg = 0;
+        else if (v >= 90 && v <= 97) t->fg = ansi_to_vga[v - 90] | 8;
+        else if (v >= 100 && v <= 107) t->bg = ansi_to_vga[v - 100] | 8;
+    }
+    uint8_t fg = t->fg | (t->bold ? 8 : 0);
+    t->color = t->reverse ? (uint8_t)((fg << 4) | (t->bg & 0x0F)) : (uint8_t)((t->bg << 4) | fg);
+}
+
+static void vt_move(struct vt *t, int row, int col) {
+    t->wrap = 0;
+    t->row = row < 0 ? 0 : row >= con_rows ? con_rows - 1 : row;
+    t->col = col < 0 ? 0 : col >= con_cols ? con_cols - 1 : col;
+}
+
+static void vt_csi(struct vt *t, char final) {
+    const struct vt_parser *p = &t->parser;
+    int n = (int)vtp_param(p, 0, 1);
+    switch (final) {
+    case 'A': vt_move(t, t->row - n, t->col); break;
+    case 'B': vt_move(t, t->row + n, t->col); break;
+    case 'C': vt_move(t, t->row, t->col + n); break;
+    case 'D': vt_move(t, t->row, t->col - n); break;
+    case 'E': vt_move(t, t->row + n, 0); break;
+    case 'F': vt_move(t, t->row - n, 0); break;
+    case 'G': vt_move(t, t->row, n - 1); break;
+    case 'd': vt_move(t, n - 1, t->col); break;
+    case 'H': case 'f': vt_move(t, n - 1, (int)vtp_param(p, 1, 1) - 1); break;
+    case 'J': {
+        uint32_t mode = vtp_param(p, 0, 0);
+        if (mode == 0) {
+            vt_erase(t, t->row, t->col, con_cols);
+            for (int r = t->row + 1; r < con_rows; ++r) vt_erase(t, r, 0, con_cols);
+        } else if (mode == 1) {
+            for (int r = 0; r < t->row; ++r) vt_erase(t, r, 0, con_cols);
+            vt_erase(t, t->row, 0, t->col + 1);
+        } else {
+            for (int r = 0; r < con_rows; ++r) vt_erase(t, r, 0, con_cols);
+        }
+        break;
+    }
+    case 'K': {
+        uint32_t mode = vtp_param(p, 0, 0);
+        if (mode == 0) vt_erase(t, t->row, t->col, con_cols);
+        else if (mode == 1) vt_erase(t, t->row, 0, t->col + 1);
+        else vt_erase(t, t->row, 0, con_cols);
+        break;
+    }
+    case 'm': vt_sgr(t); break;
+    case 's': t->saved_row = t->row; t->saved_col = t->col; break;
+    case 'u': vt_move(t, t->saved_row, t->saved_col); break;
+    case 'h': case 'l':
+        if (p->priv == '?' && vtp_param(p, 0, 0) == 25) t->cursor_hidden = (final == 'l');
+        break;
+    }
+}
+
+static void vt_esc(struct vt *t, char c) {
+    if (c == '7') { t->saved_row = t->row; t->saved_col = t->col; }
+    else if (c == '8') vt_move(t, t->saved_row, t->saved_col);
+    else if (c == 'c') {
+        /* full reset: default colours, visible cursor, blank screen */
+        t->parser.nparams = 0; t->parser.params[0] = 0;
+        vt_sgr(t);
+        t->cursor_hidden = 0;
+        for (int r = 0; r < con_rows; ++r) vt_erase(t, r, 0, con_cols);
+        vt_move(t, 0, 0);
+    }
+}
+
+/* Write output to a terminal. Runs of plain characters skip the parser and
+   reach the ring and the display a row at a time; everything else goes
+   through the escape sequence state machine. */
+static void vt_write(struct vt *t, const char *s, uint32_t n) {
+    uint32_t i = 0;
+    while (i < n) {
+        uint8_t c = (uint8_t)s[i];
+        if (t->parser.state == VTP_GROUND && c >= 0x20 && c != 0x7F) {
+            if (t->wrap) vga_newline(t);
+            uint32_t run = 1, room = con_cols - t->col;
+            while (i + run < n && run < room && (uint8_t)s[i + run] >= 0x20 && s[i + run] != 0x7F) ++run;
+            vt_print(t, s + i, (int)run);
+            i += run;
+            continue;
+        }
+        ++i;
+        switch (vtp_feed(&t->parser, c)) {
+        case VTA_EXEC: vt_exec(t, (char)c); break;
+        case VTA_DISPATCH: vt_csi(t, (char)c); break;
+        case VTA_ESC_DISPATCH: vt_esc(t, (char)c); break;
+        }
+    }
+    if (vt_shown(t)) update_cursor();
+}
+
+/* Clear the output terminal; what was on it moves into the scrollback */
+static void vga_clear(void) {
+    struct vt *t = vt_out;
+    int used = t->row + (t->col ? 1 : 0);
+    for (int i = 0; i < used; ++i) {
+        t->top = (t->top + 1) % con_lines;
+        if (t->history < CON_HISTORY_MAX) ++t->history;
+    }
+    for (int r = 0; r < con_rows; ++r) vt_blank(t, vt_line(t, r));
+    t->row = t->col = t->wrap = 0;
+    t->view = 0;
+    if (t == vt_active) con_render();
+}
+
+static void vt_init(void) {
+    vtp_init();
+    for (int i = 0; i < NUM_VTS; ++i) {
+        vts[i].color = vts[i].fg = 0x07; /* light gray on black */
+        vts[i].kbuf = kmem_alloc(kbuf_size, "kbd.queue");
+        vts[i].line = kmem_alloc(input_buf, "shell.line");
+        vts[i].lines = kmem_alloc((con_scrollback + CON_MAX_ROWS) * sizeof(*vts[i].lines), "con.scrollback");
+    }
+    con_lines = con_scrollback + CON_MAX_ROWS;
+    for (int i = 0; i < NUM_VTS; ++i)
+        for (uint32_t r = 0; r < con_lines; ++r) vt_blank(&vts[i], vts[i].lines[r]);
+    con_render();
+}
+
+/* --- Serial port (COM1, 16550 UART, polled) --- */
+#define COM1 0x3F8
+static int serial_console = 1; /* mirror console output and accept input on COM1 */
+
+#ifdef CONFIG_SERIAL
+static int serial_present = 0;
+
+static void serial_init(void) {
+    outb(COM1 + 1, 0x00); /* no UART interrupts */
+    outb(COM1 + 3, 0x80); /* DLAB on */
+    outb(COM1 + 0, 0x01); /* divisor 1: 115200 baud */
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03); /* 8N1 */
+    outb(COM1 + 2, 0xC7); /* FIFOs on and cleared, 14-byte RX threshold */
+    /* loopback self-test so a missing UART doesn't stall output */
+    outb(COM1 + 4, 0x1E);
+    outb(COM1 + 0, 0xAE);
+    if (inb(COM1 + 0) != 0xAE) return;
+    outb(COM1 + 4, 0x0F);
+    serial_present = 1;
+}
+#else
+#define serial_present 0 /* the console mirror and serial input fold away */
+static void serial_init(void) {}
+#endif
+
+static int serial_can_read(void) { return inb(COM1 + 5) & 0x01; }
+static uint8_t serial_read(void) { return inb(COM1); }
+
+/* Once the transmit holding register is empty the whole 16-byte FIFO is free */
+static void serial_write_buf(const uint8_t *p, uint32_t n) {
+    while (n) {
+        while (!(inb(COM1 + 5) & 0x20)) {}
+        uint32_t burst = n < 16 ? n : 16;
+        for (uint32_t i = 0; i < burst; ++i) outb(COM1, p[i]);
+        p += burst; n -= burst;
+    }
+}
+
+/* Console output: the output terminal plus the serial console mirror (attached
+   to the first terminal). Escape sequences reach the serial terminal unchanged,
+   so it draws the same colours and cursor movement. */
+static void console_write(const char *s, uint32_t n) {
+    vt_write(vt_out, s, n);
+    if (!serial_present || !serial_console || vt_out != &vts[0]) return;
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (s[i] != '\n') continue;
+        serial_write_buf((const uint8_t *)s + start, i - start);
+        serial_write_buf((const uint8_t *)"\r\n", 2);
+        start = i + 1;
+    }
+    serial_write_buf((const uint8_t *)s + start, n - start);
+}
+
+static void console_putc(char c) { console_write(&c, 1); }
+
+/* --- Output streams ---
+   Shell output goes through the current stream so it can be redirected
+   (e.g. to a remote session) without touching the VGA console. */
+struct out_stream {
+    void (*putc)(struct out_stream *s, char c);
+    int interactive; /* attached to the local screen and keyboard */
+    void (*write)(struct out_stream *s, const char *p, uint32_t n); /* optional batch form of putc */
+};
+
+static void vga_stream_putc(struct out_stream *s, char c) { (void)s; console_putc(c); }
+static void vga_stream_write(struct out_stream *s, const char *p, uint32_t n) { (void)s; console_write(p, n); }
+static struct out_stream vga_out = { vga_stream_putc, 1, vga_stream_write };
+static struct out_stream *cur_out = &vga_out;
+
+static void out_putc(char c) { cur_out->putc(cur_out, c); }
+
+static void out_write(const char *p, uint32_t n) {
+    if (cur_out->write) cur_out->write(cur_out, p, n);
+    else for (uint32_t i = 0; i < n; ++i) cur_out->putc(cur_out, p[i]);
+}
+
+static void out_puts(const char *s) {
+    uint32_t n = 0;
+    while (s[n]) ++n;
+    out_write(s, n);
+}
+
+/* Minimal integer -> string helpers */
+static void kputu(uint32_t val, int base) {
+    char buf[33]; int i = 32;
+    if (val == 0) { out_putc('0'); return; }
+    while (val) {
+        uint32_t d = val % base;
+        buf[--i] = (d < 10) ? ('0' + d) : ('a' + d - 10);
+        val /= base;
+    }
+    out_write(buf + i, 32 - i);
+}
+
+static void kputi(int32_t val, int base) {
+    if (val < 0) { out_putc('-'); kputu((uint32_t)(-val), base); }
+    else kputu((uint32_t)val, base);
+}
+
+/* minimal printf: supports %s, %d, %u, %x, %c, %% */
+static void kvprintf(const char *fmt, __builtin_va_list args) {
+    for (int i = 0; fmt[i]; ++i) {
+        if (fmt[i] != '%') {
+            /* literal text goes out as one run */
+            int j = i;
+            while (fmt[j + 1] && fmt[j + 1] != '%') ++j;
+            out_write(fmt + i, j - i + 1);
+            i = j;
+            continue;
+        }
+        ++i;
+        char f = fmt[i];
+        if (f == 's') { const char *s = __builtin_va_arg(args, const char*); out_puts(s ? s : "(null)"); }
+        else if (f == 'd') { kputi(__builtin_va_arg(args, int), 10); }
+        else if (f == 'u') { kputu(__builtin_va_arg(args, unsigned int), 10); }
+        else if (f == 'x') { kputu(__builtin_va_arg(args, unsigned int), 16); }
+        else if (f == 'c') { char c = (char)__builtin_va_arg(args, int); out_putc(c); }
+        else if (f == '%') { out_putc('%'); }
+        else { out_putc('%'); out_putc(f); }
+    }
+}
+
+static void kprintf(const char *fmt, ... ) {
+    __builtin_va_list args;
+    __builtin_va_start(args, fmt);
+    kvprintf(fmt, args);
+    __builtin_va_end(args);
+}
+
+/* Stream that formats into a caller buffer (always NUL-terminated, truncates) */
+struct buf_stream {
+    struct out_stream out; /* first member */
+    char *buf;
+    int len, cap;
+};
+
+static void buf_stream_putc(struct out_stream *o, char c) {
+    struct buf_stream *b = (struct buf_stream *)o;
+    if (b->len < b->cap - 1) b->buf[b->len++] = c;
+}
+
+static void buf_stream_write(struct out_stream *o, const char *p, uint32_t n) {
+    struct buf_stream *b = (struct buf_stream *)o;
+    int room = b->cap - 1 - b->len;
+    if (room <= 0) return;
+    if ((uint32_t)room > n) room = (int)n;
+    memcpy(b->buf + b->len, p, room);
+    b->len += room;
+}
+
+static int kvsnprintf(char *buf, int cap, const char *fmt, __builtin_va_list args) {
+    struct buf_stream b = { { buf_stream_putc, 0, buf_stream_write }, buf, 0, cap };
+    struct out_stream *prev = cur_out;
+    cur_out = &b.out;
+    kvprintf(fmt, args);
+    cur_out = prev;
+    if (cap > 0) buf[b.len] = '\0';
+    return b.len;
+}
+
+static int ksnprintf(char *buf, int cap, const char *fmt, ...) {
+    __builtin_va_list args;
+    __builtin_va_start(args, fmt);
+    int n = kvsnprintf(buf, cap, fmt, args);
+    __builtin_va_end(args);
+    return n;
+}
+
+/* Simple scancode -> ASCII (set 1) for main keys. Non-exhaustive. */
+static const char scancode_map[128] = {
+    0, 27, '1','2','3','4','5','6','7','8','9','0','-','=','\b', /* 0x0 */
+    '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n', 0, /* 0x10 */
+    'a','s','d','f','g','h','j','k','l',';','\'', '`', 0,'\\','z','x', /* 0x20 */
+    'c','v','b','n','m',',','.','/', 0,'*', 0,' ', /* 0x30 */
+};
+
+/* Forward declarations for assembly stubs */
+extern void irq0_entry(void);
+extern void irq1_entry(void);
+extern void irq12_entry(void);
+extern void nmi_entry(void);
+
+/* The interrupted context as the timer and NMI stubs save it (boot/irq.S,
+   boot/irq64.S). Interrupts from ring 0 do not switch stacks, so the
+   interrupted code's stack continues right after the CPU's part. */
+struct irq_frame {
+#ifdef __x86_64__
+    uint64_t r11, r10, r9, r8, rdi, rsi, rdx, rcx, rax;
+    uint64_t ip, cs, flags, sp, ss;
+#else
+    uint32_t es, ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax; /* pusha */
+    uint32_t ip, cs, flags;
+#endif
+};
+
+/* PIC remap and IDT setup (minimal); long-mode gates are 16 bytes with a 64-bit offset */
+struct idt_entry {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t flags;
+    uint16_t offset_high;
+#ifdef __x86_64__
+    uint32_t offset_top;
+    uint32_t reserved;
+#endif
+} __attribute__((packed));
+
+struct idt_ptr {
+    uint16_t limit;
+    uintptr_t base;
+} __attribute__((packed));
+
+static struct idt_entry idt[256];
+static struct idt_ptr idtp;
+
+static void idt_set_gate(uint8_t n, uintptr_t handler) {
+    idt[n].offset_low = handler & 0xFFFF;
+    idt[n].selector = 0x08; /* kernel code segment */
+    idt[n].zero = 0;
+    idt[n].flags = 0x8E; /* present, ring0, interrupt gate */
+    idt[n].offset_high = (handler >> 16) & 0xFFFF;
+#ifdef __x86_64__
+    idt[n].offset_top = (uint32_t)(handler >> 32);
+#endif
+}
+
+static void idt_init(void) {
+    memset(idt, 0, sizeof(idt));
+    idtp.limit = sizeof(idt) - 1;
+    idtp.base = (uintptr_t)&idt;
+}
+
+static void idt_load(void) {
+    __asm__ volatile ("lidt (%0)" : : "r"(&idtp));
+}
+
+static void pic_remap(void) {
+    uint8_t a1 = inb(0x21);
+    uint8_t a2 = inb(0xA1);
+
+    outb(0x20, 0x11);
+    outb(0xA0, 0x11);
+    outb(0x21, 0x20);
+    outb(0xA1, 0x28);
+    outb(0x21, 4);
+    outb(0xA1, 2);
+    outb(0x21, 0x01);
+    outb(0xA1, 0x01);
+
+    outb(0x21, a1);
+    outb(0xA1, a2);
+}
+
+static void pic_unmask_irq(uint8_t irq) {
+    if (irq >= 8) {
+        /* slave PIC, reached through the cascade on master IRQ2 */
+        outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+        irq = 2;
+    }
+    uint8_t mask = inb(0x21);
+    mask &= ~(1 << irq); /* clear the IRQ's bit on the master PIC */
+    outb(0x21, mask);
+}
+
+/* --- CPU time accounting ---
+   TSC cycles are charged to whatever the CPU is doing. Interrupt handlers
+   charge their vector on the way out. At thread level the cycles go to
+   one of the tasks below, the kernel's stand-ins for threads: each
+   terminal's shell, the network stack, remote shell commands, and idle
+   (the polling loop finding nothing to do). Code calls task_switch()
+   where the CPU changes hands, and a task's share leaves out the
+   interrupts taken inside it. There is one struct per CPU (only the boot
+   CPU runs), written by that CPU alone: the vector counters by handlers,
+   which do not nest, and the task counters at thread level, so nothing
+   takes a lock. A 64-bit counter an interrupt may be updating is read
+   with cpu_stat_read(), which retries a torn read. NMIs are counted on
+   their own and stay inside the time of whatever they interrupted.
+   Cost: two rdtsc per interrupt, and four per pass of the idle loop
+   (console_idle's switch to idle and back, and net_poll's own pair). */
+enum { TASK_IDLE, TASK_TTY1, TASK_NET = TASK_TTY1 + NUM_VTS, TASK_RSH, NUM_TASKS };
+#define VEC_NMI 2
+#define VEC_IRQ0 0x20
+/* Vectors with a handler that accounts: slot 0 is the NMI, then the PICs'
+   IRQs 0-15 */
+#define STAT_VECTORS 17
+#define STAT_NMI 0
+#define STAT_IRQ(n) (1 + (n))
+#define STAT_VECTOR(slot) ((slot) == STAT_NMI ? VEC_NMI : VEC_IRQ0 + (slot) - 1)
+
+struct cpu_stat {
+    volatile uint64_t irq_cycles; /* all maskable interrupts */
+    volatile uint64_t vec_cycles[STAT_VECTORS];
+    volatile uint32_t vec_count[STAT_VECTORS];
+    uint64_t task_cycles[NUM_TASKS];
+    uint64_t task_since, irq_mark; /* TSC and irq_cycles at the last switch */
+    int task;                      /* running at thread level */
+};
+static struct cpu_stat cpu0_stat;
+
+static uint64_t cpu_stat_read(const volatile uint64_t *p) {
+    uint64_t v;
+    do v = *p; while (v != *p);
+    return v;
+}
+
+/* At the end of an interrupt handler that started at TSC start; slot is
+   STAT_NMI or STAT_IRQ(n) */
+static inline void irq_account(int slot, uint64_t start) {
+    struct cpu_stat *s = &cpu0_stat;
+    uint64_t d = rdtsc() - start;
+    s->vec_cycles[slot] += d;
+    ++s->vec_count[slot];
+    if (slot != STAT_NMI) s->irq_cycles += d;
+}
+
+/* Charges the cycles since the last switch, less interrupts, to charge
+   and runs next from now on */
+static void task_account(int charge, int next) {
+    struct cpu_stat *s = &cpu0_stat;
+    uint64_t now = rdtsc(), irq = cpu_stat_read(&s->irq_cycles);
+    uint64_t d = now - s->task_since, in_irq = irq - s->irq_mark;
+    s->task_cycles[charge] += d > in_irq ? d - in_irq : 0;
+    s->task_since = now;
+    s->irq_mark = irq;
+    s->task = next;
+}
+
+/* Returns the task that was running, to switch back to */
+static int task_switch(int task) {
+    int prev = cpu0_stat.task;
+    task_account(prev, task);
+    return prev;
+}
+
+/* From the first prompt on; boot time is nobody's */
+static void cpu_stat_start(void) {
+    cpu0_stat.task = TASK_IDLE;
+    cpu0_stat.task_since = rdtsc();
+    cpu0_stat.irq_mark = cpu_stat_read(&cpu0_stat.irq_cycles);
+}
+
+/* --- PIT timer (IRQ0) --- */
+#define TIMER_HZ 100
+#define PIT_HZ 1193182
+#define PIT_DIVISOR (PIT_HZ / TIMER_HZ)
+static volatile uint32_t timer_ticks = 0;
+
+#ifdef CONFIG_WATCHDOG
+#define WATCHDOG_SOFT 10 /* default of watchdog.soft, seconds */
+#define WATCHDOG_HARD 5  /* default of watchdog.hard, seconds */
+static uint32_t watchdog_soft = WATCHDOG_SOFT;
+static volatile uint32_t watchdog_touched = 0; /* timer_ticks when the shell loop last ran */
+static void watchdog_soft_fire(const struct irq_frame *f);
+static void watchdog_flush(void);
+/* The shell loop, and long waits that are still making progress */
+#define watchdog_touch() (watchdog_touched = timer_ticks)
+#else
+#define watchdog_touch() ((void)0)
+#define watchdog_flush() ((void)0)
+#endif
+
+/* Called from assembly stub (irq0_entry) */
+void timer_handler(const struct irq_frame *f) {
+    uint64_t start = rdtsc();
+    ++timer_ticks;
+#ifdef CONFIG_WATCHDOG
+    /* the soft watchdog's whole per-tick cost; the report is out of line */
+    if (timer_ticks - watchdog_touched > watchdog_soft * TIMER_HZ && watchdog_soft) watchdog_soft_fire(f);
+#else
+    (void)f;
+#endif
+    irq_account(STAT_IRQ(0), start);
+}
+
+static void pit_init(void) {
+    /* mode 2 counts down once per period, so the counter can be read as a clock */
+    outb(0x43, 0x34); /* channel 0, lobyte/hibyte, mode 2 */
+    outb(0x40, PIT_DIVISOR & 0xFF);
+    outb(0x40, (PIT_DIVISOR >> 8) & 0xFF);
+}
+
+/* PIT input clocks since boot: whole ticks plus the latched position in the current one */
+static uint64_t pit_read(void) {
+    uintptr_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    uint32_t ticks = timer_ticks;
+    outb(0x43, 0x00); /* latch channel 0 */
+    uint32_t count = inb(0x40);
+    count |= (uint32_t)inb(0x40) << 8;
+    outb(0x20, 0x0A); /* read the master PIC's IRR */
+    /* the counter reloaded but IRQ0 has not been serviced yet */
+    if ((inb(0x20) & 1) && count > PIT_DIVISOR / 2) ++ticks;
+    if (flags & 0x200) __asm__ volatile ("sti");
+    return (uint64_t)ticks * PIT_DIVISOR + (PIT_DIVISOR - count);
+}
+
+/* --- ACPI tables ---
+   Parsed once at boot into acpi_info: the table directory, the MADT
+   (CPUs, I/O APICs, ISA interrupt overrides), the HPET block and the
+   FADT fields the kernel cares about. Callers query the cached copy and
+   never walk the firmware tables again. The RSDP is searched in the EBDA
+   and the BIOS area; the XSDT is preferred when it lies below 4 GiB. */
+#define ACPI_MAX_TABLES 24
+#define ACPI_MAX_CPUS 32
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_MAX_OVERRIDES 16
+
+struct acpi_rsdp {
+    char sig[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+    uint32_t length;
+    uint64_t xsdt;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt {
+    char sig[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id, creator_revision;
+} __attribute__((packed));
+
+struct acpi_gas {
+    uint8_t space_id, bit_width, bit_offset, access_size;
+    uint64_t address;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_sdt hdr;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_hpet {
+    struct acpi_sdt hdr;
+    uint32_t block_id;
+    struct acpi_gas base;
+    uint8_t number;
+    uint16_t min_tick;
+    uint8_t page_protection;
+} __attribute__((packed));
+
+/* FADT up to the reset register; later fields are not used */
+struct acpi_fadt {
+    struct acpi_sdt hdr;
+    uint32_t firmware_ctrl, dsdt;
+    uint8_t reserved0, pm_profile;
+    uint16_t sci_irq;
+    uint32_t smi_cmd;
+    uint8_t acpi_enable, acpi_disable, s4bios_req, pstate_cnt;
+    uint32_t pm1a_evt, pm1b_evt, pm1a_cnt, pm1b_cnt, pm2_cnt, pm_tmr, gpe0, gpe1;
+    uint8_t pm1_evt_len, pm1_cnt_len, pm2_cnt_len, pm_tmr_len, gpe0_len, gpe1_len, gpe1_base, cst_cnt;
+    uint16_t p_lvl2_lat, p_lvl3_lat, flush_size, flush_stride;
+    uint8_t duty_offset, duty_width, day_alarm, month_alarm, century;
+    uint16_t boot_arch;
+    uint8_t reserved1;
+    uint32_t flags;
+    struct acpi_gas reset_reg;
+    uint8_t reset_value;
+} __attribute__((packed));
+
+#define ACPI_FADT_TMR_32BIT (1u << 8)
+#define ACPI_BOOT_8042 (1u << 1)
+#define ACPI_MADT_PCAT (1u << 0)
+
+struct acpi_info {
+    uint8_t present;
+    uint8_t revision;
+    uint8_t wide; /* the root table is the XSDT */
+    char oem_id[7];
+    uint32_t root;
+    uint8_t num_tables;
+    struct { char sig[4]; uint32_t addr, length; } tables[ACPI_MAX_TABLES];
+    /* MADT */
+    uint32_t lapic_addr;
+    uint32_t madt_flags;
+    uint8_t num_cpus, num_ioapics, num_overrides, num_lapic_nmis;
+    struct { uint32_t apic_id; uint8_t acpi_id, enabled; } cpus[ACPI_MAX_CPUS];
+    struct { uint8_t id; uint32_t addr, gsi_base; } ioapics[ACPI_MAX_IOAPICS];
+    struct { uint8_t irq; uint16_t flags; uint32_t gsi; } overrides[ACPI_MAX_OVERRIDES];
+    /* HPET */
+    uint32_t hpet_addr, hpet_block_id;
+    /* FADT */
+    uint16_t sci_irq, boot_arch;
+    uint16_t pm_tmr_port;
+    uint8_t pm_tmr_bits, century_reg;
+    uint32_t fadt_flags;
+};
+
+static struct acpi_info acpi;
+
+static uint8_t acpi_sum(const void *p, uint32_t n) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < n; ++i) sum += b[i];
+    return sum;
+}
+
+static const struct acpi_rsdp *acpi_scan_rsdp(uintptr_t from, uintptr_t to) {
+    for (uintptr_t a = from; a + 20 <= to; a += 16) {
+        const struct acpi_rsdp *r = (const struct acpi_rsdp *)a;
+        if (memcmp(r->sig, "RSD PTR ", 8) == 0 && acpi_sum(r, 20) == 0) return r;
+    }
+    return 0;
+}
+
+static const struct acpi_rsdp *acpi_find_rsdp(void) {
+    uint16_t ebda_seg; /* from the BIOS data area */
+    __asm__ volatile ("movw 0x40E, %0" : "=r"(ebda_seg));
+    uintptr_t ebda = (uintptr_t)ebda_seg << 4;
+    const struct acpi_rsdp *r = 0;
+    if (ebda >= 0x80000 && ebda < 0xA0000) r = acpi_scan_rsdp(ebda, ebda + 1024);
+    return r ? r : acpi_scan_rsdp(0xE0000, 0x100000);
+}
+
+static void acpi_parse_madt(const struct acpi_madt *m) {
+    acpi.lapic_addr = m->lapic_addr;
+    acpi.madt_flags = m->flags;
+    const uint8_t *p = (const uint8_t *)(m + 1), *end = (const uint8_t *)m + m->hdr.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        uint32_t v32;
+        uint16_t v16;
+        switch (p[0]) {
+        case 0: /* processor local APIC */
+        case 9: /* processor local x2APIC */
+            if (acpi.num_cpus < ACPI_MAX_CPUS) {
+                int x2 = p[0] == 9;
+                uint32_t flags;
+                memcpy(&flags, p + (x2 ? 8 : 4), 4);
+                if (x2) memcpy(&v32, p + 4, 4); else v32 = p[3];
+                acpi.cpus[acpi.num_cpus].apic_id = v32;
+                acpi.cpus[acpi.num_cpus].acpi_id = x2 ? p[12] : p[2];
+                acpi.cpus[acpi.num_cpus].enabled = flags & 1;
+                ++acpi.num_cpus;
+            }
+            break;
+        case 1: /* I/O APIC */
+            if (acpi.num_ioapics < ACPI_MAX_IOAPICS) {
+                acpi.ioapics[acpi.num_ioapics].id = p[2];
+                memcpy(&acpi.ioapics[acpi.num_ioapics].addr, p + 4, 4);
+                memcpy(&acpi.ioapics[acpi.num_ioapics].gsi_base, p + 8, 4);
+                ++acpi.num_ioapics;
+            }
+            break;
+        case 2: /* interrupt source override (bus 0 is ISA) */
+            if (acpi.num_overrides < ACPI_MAX_OVERRIDES) {
+                acpi.overrides[acpi.num_overrides].irq = p[3];
+                memcpy(&acpi.overrides[acpi.num_overrides].gsi, p + 4, 4);
+                memcpy(&v16, p + 8, 2);
+                acpi.overrides[acpi.num_overrides].flags = v16;
+                ++acpi.num_overrides;
+            }
+            break;
+        case 4: /* local APIC NMI */
+            ++acpi.num_lapic_nmis;
+            break;
+        case 5: /* 64-bit local APIC address */
+            memcpy(&v32, p + 8, 4);
+            if (v32 == 0) memcpy(&acpi.lapic_addr, p + 4, 4);
+            break;
+        }
+        p += p[1];
+    }
+}
+
+static void acpi_parse_fadt(const struct acpi_fadt *f) {
+    acpi.sci_irq = f->sci_irq;
+    acpi.pm_tmr_port = (uint16_t)f->pm_tmr;
+    acpi.pm_tmr_bits = f->pm_tmr_len == 4 ? ((f->flags & ACPI_FADT_TMR_32BIT) ? 32 : 24) : 0;
+    acpi.century_reg = f->century;
+    acpi.fadt_flags = f->flags;
+    /* IA-PC boot flags exist from revision 3 (ACPI 2.0) */
+    acpi.boot_arch = f->hdr.revision >= 3 ? f->boot_arch : 0;
+}
+
+static void acpi_init(void) {
+    const struct acpi_rsdp *r = acpi_find_rsdp();
+    if (!r) return;
+    acpi.wide = r->revision >= 2 && r->xsdt && (r->xsdt >> 32) == 0 && acpi_sum(r, r->length) == 0;
+    const struct acpi_sdt *root = (const struct acpi_sdt *)(uintptr_t)(acpi.wide ? (uint32_t)r->xsdt : r->rsdt);
+    if (!root || acpi_sum(root, root->length) != 0) return;
+    acpi.present = 1;
+    acpi.revision = r->revision;
+    memcpy(acpi.oem_id, r->oem_id, 6);
+    acpi.root = (uint32_t)(uintptr_t)root;
+    uint32_t entry = acpi.wide ? 8 : 4;
+    const uint8_t *p = (const uint8_t *)(root + 1), *end = (const uint8_t *)root + root->length;
+    for (; p + entry <= end && acpi.num_tables < ACPI_MAX_TABLES; p += entry) {
+        uint32_t lo, hi = 0;
+        memcpy(&lo, p, 4);
+        if (acpi.wide) memcpy(&hi, p + 4, 4);
+        if (hi || !lo) continue;
+        const struct acpi_sdt *t = (const struct acpi_sdt *)(uintptr_t)lo;
+        if (acpi_sum(t, t->length) != 0) continue;
+        memcpy(acpi.tables[acpi.num_tables].sig, t->sig, 4);
+        acpi.tables[acpi.num_tables].addr = lo;
+        acpi.tables[acpi.num_tables].length = t->length;
+        ++acpi.num_tables;
+        if (memcmp(t->sig, "APIC", 4) == 0 && t->length >= sizeof(struct acpi_madt)) acpi_parse_madt((const struct acpi_madt *)t);
+        else if (memcmp(t->sig, "FACP", 4) == 0 && t->length >= 116) acpi_parse_fadt((const struct acpi_fadt *)t);
+        else if (memcmp(t->sig, "HPET", 4) == 0 && t->length >= sizeof(struct acpi_hpet)) {
+            const struct acpi_hpet *h = (const struct acpi_hpet *)t;
+            if (h->base.space_id == 0 && (h->base.address >> 32) == 0) acpi.hpet_addr = (uint32_t)h->base.address;
+            acpi.hpet_block_id = h->block_id;
+        }
+    }
+}
+
+static void acpi_dump(void) {
+    if (!acpi.present) { kprintf("acpi: no valid RSDP found\n"); return; }
+    kprintf("ACPI revision %u, OEM %s, %s at 0x%x\n", acpi.revision, acpi.oem_id, acpi.wide ? "XSDT" : "RSDT", acpi.root);
+    for (int i = 0; i < acpi.num_tables; ++i)
+        kprintf("  %c%c%c%c at 0x%x, %u bytes\n", acpi.tables[i].sig[0], acpi.tables[i].sig[1], acpi.tables[i].sig[2],
+                acpi.tables[i].sig[3], acpi.tables[i].addr, acpi.tables[i].length);
+    kprintf("MADT: local APIC at 0x%x%s\n", acpi.lapic_addr, (acpi.madt_flags & ACPI_MADT_PCAT) ? ", dual 8259 PICs" : "");
+    for (int i = 0; i < acpi.num_cpus; ++i)
+        kprintf("  cpu %u: APIC id %u%s\n", acpi.cpus[i].acpi_id, acpi.cpus[i].apic_id, acpi.cpus[i].enabled ? "" : " (disabled)");
+    for (int i = 0; i < acpi.num_ioapics; ++i)
+        kprintf("  I/O APIC %u at 0x%x, GSI base %u\n", acpi.ioapics[i].id, acpi.ioapics[i].addr, acpi.ioapics[i].gsi_base);
+    for (int i = 0; i < acpi.num_overrides; ++i)
+        kprintf("  IRQ %u -> GSI %u, flags 0x%x\n", acpi.overrides[i].irq, acpi.overrides[i].gsi, acpi.overrides[i].flags);
+    if (acpi.num_lapic_nmis) kprintf("  %u local APIC NMI entries\n", acpi.num_lapic_nmis);
+    if (acpi.hpet_addr) kprintf("HPET: at 0x%x, block id 0x%x\n", acpi.hpet_addr, acpi.hpet_block_id);
+    kprintf("FADT: SCI IRQ %u, PM timer ", acpi.sci_irq);
+    if (acpi.pm_tmr_bits) kprintf("port 0x%x (%u-bit)", acpi.pm_tmr_port, acpi.pm_tmr_bits); else kprintf("none");
+    kprintf(", RTC century register 0x%x, boot flags 0x%x%s\n", acpi.century_reg, acpi.boot_arch,
+            (acpi.boot_arch & ACPI_BOOT_8042) ? " (8042)" : "");
+}
+
+#ifdef CONFIG_HPET
+/* --- HPET ---
+   Registers are memory mapped at the address from the ACPI HPET table;
+   with paging off the physical address is used directly. Only HPETs with
+   a 64-bit main counter are used, so reads never need wrap handling. */
+#define HPET_CAP 0x00
+#define HPET_CONFIG 0x10
+#define HPET_COUNTER 0xF0
+#define HPET_CAP_64BIT (1u << 13)
+#define HPET_ENABLE 1u
+
+static volatile uint32_t *hpet_regs = 0;
+static uint32_t hpet_hz = 0;
+
+static uint64_t hpet_read(void) {
+    volatile uint32_t *c = hpet_regs + HPET_COUNTER / 4;
+    uint32_t hi, lo;
+    do { hi = c[1]; lo = c[0]; } while (hi != c[1]);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static int hpet_init(void) {
+    if (!acpi.hpet_addr) return -1;
+    volatile uint32_t *regs = (volatile uint32_t *)(uintptr_t)acpi.hpet_addr;
+    uint32_t period_fs = regs[HPET_CAP / 4 + 1];
+    if (!(regs[HPET_CAP / 4] & HPET_CAP_64BIT) || period_fs == 0 || period_fs > 100000000) return -1;
+    regs[HPET_CONFIG / 4] |= HPET_ENABLE;
+    hpet_regs = regs;
+    hpet_hz = (uint32_t)div64_32(1000000000000000ull, period_fs);
+    return 0;
+}
+#endif
+
+/* --- Clocksources ---
+   Every counter that can tell time is rated; the best one present drives
+   the wall clock. An invariant TSC is cheapest and steady, the HPET is
+   steady but each read is an uncached MMIO access, a TSC that may change
+   rate with power states comes next, and the PIT (port I/O with the
+   counter latched) is the fallback that always exists. */
+struct clocksource {
+    const char *name;
+    int rating;
+    uint64_t (*read)(void);
+    uint32_t hz;          /* of the count after shifting right by shift */
+    uint8_t shift;
+    uint32_t read_cycles; /* TSC cycles per read, measured at boot */
+};
+
+static uint64_t tsc_read(void) { return rdtsc(); }
+
+static struct clocksource cs_tsc = { "tsc", 150, tsc_read, 0, 0, 0 };
+#ifdef CONFIG_HPET
+static struct clocksource cs_hpet = { "hpet", 250, hpet_read, 0, 0, 0 };
+#endif
+static struct clocksource cs_pit = { "pit", 100, pit_read, PIT_HZ, 0, 0 };
+static struct clocksource *clocksources[3];
+static int num_clocksources = 0;
+static struct clocksource *clock_cs = 0;
+static uint32_t tsc_khz = 0; /* TSC cycles per millisecond */
+
+static void clocksource_register(struct clocksource *cs, uint64_t hz) {
+    while (hz > 0xFFFFFFFFu) { hz >>= 1; ++cs->shift; }
+    cs->hz = (uint32_t)hz;
+    uint64_t c0 = rdtsc();
+    for (int i = 0; i < 64; ++i) cs->read();
+    cs->read_cycles = (uint32_t)div64_32(rdtsc() - c0, 64);
+    clocksources[num_clocksources++] = cs;
+    if (!clock_cs || cs->rating > clock_cs->rating) clock_cs = cs;
+}
+
+/* Needs the PIT running and tsc_khz measured */
+static void clocksource_init(void) {
+    if (tsc_khz) {
+        if (cpu_has(CPUF_INVTSC)) cs_tsc.rating = 300;
+        clocksource_register(&cs_tsc, (uint64_t)tsc_khz * 1000);
+    }
+#ifdef CONFIG_HPET
+    if (hpet_init() == 0) clocksource_register(&cs_hpet, hpet_hz);
+#endif
+    clocksource_register(&cs_pit, PIT_HZ);
+}
+
+static void clocksource_list(void) {
+    kprintf("clocksources (rating, frequency, cost per read):\n");
+    for (int i = 0; i < num_clocksources; ++i) {
+        const struct clocksource *cs = clocksources[i];
+        kprintf(" %c %s\t%d  %u kHz  %u cycles", cs == clock_cs ? '*' : ' ', cs->name, cs->rating,
+                (cs->hz / 1000) << cs->shift, cs->read_cycles);
+        if (tsc_khz) kprintf(" (%u ns)", (uint32_t)div64_32((uint64_t)cs->read_cycles * 1000000, tsc_khz));
+        kprintf("\n");
+    }
+}
+
+
+/* --- Wall clock (CMOS RTC + clocksource) ---
+   The RTC is read once at boot. After that the time is the boot reading
+   plus the clocksource counts elapsed since, so clock_now() is one
+   counter read and never touches the RTC ports. The RTC is assumed to
+   run in UTC. Without CONFIG_RTC the clock starts at 1970-01-01 at boot. */
+static uint32_t clock_base = 0;    /* Unix time read from the RTC at boot */
+static uint64_t clock_base_count = 0;
+
+#ifdef CONFIG_RTC
+struct rtc_time { uint8_t sec, min, hour, day, mon, year, century; };
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(0x70, reg & 0x7F); /* bit 7 clear: leave NMI enabled for the watchdog */
+    return inb(0x71);
+}
+
+static void rtc_read_raw(struct rtc_time *t) {
+    /* registers are not stable while an update is in progress (<2 ms) */
+    for (uint32_t spin = 0; (cmos_read(0x0A) & 0x80) && spin < 1000000; ++spin) {}
+    t->sec = cmos_read(0x00); t->min = cmos_read(0x02); t->hour = cmos_read(0x04);
+    t->day = cmos_read(0x07); t->mon = cmos_read(0x08); t->year = cmos_read(0x09);
+    t->century = acpi.century_reg ? cmos_read(acpi.century_reg) : 0; /* register named by the FADT */
+}
+
+static uint8_t bcd_to_bin(uint8_t v) { return (uint8_t)((v >> 4) * 10 + (v & 0x0F)); }
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+static int32_t days_from_civil(int32_t y, uint32_t m, uint32_t d) {
+    y -= m <= 2;
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = (uint32_t)(y - era * 400);
+    uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t)doe - 719468;
+}
+
+static uint32_t rtc_read(void) {
+    struct rtc_time a, b;
+    /* read until two passes agree, so no field straddles an update */
+    rtc_read_raw(&b);
+    do { a = b; rtc_read_raw(&b); } while (memcmp(&a, &b, sizeof(a)) != 0);
+    uint8_t status_b = cmos_read(0x0B);
+    uint8_t pm = a.hour & 0x80;
+    a.hour &= 0x7F;
+    if (!(status_b & 0x04)) {
+        a.sec = bcd_to_bin(a.sec); a.min = bcd_to_bin(a.min); a.hour = bcd_to_bin(a.hour);
+        a.day = bcd_to_bin(a.day); a.mon = bcd_to_bin(a.mon); a.year = bcd_to_bin(a.year);
+        a.century = bcd_to_bin(a.century);
+    }
+    if (!(status_b & 0x02)) a.hour = (uint8_t)(a.hour % 12 + (pm ? 12 : 0)); /* 12-hour mode */
+    int32_t year = a.century >= 19 && a.century <= 21 ? a.century * 100 + a.year : a.year + (a.year < 70 ? 2000 : 1900);
+    if (a.mon < 1 || a.mon > 12 || a.day < 1 || a.day > 31) return 0;
+    return (uint32_t)days_from_civil(year, a.mon, a.day) * 86400 + a.hour * 3600u + a.min * 60u + a.sec;
+}
+#endif
+
+/* TSC cycles per millisecond, measured over 100 ms of PIT ticks */
+static uint32_t tsc_calibrate(void) {
+    uint32_t t0 = timer_ticks;
+    while (timer_ticks == t0) {}
+    uint64_t c0 = rdtsc();
+    uint32_t t1 = timer_ticks;
+    while (timer_ticks - t1 < TIMER_HZ / 10) {}
+    return (uint32_t)div64_32(rdtsc() - c0, 100);
+}
+
+/* Needs the PIT running */
+static void clock_init(void) {
+    tsc_khz = tsc_calibrate();
+    clocksource_init();
+#ifdef CONFIG_RTC
+    clock_base = rtc_read();
+#endif
+    clock_base_count = clock_cs->read();
+}
+
+static uint32_t clock_now(void) {
+    if (!clock_cs) return clock_base;
+    return clock_base + (uint32_t)div64_32((clock_cs->read() - clock_base_count) >> clock_cs->shift, clock_cs->hz);
+}
+
+/* "YYYY-MM-DD HH:MM:SS" into buf[20] */
+static void clock_format(uint32_t t, char *buf) {
+    uint32_t z = t / 86400 + 719468, secs = t % 86400;
+    uint32_t era = z / 146097, doe = z - era * 146097;
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    uint32_t d = doy - (153 * mp + 2) / 5 + 1, m = mp < 10 ? mp + 3 : mp - 9;
+    uint32_t y = yoe + era * 400 + (m <= 2);
+    uint32_t hh = secs / 3600, mm = secs / 60 % 60, ss = secs % 60;
+    ksnprintf(buf, 20, "%u-%u%u-%u%u %u%u:%u%u:%u%u", y, m / 10, m % 10, d / 10, d % 10,
+              hh / 10, hh % 10, mm / 10, mm % 10, ss / 10, ss % 10);
+}
+
+/* --- Kernel log ---
+   Fixed ring of records; the oldest is overwritten when full. Errors and
+   warnings are also shown on the local console. */
+#define KLOG_RECORDS 128 /* default of klog.records */
+#define KLOG_MSG 96
+
+enum { KLOG_ERR = 0, KLOG_WARN, KLOG_INFO, KLOG_DEBUG };
+static const char klog_level_chars[] = "EWID";
+
+struct klog_record {
+    uint32_t seq;
+    uint32_t ticks;
+    uint8_t level;
+    uint8_t len;
+    char msg[KLOG_MSG];
+};
+
+static uint32_t klog_records = KLOG_RECORDS;
+static uint32_t klog_console = KLOG_WARN; /* most verbose level also shown on the console */
+static struct klog_record *klog_ring;
+static uint32_t klog_next_seq = 0; /* sequence number of the next record */
+
+static void klog_init(void) {
+    klog_ring = kmem_alloc(klog_records * sizeof(*klog_ring), "klog.records");
+}
+
+static void klog(int level, const char *fmt, ...) {
+    struct klog_record *r = &klog_ring[klog_next_seq % klog_records];
+    __builtin_va_list args;
+    __builtin_va_start(args, fmt);
+    int n = kvsnprintf(r->msg, KLOG_MSG, fmt, args);
+    __builtin_va_end(args);
+    r->len = (uint8_t)n;
+    r->level = (uint8_t)level;
+    r->ticks = timer_ticks;
+    r->seq = klog_next_seq++;
+    if (level <= (int)klog_console) {
+        struct out_stream *prev = cur_out;
+        cur_out = &vga_out;
+        kprintf("[%c] %s\n", klog_level_chars[level], r->msg);
+        cur_out = prev;
+    }
+}
+
+static const struct klog_record *klog_get(uint32_t seq) {
+    if (seq >= klog_next_seq || klog_next_seq - seq > klog_records) return 0;
+    return &klog_ring[seq % klog_records];
+}
+
+static void klog_dump(void) {
+    uint32_t first = klog_next_seq > klog_records ? klog_next_seq - klog_records : 0;
+    for (uint32_t seq = first; seq < klog_next_seq; ++seq) {
+        const struct klog_record *r = klog_get(seq);
+        uint32_t centis = (r->ticks % TIMER_HZ) * 100 / TIMER_HZ;
+        kprintf("[%u.%u%u] %c %s\n", r->ticks / TIMER_HZ, centis / 10, centis % 10, klog_level_chars[r->level], r->msg);
+    }
+}
+
+/* Producer side of a terminal's input queue; runs with interrupts off */
+static void kbuf_push(struct vt *t, char c) {
+    int next = (t->kbuf_head + 1) % (int)kbuf_size;
+    if (next != t->kbuf_tail) { t->kbuf[t->kbuf_head] = c; t->kbuf_head = next; }
+}
+
+static int kbd_shift = 0; /* either Shift key held */
+static int kbd_alt = 0;   /* either Alt key held */
+static int kbd_e0 = 0;    /* previous byte was the 0xE0 extended prefix */
+
+static void keyboard_irq(void) {
+    uint8_t sc = inb(0x60);
+    if (sc == 0xE0) { kbd_e0 = 1; return; }
+    int extended = kbd_e0;
+    kbd_e0 = 0;
+    if (!extended && (sc & 0x7F) == 0x2A) { kbd_shift = (kbd_shift & ~1) | !(sc & 0x80); return; }
+    if (!extended && (sc & 0x7F) == 0x36) { kbd_shift = (kbd_shift & ~2) | (!(sc & 0x80) << 1); return; }
+    if ((sc & 0x7F) == 0x38) { kbd_alt = (kbd_alt & ~(1 << extended)) | (!(sc & 0x80) << extended); return; }
+    /* ignore key release */
+    if (sc & 0x80) return;
+    /* Shift+PgUp / Shift+PgDn browse the scrollback (applied outside the IRQ) */
+    if (kbd_shift && (sc == 0x49 || sc == 0x51)) { con_scroll_req += (sc == 0x49) ? CON_SCROLL_STEP : -CON_SCROLL_STEP; return; }
+    /* Alt+F1..F4 switch terminals: keys go to the new one at once, the screen follows outside the IRQ */
+    if (kbd_alt && !extended && sc >= 0x3B && sc < 0x3B + NUM_VTS) { vt_input = sc - 0x3B; con_scroll_req = 0; return; }
+    if (extended && sc != 0x1C) return; /* only keypad Enter maps to a character */
+    char c = 0;
+    if (sc < sizeof(scancode_map)) c = scancode_map[sc];
+    if (!c) return;
+    kbuf_push(&vts[vt_input], c);
+}
+
+/* Called from assembly stub (irq1_entry) */
+void keyboard_handler(void) {
+    uint64_t start = rdtsc();
+    keyboard_irq();
+    irq_account(STAT_IRQ(1), start);
+}
+
+/* Feed characters typed on the serial console into the first terminal's input queue */
+static struct vt_parser serial_in; /* escape sequences sent by the serial terminal */
+
+static void serial_poll_input(void) {
+    if (!serial_present || !serial_console) return;
+    while (serial_can_read()) {
+        char c = (char)serial_read();
+        /* cursor and function keys arrive as escape sequences; run them
+           through the console's parser and drop them instead of typing them */
+        if (serial_in.state != VTP_GROUND || c == 0x1B) {
+            if (vtp_feed(&serial_in, (uint8_t)c) != VTA_EXEC) continue;
+        }
+        if (c == '\r') c = '\n';
+        else if (c == 0x7F) c = '\b';
+        __asm__ volatile ("cli");
+        kbuf_push(&vts[0], c);
+        __asm__ volatile ("sti");
+    }
+}
+
+#ifdef CONFIG_MOUSE
+/* --- PS/2 mouse (IRQ12) ---
+   The IRQ handler only assembles 3-byte packets and appends them to a
+   single-producer/single-consumer ring: the handler owns the head, the
+   console owns the tail, so neither side has to disable interrupts. The
+   console drains the ring in batches from its idle loop, sums the motion
+   and redraws the pointer once per batch.
+   Left button selects text on the active terminal, middle or right button
+   pastes it into the terminal's input line. */
+#define MOUSE_RING 64
+#define CLIP_MAX 2048
+
+struct mouse_event {
+    int16_t dx, dy;
+    uint8_t buttons; /* bit 0 left, bit 1 right, bit 2 middle */
+};
+static struct mouse_event mouse_ring[MOUSE_RING];
+static volatile uint32_t mouse_head = 0, mouse_tail = 0;
+static uint32_t mouse_dropped = 0;
+static uint8_t mouse_packet[3];
+static int mouse_phase = 0;
+static int mouse_present = 0;
+static uint32_t mouse_enable = 1; /* tunable "mouse": probe the aux port at boot */
+
+static int mouse_x = 0, mouse_y = 0; /* pointer in 1/8 column, 1/16 row steps */
+static uint8_t mouse_buttons = 0;
+static char clip_buf[CLIP_MAX];
+static uint32_t clip_len = 0;
+
+static void mouse_irq(void) {
+    uint8_t status = inb(0x64);
+    /* a keyboard byte stays in the buffer for IRQ1 */
+    if ((status & 0x21) != 0x21) return;
+    uint8_t b = inb(0x60);
+    if (mouse_phase == 0 && !(b & 0x08)) return; /* first byte always has bit 3 set: resync */
+    mouse_packet[mouse_phase++] = b;
+    if (mouse_phase < 3) return;
+    mouse_phase = 0;
+    if (mouse_packet[0] & 0xC0) return; /* counter overflow */
+    uint32_t head = mouse_head;
+    if (head - mouse_tail == MOUSE_RING) { ++mouse_dropped; return; }
+    struct mouse_event *e = &mouse_ring[head % MOUSE_RING];
+    e->dx = (int16_t)(mouse_packet[1] - ((mouse_packet[0] & 0x10) ? 256 : 0));
+    e->dy = (int16_t)(mouse_packet[2] - ((mouse_packet[0] & 0x20) ? 256 : 0));
+    e->buttons = mouse_packet[0] & 0x07;
+    __asm__ volatile ("" ::: "memory"); /* event contents before the new head */
+    mouse_head = head + 1;
+}
+
+/* Called from assembly stub (irq12_entry) */
+void mouse_handler(void) {
+    uint64_t start = rdtsc();
+    mouse_irq();
+    irq_account(STAT_IRQ(12), start);
+}
+
+static int ps2_wait_write(void) {
+    for (int i = 0; i < 100000; ++i) if (!(inb(0x64) & 0x02)) return 0;
+    return -1;
+}
+
+static int ps2_wait_read(void) {
+    for (int i = 0; i < 100000; ++i) if (inb(0x64) & 0x01) return 0;
+    return -1;
+}
+
+static int mouse_cmd(uint8_t cmd) {
+    if (ps2_wait_write() < 0) return -1;
+    outb(0x64, 0xD4); /* next data byte goes to the aux device */
+    if (ps2_wait_write() < 0) return -1;
+    outb(0x60, cmd);
+    if (ps2_wait_read() < 0) return -1;
+    return inb(0x60) == 0xFA ? 0 : -1;
+}
+
+/* Enable the controller's aux port and its IRQ, then the mouse itself */
+static int mouse_init(void) {
+    if (ps2_wait_write() < 0) return -1;
+    outb(0x64, 0xA8);
+    if (ps2_wait_write() < 0) return -1;
+    outb(0x64, 0x20);
+    if (ps2_wait_read() < 0) return -1;
+    uint8_t cfg = inb(0x60);
+    cfg |= 0x02;  /* IRQ12 */
+    cfg &= ~0x20; /* aux clock on */
+    if (ps2_wait_write() < 0) return -1;
+    outb(0x64, 0x60);
+    if (ps2_wait_write() < 0) return -1;
+    outb(0x60, cfg);
+    if (mouse_cmd(0xF6) < 0 || mouse_cmd(0xF4) < 0) return -1; /* defaults, start streaming */
+    mouse_present = 1;
+    return 0;
+}
+
+/* Copy the selected cells as text, one line per screen row without trailing blanks */
+static void mouse_copy(void) {
+    int lo = sel_lo(), hi = sel_hi();
+    clip_len = 0;
+    for (int r = lo / con_cols; r <= hi / con_cols; ++r) {
+        const uint16_t *line = con_view_line(r);
+        int from = r == lo / con_cols ? lo % con_cols : 0;
+        int to = r == hi / con_cols ? hi % con_cols : con_cols - 1;
+        while (to >= from && (uint8_t)line[to] == ' ') --to;
+        if (r != lo / con_cols && clip_len < CLIP_MAX) clip_buf[clip_len++] = '\n';
+        for (int c = from; c <= to && clip_len < CLIP_MAX; ++c) clip_buf[clip_len++] = (char)line[c];
+    }
+}
+
+/* Type the clipboard into the active terminal; line breaks become spaces */
+static void mouse_paste(void) {
+    struct vt *t = &vts[vt_input];
+    for (uint32_t i = 0; i < clip_len; ++i) {
+        char c = clip_buf[i] == '\n' ? ' ' : clip_buf[i];
+        __asm__ volatile ("cli");
+        kbuf_push(t, c);
+        __asm__ volatile ("sti");
+    }
+}
+
+static void mouse_poll(void) {
+    uint32_t head = mouse_head, tail = mouse_tail;
+    if (head == tail) return;
+    int old_ptr = ptr_pos, old_sel = sel_active, old_lo = sel_lo(), old_hi = sel_hi();
+    int max_x = con_cols * 8 - 1, max_y = con_rows * 16 - 1;
+    for (; tail != head; ++tail) {
+        const struct mouse_event *e = &mouse_ring[tail % MOUSE_RING];
+        mouse_x += e->dx;
+        mouse_y -= e->dy; /* the mouse counts up, the screen down */
+        if (mouse_x < 0) mouse_x = 0;
+        if (mouse_x > max_x) mouse_x = max_x;
+        if (mouse_y < 0) mouse_y = 0;
+        if (mouse_y > max_y) mouse_y = max_y;
+        int pos = (mouse_y / 16) * con_cols + mouse_x / 8;
+        uint8_t pressed = e->buttons & ~mouse_buttons, released = mouse_buttons & ~e->buttons;
+        mouse_buttons = e->buttons;
+        if (pressed & 1) { sel_anchor = sel_end = pos; sel_active = 1; }
+        else if (mouse_buttons & 1) sel_end = pos;
+        if (released & 1) mouse_copy();
+        if (pressed & 6) mouse_paste();
+        ptr_pos = pos;
+    }
+    mouse_tail = tail;
+    /* one redraw for the whole batch: rows the pointer or selection left or entered */
+    if (ptr_pos != old_ptr) {
+        if (old_ptr >= 0) con_redraw_rows(old_ptr / con_cols, old_ptr / con_cols);
+        con_redraw_rows(ptr_pos / con_cols, ptr_pos / con_cols);
+    }
+    if (old_sel || sel_active) {
+        int from = old_sel ? old_lo : sel_lo(), to = old_sel ? old_hi : sel_hi();
+        if (sel_active && sel_lo() < from) from = sel_lo();
+        if (sel_active && sel_hi() > to) to = sel_hi();
+        if (old_sel != sel_active || old_lo != sel_lo() || old_hi != sel_hi()) con_redraw_rows(from / con_cols, to / con_cols);
+    }
+}
+#else
+static int mouse_present = 0;
+static uint32_t mouse_enable = 0;
+void mouse_handler(void) {} /* irq12_entry is assembled either way */
+static int mouse_init(void) { return -1; }
+static void mouse_poll(void) {}
+#endif
+
+static void net_poll(void);
+static void vt_service(void);
+
+/* Take a character from a terminal's input queue, if there is one */
+static int vt_getc(struct vt *t, char *c) {
+    if (t->kbuf_head == t->kbuf_tail) return 0;
+    *c = t->kbuf[t->kbuf_tail];
+    t->kbuf_tail = (t->kbuf_tail + 1) % (int)kbuf_size;
+    /* typing returns the terminal to its live screen */
+    if (t->view) { t->view = 0; if (t == vt_active) con_render(); }
+    return 1;
+}
+
+/* console_idle calls on the stack: 1 in the main loop, more while a
+   command waits inside it */
+static int idle_depth = 0;
+
+/* Everything that runs while the shell waits for a key */
+static void console_idle(void) {
+    int prev = task_switch(TASK_IDLE);
+    ++idle_depth;
+    watchdog_touch();
+    watchdog_flush();
+    con_poll();
+    mouse_poll();
+    serial_poll_input();
+    net_poll();
+    vt_service();
+    --idle_depth;
+    task_switch(prev);
+}
+
+/* The terminals share one stack: a command that waits in console_idle
+   (nano, more, top) runs the other terminals' commands nested inside
+   its wait, so it cannot go on until they return. Such a command may
+   therefore only start when no other one is waiting; otherwise the
+   first would be frozen behind the second. */
+static int console_may_wait(const char *cmd) {
+    if (idle_depth <= 1) return 1;
+    kprintf("%s: a command on another terminal is waiting (nano, more or top); finish it first\n", cmd);
+    return 0;
+}
+
+/* IRQ-based getchar for the terminal running the caller: blocks (busy-wait)
+   until a character is available. The network and the other terminals'
+   shells are serviced while we wait. */
+static char keyboard_getchar_irq(void) {
+    struct vt *t = vt_out;
+    char c;
+    while (!vt_getc(t, &c)) console_idle();
+    return c;
+}
+
+/* Simple line reader (uses IRQ-driven getchar) */
+static void read_line(char *buf, int bufsize) {
+    int idx = 0;
+    while (1) {
+        char c = keyboard_getchar_irq();
+        if (c == '\n' || c == '\r') { console_putc('\n'); buf[idx] = '\0'; return; }
+        else if (c == '\b') {
+            if (idx > 0) { --idx; console_write("\b \b", 3); }
+        } else {
+            if (idx < bufsize - 1) { buf[idx++] = c; console_putc(c); }
+        }
+    }
+}
+
+/* --- Tiny in-memory filesystem --- */
+#define MAX_FILES 16      /* default of fs.files */
+#define MAX_NAME 16
+#define MAX_FILE_SIZE 16384 /* default of fs.file_size */
+
+struct file_entry {
+    char name[MAX_NAME];
+    int used;
+    int size;
+    uint32_t mtime; /* Unix time of the last write */
+    char *data;     /* fs_file_size bytes */
+    int pins;       /* HTTP responses sending data by reference; no writes until 0 */
+};
+
+static uint32_t fs_max_files = MAX_FILES, fs_file_size = MAX_FILE_SIZE;
+static struct file_entry *files;
+/* a file's worth of buffer per terminal, for nano and recv; both refuse to
+   run from the remote shell, which borrows whatever terminal is current */
+static char *fs_scratch[NUM_VTS];
+
+static int fs_write(const char *name, const char *data, int len);
+#ifdef CONFIG_PROCFS
+#define PROC_DIR "/proc/"
+static const char *proc_read(const char *name, int *size);
+static int proc_index(char *out, int cap);
+#ifdef CONFIG_FS_COMMANDS
+static void proc_list(void);
+#endif
+
+/* The file name under /proc/, or 0 */
+static const char *proc_path(const char *name) {
+    for (int i = 0; PROC_DIR[i]; ++i) if (name[i] != PROC_DIR[i]) return 0;
+    return name + sizeof(PROC_DIR) - 1;
+}
+#endif
+
+static void fs_init(void) {
+    files = kmem_alloc(fs_max_files * sizeof(*files), "fs.files");
+    char *data = kmem_alloc((fs_max_files + NUM_VTS) * fs_file_size, "fs.file_size");
+    for (uint32_t i = 0; i < fs_max_files; ++i) files[i].data = data + i * fs_file_size;
+    for (int i = 0; i < NUM_VTS; ++i) fs_scratch[i] = data + (fs_max_files + i) * fs_file_size;
+    /* create a welcome file */
+    static const char w[] = "welcome: This is MiniOS (in-memory FS)\n";
+    fs_write("welcome", w, sizeof(w) - 1);
+}
+
+static int fs_find(const char *name) {
+    for (int i = 0; i < (int)fs_max_files; ++i) if (files[i].used) {
+        int k = 0; while (k < MAX_NAME && files[i].name[k] && name[k] && files[i].name[k] == name[k]) ++k;
+        if (files[i].name[k] == '\0' && name[k] == '\0') return i;
+    }
+    return -1;
+}
+
+static int fs_create(const char *name) {
+#ifdef CONFIG_PROCFS
+    if (proc_path(name)) return -1; /* read-only */
+#endif
+    if (fs_find(name) >= 0) return -1; /* already exists */
+    for (int i = 0; i < (int)fs_max_files; ++i) if (!files[i].used) {
+        files[i].used = 1; files[i].size = 0; files[i].mtime = clock_now(); int j=0; while (j < MAX_NAME - 1 && name[j]) { files[i].name[j] = name[j]; ++j; } files[i].name[j] = '\0'; return i;
+    }
+    return -1; /* no space */
+}
+
+static int fs_write(const char *name, const char *data, int len) {
+    int idx = fs_find(name);
+    if (idx < 0) idx = fs_create(name);
+    if (idx < 0 || files[idx].pins) return -1;
+    int n = 0; while (n < len && n < (int)fs_file_size) { files[idx].data[n] = data[n]; ++n; }
+    files[idx].size = n;
+    files[idx].mtime = clock_now();
+    return n;
+}
+
+/* Contents of a file, or 0. A /proc file is generated now, on every read. */
+static const char *fs_data(const char *name, int *size) {
+#ifdef CONFIG_PROCFS
+    const char *proc = proc_path(name);
+    if (proc) return proc_read(proc, size);
+#endif
+    int idx = fs_find(name);
+    if (idx < 0) return 0;
+    *size = files[idx].size;
+    return files[idx].data;
+}
+
+#ifdef CONFIG_FS_COMMANDS
+static int fs_read_to_console(const char *name) {
+    int size;
+    const char *data = fs_data(name, &size);
+    if (!data) return -1;
+    out_write(data, size);
+    return size;
+}
+
+static void fs_list(void) {
+    kprintf("Files:\n");
+    for (int i = 0; i < (int)fs_max_files; ++i) if (files[i].used) {
+        char when[20];
+        clock_format(files[i].mtime, when);
+        kprintf("  %s (%d bytes, %s)\n", files[i].name, files[i].size, when);
+    }
+#ifdef CONFIG_PROCFS
+    proc_list();
+#endif
+}
+#endif
+
+#if defined(CONFIG_FS_COMMANDS) || defined(CONFIG_MODULES)
+/* -1 if there is no such file, -2 while it is pinned */
+static int fs_remove(const char *name) {
+    int idx = fs_find(name);
+    if (idx < 0) return -1;
+    if (files[idx].pins) return -2;
+    files[idx].used = 0; return 0;
+}
+#endif
+
+/* --- CRC-32C (Castagnoli), table driven --- */
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc32c_table[i] = c;
+    }
+}
+
+/* crc32c_update(crc32c_update(0, a), b) == CRC of a followed by b */
+static uint32_t crc32c_update_table(uint32_t crc, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (len--) crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* The SSE4.2 CRC32 instruction uses this polynomial, a word at a time */
+static uint32_t crc32c_update_sse42(uint32_t crc, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for (; len && ((uintptr_t)p & 7); --len) __asm__ ("crc32b %1, %0" : "+r"(crc) : "qm"(*p++));
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8) { uint64_t w; __builtin_memcpy(&w, p, 8); __asm__ ("crc32q %1, %0" : "+r"(crc64) : "rm"(w)); }
+    crc = (uint32_t)crc64;
+#endif
+    for (; len >= 4; len -= 4, p += 4) { uint32_t w; __builtin_memcpy(&w, p, 4); __asm__ ("crc32l %1, %0" : "+r"(crc) : "rm"(w)); }
+    while (len--) __asm__ ("crc32b %1, %0" : "+r"(crc) : "qm"(*p++));
+    return ~crc;
+}
+
+static uint32_t (*crc32c_update)(uint32_t crc, const void *data, uint32_t len) = crc32c_update_table;
+
+#ifdef CONFIG_SERIAL_XFER
+/* --- Serial file transfer (recv/send) ---
+   Frames are SLIP-delimited: type, seq, len (LE16), payload, CRC-32C (LE32).
+   Frame 0 is INIT (LE32 size + name), then DATA frames, then EOF. The
+   receiver answers with cumulative ACKs carrying the next sequence number it
+   expects; the sender keeps XFER_WINDOW frames in flight and goes back to
+   the oldest unacknowledged frame on timeout. tools/sercp.py is the host side. */
+#define XFER_END 0xC0
+#define XFER_ESC 0xDB
+#define XFER_ESC_END 0xDC
+#define XFER_ESC_ESC 0xDD
+#define XFER_CHUNK 1024
+#define XFER_WINDOW 8
+#define XFER_TIMEOUT_TICKS (TIMER_HZ / 2)
+#define XFER_MAX_RETRIES 10
+#define XFER_START_TICKS (30 * TIMER_HZ) /* how long recv waits for the host */
+#define XFER_LINGER_TICKS (TIMER_HZ / 2)
+
+enum { XF_INIT = 'I', XF_DATA = 'D', XF_EOF = 'E', XF_ACK = 'A', XF_READY = 'R', XF_ABORT = 'X' };
+
+static uint8_t xfer_txbuf[2 * (4 + XFER_CHUNK + 4) + 2];
+static uint8_t xfer_rxbuf[4 + XFER_CHUNK + 4];
+static uint32_t xfer_rxlen = 0;
+static int xfer_rx_esc = 0, xfer_rx_overflow = 0;
+static uint32_t xfer_crc_errors = 0;
+/* Bytes taken off the UART while a frame is written, so the peer's ACKs
+   (or frames, while we ACK) do not overrun its 16-byte RX FIFO */
+#define XFER_RXQ 256
+static uint8_t xfer_rxq[XFER_RXQ];
+static uint32_t xfer_rxq_head = 0, xfer_rxq_tail = 0;
+
+static void xfer_rx_stash(void) {
+    while (serial_can_read()) {
+        uint8_t b = serial_read();
+        if (xfer_rxq_head - xfer_rxq_tail < XFER_RXQ) xfer_rxq[xfer_rxq_head++ % XFER_RXQ] = b;
+        /* else dropped: its frame fails the length or CRC check */
+    }
+}
+
+static void xfer_send_frame(uint8_t type, uint8_t seq, const uint8_t *data, uint32_t len) {
+    uint8_t hdr[4] = { type, seq, (uint8_t)(len & 0xFF), (uint8_t)(len >> 8) };
+    uint32_t crc = crc32c_update(crc32c_update(0, hdr, 4), data, len);
+    uint8_t tail[4] = { (uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24) };
+    uint32_t n = 0;
+    xfer_txbuf[n++] = XFER_END; /* flush any line noise at the receiver */
+    for (int part = 0; part < 3; ++part) {
+        const uint8_t *p = part == 0 ? hdr : part == 1 ? data : tail;
+        uint32_t plen = part == 0 ? 4 : part == 1 ? len : 4;
+        for (uint32_t i = 0; i < plen; ++i) {
+            if (p[i] == XFER_END) { xfer_txbuf[n++] = XFER_ESC; xfer_txbuf[n++] = XFER_ESC_END; }
+            else if (p[i] == XFER_ESC) { xfer_txbuf[n++] = XFER_ESC; xfer_txbuf[n++] = XFER_ESC_ESC; }
+            else xfer_txbuf[n++] = p[i];
+        }
+    }
+    xfer_txbuf[n++] = XFER_END;
+    /* as serial_write_buf, but draining RX while the TX FIFO empties */
+    for (uint32_t i = 0; i < n; ) {
+        while (!(inb(COM1 + 5) & 0x20)) xfer_rx_stash();
+        for (uint32_t end = i + 16 < n ? i + 16 : n; i < end; ++i) outb(COM1, xfer_txbuf[i]);
+    }
+    xfer_rx_stash();
+}
+
+/* Parse the bytes received so far (stashed ones first) without waiting;
+   returns a good frame's payload length, or -1 once nothing is left.
+   The payload is left in xfer_rxbuf + 4. */
+static int xfer_poll_frame(uint8_t *type, uint8_t *seq) {
+    for (;;) {
+        uint8_t b;
+        if (xfer_rxq_tail != xfer_rxq_head) b = xfer_rxq[xfer_rxq_tail++ % XFER_RXQ];
+        else if (serial_can_read()) b = serial_read();
+        else return -1;
+        if (b == XFER_END) {
+            uint32_t n = xfer_rxlen;
+            int bad = xfer_rx_overflow;
+            xfer_rxlen = 0; xfer_rx_esc = 0; xfer_rx_overflow = 0;
+            if (n == 0) continue;
+            uint32_t len = xfer_rxbuf[2] | (xfer_rxbuf[3] << 8);
+            if (bad || n < 8 || len != n - 8) { xfer_crc_errors++; continue; }
+            uint32_t crc = xfer_rxbuf[n - 4] | (xfer_rxbuf[n - 3] << 8) | (xfer_rxbuf[n - 2] << 16) | ((uint32_t)xfer_rxbuf[n - 1] << 24);
+            if (crc32c_update(0, xfer_rxbuf, n - 4) != crc) { xfer_crc_errors++; continue; }
+            *type = xfer_rxbuf[0]; *seq = xfer_rxbuf[1];
+            return (int)len;
+        }
+        if (b == XFER_ESC) { xfer_rx_esc = 1; continue; }
+        if (xfer_rx_esc) { b = (b == XFER_ESC_END) ? XFER_END : (b == XFER_ESC_ESC) ? XFER_ESC : b; xfer_rx_esc = 0; }
+        if (xfer_rxlen < sizeof(xfer_rxbuf)) xfer_rxbuf[xfer_rxlen++] = b;
+        else xfer_rx_overflow = 1;
+    }
+}
+
+/* Wait for the next good frame until deadline; returns payload length or -1 */
+static int xfer_recv_frame(uint8_t *type, uint8_t *seq, uint32_t deadline) {
+    while ((int32_t)(timer_ticks - deadline) < 0) {
+        watchdog_touch(); /* recv waits up to XFER_START_TICKS for the host */
+        int n = xfer_poll_frame(type, seq);
+        if (n >= 0) return n;
+    }
+    return -1;
+}
+
+static void xfer_abort(const char *why) {
+    uint32_t n = 0; while (why[n]) ++n;
+    xfer_send_frame(XF_ABORT, 0, (const uint8_t *)why, n);
+}
+
+/* Frame i of a transfer: 0 = INIT, 1..n = DATA, n + 1 = EOF */
+static void xfer_send_numbered(uint32_t i, uint32_t nframes, const char *name, const uint8_t *data, uint32_t size) {
+    if (i == 0) {
+        uint8_t init[4 + MAX_NAME];
+        uint32_t n = 4;
+        init[0] = size & 0xFF; init[1] = (size >> 8) & 0xFF; init[2] = (size >> 16) & 0xFF; init[3] = size >> 24;
+        while (name[n - 4] && n < sizeof(init)) { init[n] = name[n - 4]; ++n; }
+        xfer_send_frame(XF_INIT, 0, init, n);
+    } else if (i == nframes - 1) {
+        xfer_send_frame(XF_EOF, (uint8_t)i, 0, 0);
+    } else {
+        uint32_t off = (i - 1) * XFER_CHUNK;
+        uint32_t len = size - off < XFER_CHUNK ? size - off : XFER_CHUNK;
+        xfer_send_frame(XF_DATA, (uint8_t)i, data + off, len);
+    }
+}
+
+/* Go-back-N sender; returns 0 when every frame has been acknowledged.
+   A 1 KiB frame takes about 90 ms at 115200 baud, so ACKs are taken
+   between frames to slide the window while it is still being filled, and
+   the timeout runs from the end of the last frame written. */
+static int xfer_send(const char *name, const uint8_t *data, uint32_t size) {
+    uint32_t nframes = (size + XFER_CHUNK - 1) / XFER_CHUNK + 2;
+    uint32_t base = 0, next = 0;
+    int retries = 0;
+    uint32_t deadline = timer_ticks + XFER_TIMEOUT_TICKS;
+    while (base < nframes) {
+        uint8_t type, seq;
+        int n;
+        if (next < nframes && next < base + XFER_WINDOW) {
+            xfer_send_numbered(next++, nframes, name, data, size);
+            deadline = timer_ticks + XFER_TIMEOUT_TICKS;
+            n = xfer_poll_frame(&type, &seq);
+            if (n < 0) continue;
+        } else {
+            n = xfer_recv_frame(&type, &seq, deadline);
+            if (n < 0) {
+                if (++retries > XFER_MAX_RETRIES) return -1;
+                next = base;
+                continue;
+            }
+        }
+        if (type == XF_ABORT) return -1;
+        if (type != XF_ACK) continue;
+        /* ACK seq is the next frame the receiver wants (mod 256) */
+        uint32_t acked = base + (uint8_t)(seq - (uint8_t)base);
+        if (acked > base && acked <= next) {
+            base = acked;
+            retries = 0;
+            deadline = timer_ticks + XFER_TIMEOUT_TICKS;
+        }
+    }
+    return 0;
+}
+
+/* Receiver: announces itself with READY until INIT arrives; returns the size or -1 */
+static int xfer_recv(uint8_t *out, uint32_t cap) {
+    uint32_t expected = 0, got = 0, size = 0;
+    uint32_t start = timer_ticks;
+    int retries = 0;
+    xfer_send_frame(XF_READY, 0, 0, 0);
+    for (;;) {
+        uint8_t type, seq;
+        int n = xfer_recv_frame(&type, &seq, timer_ticks + XFER_TIMEOUT_TICKS);
+        if (n < 0) {
+            if (expected == 0) {
+                if (timer_ticks - start > XFER_START_TICKS) return -1;
+                xfer_send_frame(XF_READY, 0, 0, 0);
+            } else if (++retries > XFER_MAX_RETRIES) {
+                return -1;
+            }
+            continue;
+        }
+        retries = 0;
+        if (type == XF_ABORT) return -1;
+        if (seq != (uint8_t)expected) { xfer_send_frame(XF_ACK, (uint8_t)expected, 0, 0); continue; }
+        const uint8_t *p = xfer_rxbuf + 4;
+        if (expected == 0) {
+            if (type != XF_INIT || n < 4) continue;
+            size = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+            if (size > cap) { xfer_abort("file too large"); return -1; }
+        } else if (type == XF_DATA) {
+            if (got + n > size) { xfer_abort("more data than announced"); return -1; }
+            memcpy(out + got, p, n);
+            got += n;
+        } else if (type == XF_EOF) {
+            if (got != size) { xfer_abort("short transfer"); return -1; }
+            xfer_send_frame(XF_ACK, (uint8_t)(expected + 1), 0, 0);
+            /* stay a moment in case our final ACK was lost */
+            uint32_t until = timer_ticks + XFER_LINGER_TICKS;
+            while (xfer_recv_frame(&type, &seq, until) >= 0) if (type == XF_EOF) xfer_send_frame(XF_ACK, (uint8_t)(expected + 1), 0, 0);
+            return (int)got;
+        } else {
+            continue;
+        }
+        ++expected;
+        xfer_send_frame(XF_ACK, (uint8_t)expected, 0, 0);
+    }
+}
+
+static void xfer_command(const char *name, int sending) {
+    if (!serial_present) { kprintf("No serial port\n"); return; }
+    /* the transfer polls COM1 until done; from rsh that would stall net_poll */
+    if (!cur_out->interactive) { kprintf("%s: not available in a remote session\n", sending ? "send" : "recv"); return; }
+    if (sending) {
+        int size;
+        const char *data = fs_data(name, &size);
+        if (!data) { kprintf("No such file: %s\n", name); return; }
+        kprintf("send: waiting for host receiver (tools/sercp.py get)...\n");
+        serial_console = 0;
+        int r = xfer_send(name, (const uint8_t *)data, (uint32_t)size);
+        serial_console = 1;
+        if (r < 0) kprintf("send failed\n"); else kprintf("Sent %d bytes from %s\n", size, name);
+        klog(r < 0 ? KLOG_DEBUG : KLOG_INFO, "xfer: send %s: %s", name, r < 0 ? "failed" : "ok");
+    } else {
+        kprintf("recv: waiting for host sender (tools/sercp.py put)...\n");
+        serial_console = 0;
+        uint8_t *buf = (uint8_t *)fs_scratch[vt_out - vts];
+        int n = xfer_recv(buf, fs_file_size);
+        serial_console = 1;
+        if (n < 0) { kprintf("recv failed\n"); klog(KLOG_DEBUG, "xfer: recv %s failed", name); return; }
+        klog(KLOG_INFO, "xfer: recv %s: %d bytes", name, n);
+        int written = fs_write(name, (const char *)buf, n);
+        if (written < 0) kprintf("Failed to write file\n"); else kprintf("Received %d bytes into %s\n", written, name);
+    }
+    if (xfer_crc_errors) kprintf("(%u bad frames discarded)\n", xfer_crc_errors);
+    xfer_crc_errors = 0;
+}
+#endif
+
+/* --- PCI configuration space (mechanism #1) --- */
+static uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    outl(0xCF8, 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) | ((uint32_t)fn << 8) | (off & 0xFC));
+    return inl(0xCFC);
+}
+
+static void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t val) {
+    outl(0xCF8, 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) | ((uint32_t)fn << 8) | (off & 0xFC));
+    outl(0xCFC, val);
+}
+
+struct pci_dev {
+    uint8_t bus, dev, fn;
+    uint16_t vendor, device;
+};
+
+/* Find the first function matching vendor and any of the given device ids */
+static int pci_find(uint16_t vendor, const uint16_t *ids, int nids, struct pci_dev *out) {
+    for (int bus = 0; bus < 256; ++bus) {
+        for (int dev = 0; dev < 32; ++dev) {
+            for (int fn = 0; fn < 8; ++fn) {
+                uint32_t id = pci_read32(bus, dev, fn, 0x00);
+                if ((id & 0xFFFF) == 0xFFFF) { if (fn == 0) break; continue; }
+                if ((id & 0xFFFF) == vendor) {
+                    for (int i = 0; i < nids; ++i) if ((id >> 16) == ids[i]) {
+                        out->bus = bus; out->dev = dev; out->fn = fn;
+                        out->vendor = vendor; out->device = ids[i];
+                        return 0;
+                    }
+                }
+                /* single-function device: skip the other functions */
+                if (fn == 0 && !(pci_read32(bus, dev, 0, 0x0C) & 0x00800000)) break;
+            }
+        }
+    }
+    return -1;
+}
+
+/* --- Network interfaces --- */
+#define ETH_HDR_LEN 14
+#define ETH_MTU 1500
+#define IP_HDR_LEN 20
+#define UDP_HDR_LEN 8
+#define TCP_HDR_LEN 20
+
+/* Default addressing matches QEMU user-mode networking (slirp) */
+#define NET_IP      0x0A00020Fu /* 10.0.2.15, default of net.ip */
+#define NET_NETMASK 0xFFFFFF00u
+#define NET_GATEWAY 0x0A000202u /* 10.0.2.2, default of net.gateway */
+static uint32_t net_ip = NET_IP, net_gateway = NET_GATEWAY;
+
+/* A frame is handed to the driver as a list of segments (headers, payload).
+   A stable segment stays valid until the frame is on the wire, so the driver
+   may DMA it in place instead of copying. */
+struct net_seg {
+    const void *data;
+    uint32_t len;
+    int stable;
+};
+
+struct netif {
+    const char *name;
+    int up;
+    int loopback; /* no link layer addressing */
+    uint8_t mac[6];
+    uint32_t ip, netmask, gw; /* host byte order */
+    int (*xmit)(struct netif *nif, const struct net_seg *segs, int nseg);
+    uint32_t rx_packets, rx_bytes, rx_dropped;
+    uint32_t tx_packets, tx_bytes, tx_dropped, tx_zerocopy;
+};
+
+static void net_rx(struct netif *nif, const uint8_t *frame, uint32_t len);
+
+/* big-endian field access on raw packet bytes */
+static inline uint16_t rd16be(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static inline uint32_t rd32be(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static inline void wr16be(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v & 0xFF; }
+static inline void wr32be(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = (v >> 16) & 0xFF; p[2] = (v >> 8) & 0xFF; p[3] = v & 0xFF; }
+
+#define IP_FMT "%u.%u.%u.%u"
+#define IP_ARGS(ip) (ip) >> 24, ((ip) >> 16) & 0xFF, ((ip) >> 8) & 0xFF, (ip) & 0xFF
+
+static void kput_ip(uint32_t ip) {
+    kprintf(IP_FMT, IP_ARGS(ip));
+}
+
+/* Parse a dotted quad; returns the position after it or 0 */
+static const char *parse_ip(const char *s, uint32_t *ip) {
+    uint32_t v = 0;
+    for (int part = 0; part < 4; ++part) {
+        if (part && *s++ != '.') return 0;
+        if (*s < '0' || *s > '9') return 0;
+        uint32_t n = 0;
+        while (*s >= '0' && *s <= '9') { n = n * 10 + (*s++ - '0'); if (n > 255) return 0; }
+        v = (v << 8) | n;
+    }
+    *ip = v;
+    return s;
+}
+
+/* --- Intel 8254x (e1000) NIC, polled --- */
+#define E1000_CTRL   0x0000
+#define E1000_STATUS 0x0008
+#define E1000_IMC    0x00D8
+#define E1000_RCTL   0x0100
+#define E1000_TCTL   0x0400
+#define E1000_TIPG   0x0410
+#define E1000_RDBAL  0x2800
+#define E1000_RDBAH  0x2804
+#define E1000_RDLEN  0x2808
+#define E1000_RDH    0x2810
+#define E1000_RDT    0x2818
+#define E1000_TDBAL  0x3800
+#define E1000_TDBAH  0x3804
+#define E1000_TDLEN  0x3808
+#define E1000_TDH    0x3810
+#define E1000_TDT    0x3818
+#define E1000_MTA    0x5200
+#define E1000_RAL    0x5400
+#define E1000_RAH    0x5404
+
+#define E1000_CTRL_ASDE  (1u << 5)
+#define E1000_CTRL_SLU   (1u << 6)
+#define E1000_CTRL_RST   (1u << 26)
+#define E1000_RCTL_EN    (1u << 1)
+#define E1000_RCTL_BAM   (1u << 15)
+#define E1000_RCTL_SECRC (1u << 26)
+#define E1000_TCTL_EN    (1u << 1)
+#define E1000_TCTL_PSP   (1u << 3)
+#define E1000_TXD_CMD_EOP  0x01
+#define E1000_TXD_CMD_IFCS 0x02
+#define E1000_TXD_CMD_RS   0x08
+#define E1000_DESC_DD      0x01
+#define E1000_RXD_STAT_EOP 0x02
+
+#define E1000_NUM_RX 32
+#define E1000_NUM_TX 64
+#define E1000_BUF_SIZE 2048
+#define E1000_COPYBREAK 256 /* smaller stable payloads are still copied (default of net.copybreak) */
+static uint32_t e1000_copybreak = E1000_COPYBREAK;
+
+struct e1000_rx_desc {
+    uint64_t addr;
+    uint16_t length;
+    uint16_t csum;
+    uint8_t status;
+    uint8_t errors;
+    uint16_t special;
+} __attribute__((packed));
+
+struct e1000_tx_desc {
+    uint64_t addr;
+    uint16_t length;
+    uint8_t cso;
+    uint8_t cmd;
+    uint8_t status;
+    uint8_t css;
+    uint16_t special;
+} __attribute__((packed));
+
+static volatile struct e1000_rx_desc e1000_rx_ring[E1000_NUM_RX] __attribute__((aligned(128)));
+static volatile struct e1000_tx_desc e1000_tx_ring[E1000_NUM_TX] __attribute__((aligned(128)));
+static uint8_t e1000_rx_bufs[E1000_NUM_RX][E1000_BUF_SIZE] __attribute__((aligned(16)));
+static uint8_t e1000_tx_bufs[E1000_NUM_TX][E1000_BUF_SIZE] __attribute__((aligned(16)));
+static volatile uint32_t *e1000_mmio;
+static uint32_t e1000_rx_cur = 0;
+static uint32_t e1000_tx_cur = 0;
+
+static inline uint32_t e1000_read(uint32_t reg) { return e1000_mmio[reg / 4]; }
+static inline void e1000_write(uint32_t reg, uint32_t val) { e1000_mmio[reg / 4] = val; }
+
+/* Headers are gathered into the descriptor's bounce buffer. A large stable
+   trailing segment gets its own descriptor and is read by the NIC in place. */
+static int e1000_xmit(struct netif *nif, const struct net_seg *segs, int nseg) {
+    int direct = nseg > 0 && segs[nseg - 1].stable && segs[nseg - 1].len >= e1000_copybreak;
+    int ncopy = direct ? nseg - 1 : nseg;
+    uint32_t cur = e1000_tx_cur, next = (cur + 1) % E1000_NUM_TX;
+    volatile struct e1000_tx_desc *d = &e1000_tx_ring[cur];
+    if (!(d->status & E1000_DESC_DD) || (direct && !(e1000_tx_ring[next].status & E1000_DESC_DD))) {
+        nif->tx_dropped++; return -1; /* ring full */
+    }
+    uint8_t *buf = e1000_tx_bufs[cur];
+    uint32_t len = 0;
+    for (int i = 0; i < ncopy; ++i) {
+        if (len + segs[i].len > E1000_BUF_SIZE) { nif->tx_dropped++; return -1; }
+        memcpy(buf + len, segs[i].data, segs[i].len);
+        len += segs[i].len;
+    }
+    d->addr = (uintptr_t)buf;
+    d->length = len;
+    /* RS on every descriptor so each one reports DD when it may be reused */
+    d->cmd = E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS | (direct ? 0 : E1000_TXD_CMD_EOP);
+    d->status = 0;
+    if (direct) {
+        volatile struct e1000_tx_desc *z = &e1000_tx_ring[next];
+        z->addr = (uintptr_t)segs[nseg - 1].data;
+        z->length = segs[nseg - 1].len;
+        z->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
+        z->status = 0;
+        len += segs[nseg - 1].len;
+        cur = next;
+        nif->tx_zerocopy++;
+    }
+    e1000_tx_cur = (cur + 1) % E1000_NUM_TX;
+    e1000_write(E1000_TDT, e1000_tx_cur);
+    nif->tx_packets++; nif->tx_bytes += len;
+    return 0;
+}
+
+static struct netif e1000_if = { "eth0", 0, 0, {0}, NET_IP, NET_NETMASK, NET_GATEWAY, e1000_xmit, 0, 0, 0, 0, 0, 0, 0 };
+
+static void e1000_poll(void) {
+    if (!e1000_if.up) return;
+    while (e1000_rx_ring[e1000_rx_cur].status & E1000_DESC_DD) {
+        volatile struct e1000_rx_desc *d = &e1000_rx_ring[e1000_rx_cur];
+        if ((d->status & E1000_RXD_STAT_EOP) && !d->errors) net_rx(&e1000_if, e1000_rx_bufs[e1000_rx_cur], d->length);
+        else e1000_if.rx_dropped++;
+        d->status = 0;
+        /* hand the descriptor back to the NIC */
+        e1000_write(E1000_RDT, e1000_rx_cur);
+        e1000_rx_cur = (e1000_rx_cur + 1) % E1000_NUM_RX;
+    }
+}
+
+static int e1000_init(void) {
+    static const uint16_t ids[] = { 0x100E, 0x100F, 0x1004 }; /* 82540EM (QEMU default), 82545EM, 82543GC */
+    struct pci_dev pd;
+    if (pci_find(0x8086, ids, 3, &pd) < 0) return -1;
+    e1000_if.ip = net_ip;
+    e1000_if.gw = net_gateway;
+    /* enable memory space and bus mastering */
+    uint32_t cmd = pci_read32(pd.bus, pd.dev, pd.fn, 0x04);
+    pci_write32(pd.bus, pd.dev, pd.fn, 0x04, cmd | 0x6);
+    e1000_mmio = (volatile uint32_t *)(uintptr_t)(pci_read32(pd.bus, pd.dev, pd.fn, 0x10) & ~0xFu);
+
+    e1000_write(E1000_IMC, 0xFFFFFFFF);
+    e1000_write(E1000_CTRL, e1000_read(E1000_CTRL) | E1000_CTRL_RST);
+    for (int i = 0; i < 100000 && (e1000_read(E1000_CTRL) & E1000_CTRL_RST); ++i) {}
+    e1000_write(E1000_IMC, 0xFFFFFFFF);
+    e1000_write(E1000_CTRL, e1000_read(E1000_CTRL) | E1000_CTRL_SLU | E1000_CTRL_ASDE);
+
+    uint32_t ral = e1000_read(E1000_RAL), rah = e1000_read(E1000_RAH);
+    for (int i = 0; i < 4; ++i) e1000_if.mac[i] = (ral >> (8 * i)) & 0xFF;
+    e1000_if.mac[4] = rah & 0xFF; e1000_if.mac[5] = (rah >> 8) & 0xFF;
+    for (int i = 0; i < 128; ++i) e1000_write(E1000_MTA + 4 * i, 0);
+
+    for (int i = 0; i < E1000_NUM_RX; ++i) {
+        e1000_rx_ring[i].addr = (uintptr_t)e1000_rx_bufs[i];
+        e1000_rx_ring[i].status = 0;
+    }
+    e1000_write(E1000_RDBAL, (uint32_t)(uintptr_t)e1000_rx_ring);
+    e1000_write(E1000_RDBAH, 0);
+    e1000_write(E1000_RDLEN, sizeof(e1000_rx_ring));
+    e1000_write(E1000_RDH, 0);
+    e1000_write(E1000_RDT, E1000_NUM_RX - 1);
+    e1000_write(E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SECRC); /* 2048-byte buffers */
+
+    for (int i = 0; i < E1000_NUM_TX; ++i) {
+        e1000_tx_ring[i].addr = 0;
+        e1000_tx_ring[i].cmd = 0;
+        e1000_tx_ring[i].status = E1000_DESC_DD; /* free */
+    }
+    e1000_write(E1000_TDBAL, (uint32_t)(uintptr_t)e1000_tx_ring);
+    e1000_write(E1000_TDBAH, 0);
+    e1000_write(E1000_TDLEN, sizeof(e1000_tx_ring));
+    e1000_write(E1000_TDH, 0);
+    e1000_write(E1000_TDT, 0);
+    e1000_write(E1000_TIPG, 10 | (8 << 10) | (6 << 20));
+    e1000_write(E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP | (0x10 << 4) | (0x40 << 12));
+
+    e1000_rx_cur = e1000_tx_cur = 0;
+    e1000_if.up = 1;
+    klog(KLOG_INFO, "eth0: e1000 %x at pci %u:%u.%u, mac %x:%x:%x:%x:%x:%x", pd.device, pd.bus, pd.dev, pd.fn,
+         e1000_if.mac[0], e1000_if.mac[1], e1000_if.mac[2], e1000_if.mac[3], e1000_if.mac[4], e1000_if.mac[5]);
+    return 0;
+}
+
+/* --- Loopback interface ---
+   Transmitted frames are handed straight back to the receive path in the
+   same context. Frames sent while a frame is being received (replies, ACKs)
+   are queued and handled by the outermost call, so the stack never recurses. */
+#define LO_QUEUE 64
+#define LO_FRAME_MAX (ETH_HDR_LEN + ETH_MTU)
+
+static uint8_t lo_frames[LO_QUEUE][LO_FRAME_MAX];
+static uint32_t lo_frame_len[LO_QUEUE];
+static uint32_t lo_head = 0, lo_tail = 0;
+static int lo_draining = 0;
+
+static int lo_xmit(struct netif *nif, const struct net_seg *segs, int nseg);
+
+static struct netif lo_if = { "lo", 1, 1, {0}, 0x7F000001u, 0xFF000000u, 0, lo_xmit, 0, 0, 0, 0, 0, 0, 0 };
+
+static int lo_xmit(struct netif *nif, const struct net_seg *segs, int nseg) {
+    if (lo_head - lo_tail == LO_QUEUE) { nif->tx_dropped++; return -1; }
+    uint8_t *f = lo_frames[lo_head % LO_QUEUE];
+    uint32_t len = 0;
+    for (int i = 0; i < nseg; ++i) {
+        if (len + segs[i].len > LO_FRAME_MAX) { nif->tx_dropped++; return -1; }
+        memcpy(f + len, segs[i].data, segs[i].len);
+        len += segs[i].len;
+    }
+    lo_frame_len[lo_head % LO_QUEUE] = len;
+    lo_head++;
+    nif->tx_packets++; nif->tx_bytes += len;
+    if (lo_draining) return 0;
+    lo_draining = 1;
+    while (lo_tail != lo_head) {
+        uint32_t slot = lo_tail % LO_QUEUE;
+        net_rx(nif, lo_frames[slot], lo_frame_len[slot]);
+        lo_tail++;
+    }
+    lo_draining = 0;
+    return 0;
+}
+
+/* --- ARP --- */
+#define ARP_CACHE_SIZE 8
+
+struct arp_entry {
+    uint32_t ip;
+    uint8_t mac[6];
+    int used;
+    uint32_t stamp;
+};
+
+static struct arp_entry arp_cache[ARP_CACHE_SIZE];
+static uint32_t arp_clock = 0;
+static const uint8_t eth_broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+static void arp_learn(uint32_t ip, const uint8_t *mac) {
+    int slot = 0;
+    for (int i = 0; i < ARP_CACHE_SIZE; ++i) {
+        if (arp_cache[i].used && arp_cache[i].ip == ip) { slot = i; break; }
+        /* otherwise evict the free or least recently refreshed entry */
+        if (!arp_cache[i].used || (arp_cache[slot].used && arp_cache[i].stamp < arp_cache[slot].stamp)) slot = i;
+    }
+    arp_cache[slot].ip = ip;
+    memcpy(arp_cache[slot].mac, mac, 6);
+    arp_cache[slot].used = 1;
+    arp_cache[slot].stamp = ++arp_clock;
+}
+
+static void arp_send(struct netif *nif, uint16_t op, const uint8_t *tha, uint32_t tpa) {
+    uint8_t f[ETH_HDR_LEN + 28];
+    memcpy(f, op == 1 ? eth_broadcast : tha, 6);
+    memcpy(f + 6, nif->mac, 6);
+    wr16be(f + 12, 0x0806);
+    uint8_t *a = f + ETH_HDR_LEN;
+    wr16be(a, 1); wr16be(a + 2, 0x0800); a[4] = 6; a[5] = 4; wr16be(a + 6, op);
+    memcpy(a + 8, nif->mac, 6); wr32be(a + 14, nif->ip);
+    if (op == 1) memset(a + 18, 0, 6); else memcpy(a + 18, tha, 6);
+    wr32be(a + 24, tpa);
+    struct net_seg seg = { f, sizeof(f), 0 };
+    nif->xmit(nif, &seg, 1);
+}
+
+/* Look up the MAC for a next hop; on a miss send a request and fail */
+static int arp_resolve(struct netif *nif, uint32_t ip, uint8_t *mac) {
+    for (int i = 0; i < ARP_CACHE_SIZE; ++i) if (arp_cache[i].used && arp_cache[i].ip == ip) {
+        memcpy(mac, arp_cache[i].mac, 6); return 0;
+    }
+    arp_send(nif, 1, 0, ip);
+    return -1;
+}
+
+static void arp_input(struct netif *nif, const uint8_t *a, uint32_t len) {
+    if (len < 28 || rd16be(a) != 1 || rd16be(a + 2) != 0x0800) return;
+    uint16_t op = rd16be(a + 6);
+    uint32_t spa = rd32be(a + 14), tpa = rd32be(a + 24);
+    if (tpa != nif->ip) return;
+    arp_learn(spa, a + 8);
+    if (op == 1) arp_send(nif, 2, a + 8, spa);
+}
+
+/* --- IPv4 / ICMP / UDP --- */
+static uint16_t ip_next_id = 1;
+
+/* Accumulate a ones' complement sum; only the last chunk may have odd length */
+static uint32_t csum_add_generic(uint32_t sum, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 1) { sum += (p[0] << 8) | p[1]; p += 2; len -= 2; }
+    if (len) sum += p[0] << 8;
+    return sum;
+}
+
+/* The ones' complement sum doesn't care about byte order (RFC 1071): add
+   little-endian words 16 bytes at a time, fold, and byte-swap the result
+   into the big-endian sum. A 32-bit lane gains at most 0x1FFFE per block,
+   so the lanes are emptied every 16K blocks. */
+SIMD_FN("sse2") static uint32_t csum_add_sse2(uint32_t sum, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t total = 0;
+    while (len >= 16) {
+        v4u32 acc = {0, 0, 0, 0};
+        for (uint32_t blocks = 0; len >= 16 && blocks < 16384; ++blocks, p += 16, len -= 16) {
+            v4u32 x;
+            __builtin_memcpy(&x, p, 16);
+            acc += (x & 0xFFFF) + (x >> 16);
+        }
+        total += (uint64_t)acc[0] + acc[1] + acc[2] + acc[3];
+    }
+    for (; len > 1; p += 2, len -= 2) total += p[0] | (p[1] << 8);
+    while (total >> 16) total = (total & 0xFFFF) + (total >> 16);
+    sum += ((total & 0xFF) << 8) | (total >> 8);
+    if (len) sum += p[0] << 8;
+    return sum;
+}
+
+static uint32_t (*csum_add)(uint32_t sum, const void *data, uint32_t len) = csum_add_generic;
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static struct netif *net_route(uint32_t dst) {
+    if ((dst >> 24) == 127 || (e1000_if.up && dst == e1000_if.ip)) return &lo_if;
+    return e1000_if.up ? &e1000_if : 0;
+}
+
+/* Send an IPv4 datagram: l4 header is copied, payload is passed through as a segment
+   (stable: see struct net_seg). Transport checksums (ICMP/UDP/TCP) are filled in here. */
+static int ip_output(uint32_t dst, uint8_t proto, uint8_t *l4, uint32_t l4len, const void *payload, uint32_t plen, int stable) {
+    struct netif *nif = net_route(dst);
+    if (!nif) return -1;
+    if (IP_HDR_LEN + l4len + plen > ETH_MTU) return -1;
+    uint8_t hdr[ETH_HDR_LEN + IP_HDR_LEN];
+    uint32_t hop = ((dst & nif->netmask) == (nif->ip & nif->netmask)) ? dst : nif->gw;
+    if (nif->loopback) memset(hdr, 0, 6);
+    else if (dst == 0xFFFFFFFFu) memcpy(hdr, eth_broadcast, 6);
+    else if (arp_resolve(nif, hop, hdr) < 0) { nif->tx_dropped++; return -1; }
+    memcpy(hdr + 6, nif->mac, 6);
+    wr16be(hdr + 12, 0x0800);
+
+    uint8_t *ip = hdr + ETH_HDR_LEN;
+    ip[0] = 0x45; ip[1] = 0;
+    wr16be(ip + 2, IP_HDR_LEN + l4len + plen);
+    wr16be(ip + 4, ip_next_id++);
+    wr16be(ip + 6, 0x4000); /* don't fragment */
+    ip[8] = 64; ip[9] = proto;
+    wr16be(ip + 10, 0);
+    wr32be(ip + 12, nif->ip);
+    wr32be(ip + 16, dst);
+    wr16be(ip + 10, csum_fold(csum_add(0, ip, IP_HDR_LEN)));
+
+    uint32_t sum = 0;
+    int csum_off = -1;
+    if (proto == 17 || proto == 6) {
+        uint8_t pseudo[12];
+        memcpy(pseudo, ip + 12, 8);
+        pseudo[8] = 0; pseudo[9] = proto; wr16be(pseudo + 10, l4len + plen);
+        sum = csum_add(0, pseudo, sizeof(pseudo));
+        csum_off = (proto == 17) ? 6 : 16;
+    } else if (proto == 1) {
+        csum_off = 2;
+    }
+    if (csum_off >= 0) {
+        wr16be(l4 + csum_off, 0);
+        uint16_t c = csum_fold(csum_add(csum_add(sum, l4, l4len), payload, plen));
+        if (proto == 17 && c == 0) c = 0xFFFF;
+        wr16be(l4 + csum_off, c);
+    }
+
+    struct net_seg segs[3] = { { hdr, sizeof(hdr), 0 }, { l4, l4len, 0 }, { payload, plen, stable } };
+    return nif->xmit(nif, segs, plen ? 3 : 2);
+}
+
+typedef void (*udp_handler_t)(uint32_t src_ip, uint16_t src_port, uint16_t dst_port, const uint8_t *data, uint32_t len);
+
+#define UDP_MAX_BINDS 8
+struct udp_bind {
+    uint16_t port;
+    udp_handler_t handler;
+};
+static struct udp_bind udp_binds[UDP_MAX_BINDS];
+
+static int udp_bind(uint16_t port, udp_handler_t handler) {
+    for (int i = 0; i < UDP_MAX_BINDS; ++i) if (!udp_binds[i].port) {
+        udp_binds[i].port = port; udp_binds[i].handler = handler; return 0;
+    }
+    return -1;
+}
+
+static int udp_send(uint32_t dst, uint16_t src_port, uint16_t dst_port, const void *data, uint32_t len) {
+    uint8_t uh[UDP_HDR_LEN];
+    wr16be(uh, src_port); wr16be(uh + 2, dst_port);
+    wr16be(uh + 4, UDP_HDR_LEN + len); wr16be(uh + 6, 0);
+    return ip_output(dst, 17, uh, UDP_HDR_LEN, data, len, 0);
+}
+
+/* --- Kernel log shipping over UDP ---
+   Records are batched into datagrams of text lines
+   "<name> <seq> <ms> <level> <message>" and sent from net_poll. The exporter
+   never blocks: it only reads the log ring, a token bucket limits the
+   datagram rate, and records overwritten before they could be sent are
+   counted as dropped. */
+#define LOGSHIP_MAX_PAYLOAD 1200
+#define LOGSHIP_DELAY_TICKS (TIMER_HZ / 5) /* max wait to fill a batch */
+#define LOGSHIP_RATE 20  /* datagrams per second (default of logship.rate) */
+#define LOGSHIP_BURST 5
+#define LOGSHIP_SRC_PORT 5140
+
+static int logship_enabled = 0;
+static uint32_t logship_ip;
+static uint16_t logship_port;
+static char logship_name[24];
+static uint32_t logship_seq = 0; /* next record to ship */
+static uint32_t logship_rate = LOGSHIP_RATE;
+static uint32_t logship_tokens = LOGSHIP_BURST;
+static uint32_t logship_refill_at = 0;
+static uint32_t logship_sent = 0, logship_dropped = 0;
+static uint8_t logship_buf[LOGSHIP_MAX_PAYLOAD];
+
+static void logship_start(uint32_t ip, uint16_t port, const char *name) {
+    logship_ip = ip; logship_port = port;
+    int i = 0;
+    for (; name[i] && i < (int)sizeof(logship_name) - 1; ++i) logship_name[i] = name[i];
+    logship_name[i] = '\0';
+    logship_seq = klog_next_seq > klog_records ? klog_next_seq - klog_records : 0;
+    logship_enabled = 1;
+}
+
+static void logship_poll(void) {
+    if (!logship_enabled || logship_seq == klog_next_seq) return;
+    if ((int32_t)(timer_ticks - logship_refill_at) >= 0) {
+        logship_tokens = LOGSHIP_BURST;
+        logship_refill_at = timer_ticks + TIMER_HZ * LOGSHIP_BURST / logship_rate;
+    }
+    if (!logship_tokens) return;
+    /* skip what the ring has already overwritten */
+    if (klog_next_seq - logship_seq > klog_records) {
+        logship_dropped += klog_next_seq - klog_records - logship_seq;
+        logship_seq = klog_next_seq - klog_records;
+    }
+    const struct klog_record *oldest = klog_get(logship_seq);
+    uint32_t pending = klog_next_seq - logship_seq;
+    if (pending * (KLOG_MSG / 2) < LOGSHIP_MAX_PAYLOAD && timer_ticks - oldest->ticks < LOGSHIP_DELAY_TICKS) return;
+
+    uint32_t len = 0, seq = logship_seq;
+    char line[KLOG_MSG + 48];
+    for (; seq < klog_next_seq; ++seq) {
+        const struct klog_record *r = klog_get(seq);
+        int n = ksnprintf(line, sizeof(line), "%s %u %u %c %s\n", logship_name, r->seq,
+                          r->ticks * (1000 / TIMER_HZ), klog_level_chars[r->level], r->msg);
+        if (len + n > LOGSHIP_MAX_PAYLOAD) break;
+        memcpy(logship_buf + len, line, n);
+        len += n;
+    }
+    if (udp_send(logship_ip, LOGSHIP_SRC_PORT, logship_port, logship_buf, len) < 0) return; /* retry on a later poll */
+    logship_tokens--;
+    logship_sent++;
+    logship_seq = seq;
+}
+
+static void logship_status(void) {
+    if (!logship_enabled) { kprintf("logship: off\n"); return; }
+    kprintf("logship: to "); kput_ip(logship_ip);
+    kprintf(":%u as %s, %u datagrams sent, %u records dropped, %u pending\n", logship_port, logship_name,
+            logship_sent, logship_dropped, klog_next_seq - logship_seq);
+}
+
+static void udp_input(uint32_t src, const uint8_t *u, uint32_t len) {
+    if (len < UDP_HDR_LEN) return;
+    uint16_t ulen = rd16be(u + 4);
+    if (ulen < UDP_HDR_LEN || ulen > len) return;
+    uint16_t dport = rd16be(u + 2);
+    for (int i = 0; i < UDP_MAX_BINDS; ++i) if (udp_binds[i].port == dport) {
+        udp_binds[i].handler(src, rd16be(u), dport, u + UDP_HDR_LEN, ulen - UDP_HDR_LEN);
+        return;
+    }
+}
+
+static void icmp_input(uint32_t src, const uint8_t *p, uint32_t len) {
+    if (len < 8 || p[0] != 8) return; /* echo request only */
+    uint8_t h[8];
+    memcpy(h, p, 8);
+    h[0] = 0; /* echo reply */
+    ip_output(src, 1, h, 8, p + 8, len - 8, 0);
+}
+
+/* --- TCP ---
+   Small TCP for kernel services: passive open, in-order receive, go-back-N
+   retransmission on a fixed RTO. Queued send data is kept by reference until
+   acknowledged: either in the connection's own copy buffer (tcp_write) or in
+   caller memory that stays valid that long (tcp_write_ref, zero copy). */
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+#define TCP_MAX_CONNS 8
+#define TCP_MAX_LISTEN 4
+#define TCP_MSS 1460
+#define TCP_RCV_WND 8192
+#define TCP_MAX_INFLIGHT (16 * TCP_MSS)
+#define TCP_TXQ 8
+#define TCP_TXBUF 2048
+#define TCP_RTO_TICKS (TIMER_HZ / 4)
+#define TCP_MAX_RETRIES 8
+#define TCP_IDLE_TICKS (60 * TIMER_HZ) /* drop half-closed peers that go quiet */
+
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+
+enum tcp_state {
+    TCP_CLOSED = 0, TCP_SYN_SENT, TCP_SYN_RCVD, TCP_ESTABLISHED, TCP_CLOSE_WAIT,
+    TCP_FIN_WAIT_1, TCP_FIN_WAIT_2, TCP_LAST_ACK
+};
+
+static const char *const tcp_state_names[] = {
+    "CLOSED", "SYN_SENT", "SYN_RCVD", "ESTABLISHED", "CLOSE_WAIT", "FIN_WAIT_1", "FIN_WAIT_2", "LAST_ACK"
+};
+
+struct tcp_conn;
+
+/* Application callbacks; recv with len 0 means the peer closed its side.
+   accepted also reports a completed tcp_connect, closed a failed one. */
+struct tcp_ops {
+    void (*accepted)(struct tcp_conn *c);
+    void (*recv)(struct tcp_conn *c, const uint8_t *data, uint32_t len);
+    void (*sent)(struct tcp_conn *c);
+    void (*closed)(struct tcp_conn *c);
+};
+
+struct tcp_ref {
+    const uint8_t *data;
+    uint32_t len;
+    int stable;
+};
+
+struct tcp_conn {
+    enum tcp_state state;
+    const struct tcp_ops *ops;
+    void *app;
+    uint32_t local_ip, remote_ip;
+    uint16_t local_port, remote_port;
+    uint32_t snd_una, snd_nxt, snd_wnd;
+    uint32_t rcv_nxt;
+    uint16_t mss;
+    int fin_queued, fin_sent;
+    uint32_t rto_at, rto_ticks, last_rx;
+    int retries;
+    struct tcp_ref txq[TCP_TXQ];
+    int txq_head, txq_count;
+    uint32_t txq_bytes;
+    uint8_t txbuf[TCP_TXBUF];
+    uint32_t txbuf_used;
+};
+
+struct tcp_listener {
+    uint16_t port;
+    const struct tcp_ops *ops;
+};
+
+static struct tcp_conn tcp_conns[TCP_MAX_CONNS];
+static struct tcp_listener tcp_listeners[TCP_MAX_LISTEN];
+static uint32_t tcp_iss = 0x1000;
+static uint16_t tcp_next_port = 49152;
+static uint32_t tcp_retransmits = 0;
+
+static int tcp_listen(uint16_t port, const struct tcp_ops *ops) {
+    for (int i = 0; i < TCP_MAX_LISTEN; ++i) if (!tcp_listeners[i].port) {
+        tcp_listeners[i].port = port; tcp_listeners[i].ops = ops; return 0;
+    }
+    return -1;
+}
+
+static int tcp_send_raw(uint32_t dst, uint16_t sport, uint16_t dport, uint8_t flags, uint32_t seq, uint32_t ack,
+                        const void *data, uint32_t len, int stable) {
+    uint8_t th[TCP_HDR_LEN + 4];
+    uint32_t hlen = TCP_HDR_LEN;
+    wr16be(th, sport); wr16be(th + 2, dport);
+    wr32be(th + 4, seq);
+    wr32be(th + 8, (flags & TCP_ACK) ? ack : 0);
+    if (flags & TCP_SYN) { /* advertise our MSS */
+        th[20] = 2; th[21] = 4; wr16be(th + 22, TCP_MSS);
+        hlen += 4;
+    }
+    th[12] = (hlen / 4) << 4; th[13] = flags;
+    wr16be(th + 14, TCP_RCV_WND);
+    wr16be(th + 16, 0); wr16be(th + 18, 0);
+    return ip_output(dst, 6, th, hlen, data, len, stable);
+}
+
+static int tcp_send_segment(struct tcp_conn *c, uint8_t flags, uint32_t seq, const void *data, uint32_t len, int stable) {
+    return tcp_send_raw(c->remote_ip, c->local_port, c->remote_port, flags, seq, c->rcv_nxt, data, len, stable);
+}
+
+/* Answer a segment that matches no connection */
+static void tcp_send_reset(uint32_t src, const uint8_t *t, uint32_t seglen) {
+    if (t[13] & TCP_ACK) tcp_send_raw(src, rd16be(t + 2), rd16be(t), TCP_RST, rd32be(t + 8), 0, 0, 0, 0);
+    else tcp_send_raw(src, rd16be(t + 2), rd16be(t), TCP_RST | TCP_ACK, 0, rd32be(t + 4) + seglen, 0, 0, 0);
+}
+
+static uint16_t tcp_parse_mss(const uint8_t *t, uint32_t hlen) {
+    uint16_t mss = 536;
+    for (uint32_t o = TCP_HDR_LEN; o + 1 < hlen; ) {
+        if (t[o] == 0) break;
+        if (t[o] == 1) { ++o; continue; }
+        if (t[o] == 2 && t[o + 1] == 4 && o + 4 <= hlen) mss = rd16be(t + o + 2);
+        if (t[o + 1] < 2) break;
+        o += t[o + 1];
+    }
+    return mss > TCP_MSS ? TCP_MSS : mss;
+}
+
+static void tcp_free(struct tcp_conn *c) {
+    enum tcp_state was = c->state;
+    c->state = TCP_CLOSED;
+    if (was != TCP_SYN_RCVD && c->ops->closed) c->ops->closed(c);
+}
+
+/* Reset the connection and drop it */
+static void tcp_abort(struct tcp_conn *c) {
+    tcp_send_segment(c, TCP_RST | TCP_ACK, c->snd_nxt, 0, 0, 0);
+    tcp_free(c);
+}
+
+static void tcp_arm_rto(struct tcp_conn *c) {
+    c->rto_at = timer_ticks + c->rto_ticks;
+}
+
+/* Send as much queued data (and a pending FIN) as the peer's window allows */
+static void tcp_output(struct tcp_conn *c) {
+    if (c->state != TCP_ESTABLISHED && c->state != TCP_CLOSE_WAIT) return;
+    uint32_t window = c->snd_wnd < TCP_MAX_INFLIGHT ? c->snd_wnd : TCP_MAX_INFLIGHT;
+    while (!c->fin_sent) {
+        uint32_t off = c->snd_nxt - c->snd_una;
+        if (off == c->txq_bytes) {
+            if (!c->fin_queued) break;
+            if (tcp_send_segment(c, TCP_FIN | TCP_ACK, c->snd_nxt, 0, 0, 0) < 0) break;
+            c->snd_nxt++; c->fin_sent = 1;
+            c->state = (c->state == TCP_ESTABLISHED) ? TCP_FIN_WAIT_1 : TCP_LAST_ACK;
+            if (c->rto_at == 0) tcp_arm_rto(c);
+            break;
+        }
+        if (off >= window) break;
+        /* locate the queued chunk holding this offset; segments never span chunks */
+        int i = c->txq_head;
+        while (off >= c->txq[i].len) { off -= c->txq[i].len; i = (i + 1) % TCP_TXQ; }
+        uint32_t len = c->txq[i].len - off;
+        if (len > c->mss) len = c->mss;
+        if (len > window - (c->snd_nxt - c->snd_una)) len = window - (c->snd_nxt - c->snd_una);
+        if (tcp_send_segment(c, TCP_ACK | TCP_PSH, c->snd_nxt, c->txq[i].data + off, len, c->txq[i].stable) < 0) break;
+        c->snd_nxt += len;
+        if (c->rto_at == 0) tcp_arm_rto(c);
+    }
+}
+
+static int tcp_enqueue(struct tcp_conn *c, const uint8_t *data, uint32_t len, int stable) {
+    if (c->txq_count == TCP_TXQ || c->fin_queued) return -1;
+    struct tcp_ref *r = &c->txq[(c->txq_head + c->txq_count) % TCP_TXQ];
+    r->data = data; r->len = len; r->stable = stable;
+    c->txq_count++;
+    c->txq_bytes += len;
+    return 0;
+}
+
+/* Queue a copy of data; fails if the connection's copy buffer is full */
+static int tcp_write(struct tcp_conn *c, const void *data, uint32_t len) {
+    if (len == 0) return 0;
+    if (c->txbuf_used + len > TCP_TXBUF) return -1;
+    uint8_t *dst = c->txbuf + c->txbuf_used;
+    memcpy(dst, data, len);
+    if (tcp_enqueue(c, dst, len, 0) < 0) return -1;
+    c->txbuf_used += len;
+    return 0;
+}
+
+/* Queue data by reference: it must stay valid until acknowledged */
+static int tcp_write_ref(struct tcp_conn *c, const void *data, uint32_t len) {
+    if (len == 0) return 0;
+    return tcp_enqueue(c, (const uint8_t *)data, len, 1);
+}
+
+/* Active open; ops->accepted runs once established, ops->closed if it fails */
+static struct tcp_conn *tcp_connect(uint32_t dst, uint16_t port, const struct tcp_ops *ops, void *app) {
+    struct tcp_conn *c = 0;
+    for (int i = 0; i < TCP_MAX_CONNS; ++i) if (tcp_conns[i].state == TCP_CLOSED) { c = &tcp_conns[i]; break; }
+    struct netif *nif = net_route(dst);
+    if (!c || !nif) return 0;
+    memset(c, 0, sizeof(*c));
+    c->state = TCP_SYN_SENT;
+    c->ops = ops; c->app = app;
+    c->local_ip = nif->ip; c->remote_ip = dst;
+    c->local_port = tcp_next_port; c->remote_port = port;
+    tcp_next_port = tcp_next_port == 0xFFFF ? 49152 : tcp_next_port + 1;
+    tcp_iss += 64000 + timer_ticks;
+    c->snd_una = tcp_iss; c->snd_nxt = tcp_iss + 1;
+    c->mss = 536;
+    c->rto_ticks = TCP_RTO_TICKS;
+    c->last_rx = timer_ticks;
+    tcp_arm_rto(c);
+    tcp_send_segment(c, TCP_SYN, c->snd_una, 0, 0, 0); /* may complete at once over loopback */
+    return c;
+}
+
+static int tcp_queue_empty(struct tcp_conn *c) { return c->txq_count == 0; }
+
+/* Push queued data out; call after a batch of tcp_write/tcp_write_ref */
+static void tcp_flush(struct tcp_conn *c) { tcp_output(c); }
+
+static void tcp_close(struct tcp_conn *c) {
+    if (c->state != TCP_ESTABLISHED && c->state != TCP_CLOSE_WAIT) return;
+    c->fin_queued = 1;
+    tcp_output(c);
+}
+
+static void tcp_ack_data(struct tcp_conn *c, uint32_t acked) {
+    if (acked > c->txq_bytes) acked = c->txq_bytes; /* the rest acknowledges our FIN */
+    c->txq_bytes -= acked;
+    while (acked > 0) {
+        struct tcp_ref *r = &c->txq[c->txq_head];
+        if (acked < r->len) { r->data += acked; r->len -= acked; break; }
+        acked -= r->len;
+        c->txq_head = (c->txq_head + 1) % TCP_TXQ;
+        c->txq_count--;
+    }
+    if (c->txq_count == 0) c->txbuf_used = 0;
+}
+
+static void tcp_input(uint32_t src, uint32_t dst, const uint8_t *t, uint32_t len) {
+    if (len < TCP_HDR_LEN) return;
+    uint32_t hlen = (t[12] >> 4) * 4;
+    if (hlen < TCP_HDR_LEN || hlen > len) return;
+    uint8_t pseudo[12];
+    wr32be(pseudo, src); wr32be(pseudo + 4, dst);
+    pseudo[8] = 0; pseudo[9] = 6; wr16be(pseudo + 10, len);
+    if (csum_fold(csum_add(csum_add(0, pseudo, 12), t, len)) != 0) return;
+
+    uint16_t sport = rd16be(t), dport = rd16be(t + 2);
+    uint32_t seq = rd32be(t + 4), ack = rd32be(t + 8);
+    uint8_t flags = t[13];
+    const uint8_t *data = t + hlen;
+    uint32_t dlen = len - hlen;
+
+    struct tcp_conn *c = 0;
+    for (int i = 0; i < TCP_MAX_CONNS; ++i) {
+        struct tcp_conn *k = &tcp_conns[i];
+        if (k->state != TCP_CLOSED && k->remote_ip == src && k->remote_port == sport && k->local_port == dport) { c = k; break; }
+    }
+
+    if (!c) {
+        if (flags & TCP_RST) return;
+        const struct tcp_ops *ops = 0;
+        for (int i = 0; i < TCP_MAX_LISTEN; ++i) if (tcp_listeners[i].port == dport) ops = tcp_listeners[i].ops;
+        if (!ops || (flags & (TCP_SYN | TCP_ACK)) != TCP_SYN) { tcp_send_reset(src, t, dlen + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0)); return; }
+        for (int i = 0; i < TCP_MAX_CONNS; ++i) if (tcp_conns[i].state == TCP_CLOSED) { c = &tcp_conns[i]; break; }
+        if (!c) return; /* table full: let the peer retry its SYN */
+        memset(c, 0, sizeof(*c));
+        c->state = TCP_SYN_RCVD;
+        c->ops = ops;
+        c->local_ip = dst; c->remote_ip = src;
+        c->local_port = dport; c->remote_port = sport;
+        c->rcv_nxt = seq + 1;
+        tcp_iss += 64000 + timer_ticks;
+        c->snd_una = tcp_iss; c->snd_nxt = tcp_iss + 1;
+        c->snd_wnd = rd16be(t + 14);
+        c->mss = tcp_parse_mss(t, hlen);
+        c->rto_ticks = TCP_RTO_TICKS;
+        c->last_rx = timer_ticks;
+        tcp_send_segment(c, TCP_SYN | TCP_ACK, c->snd_una, 0, 0, 0);
+        tcp_arm_rto(c);
+        return;
+    }
+
+    c->last_rx = timer_ticks;
+    if (flags & TCP_RST) { tcp_free(c); return; }
+
+    if (c->state == TCP_SYN_SENT) {
+        if ((flags & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK) || ack != c->snd_una + 1) return;
+        c->rcv_nxt = seq + 1;
+        c->snd_una = ack;
+        c->snd_wnd = rd16be(t + 14);
+        c->mss = tcp_parse_mss(t, hlen);
+        c->state = TCP_ESTABLISHED;
+        c->rto_at = 0; c->retries = 0; c->rto_ticks = TCP_RTO_TICKS;
+        tcp_send_segment(c, TCP_ACK, c->snd_nxt, 0, 0, 0);
+        if (c->ops->accepted) c->ops->accepted(c);
+        if (c->state != TCP_CLOSED) tcp_output(c);
+        return;
+    }
+
+    if (flags & TCP_ACK) {
+        if (c->state == TCP_SYN_RCVD) {
+            if (ack != c->snd_una + 1) { tcp_send_reset(src, t, dlen); tcp_free(c); return; }
+            c->snd_una = ack;
+            c->state = TCP_ESTABLISHED;
+            c->rto_at = 0; c->retries = 0;
+            if (c->ops->accepted) c->ops->accepted(c);
+        } else if (SEQ_LT(c->snd_una, ack) && SEQ_LEQ(ack, c->snd_nxt)) {
+            tcp_ack_data(c, ack - c->snd_una);
+            c->snd_una = ack;
+            c->retries = 0; c->rto_ticks = TCP_RTO_TICKS;
+            c->rto_at = 0;
+            if (c->snd_una != c->snd_nxt) tcp_arm_rto(c);
+            if (c->fin_sent && c->snd_una == c->snd_nxt) {
+                if (c->state == TCP_FIN_WAIT_1) c->state = TCP_FIN_WAIT_2;
+                else if (c->state == TCP_LAST_ACK) { tcp_free(c); return; }
+            }
+            if (c->ops->sent) c->ops->sent(c);
+            if (c->state == TCP_CLOSED) return;
+        }
+        c->snd_wnd = rd16be(t + 14);
+    }
+
+    if (dlen > 0 || (flags & TCP_FIN)) {
+        if (seq != c->rcv_nxt) {
+            /* out of order or a retransmission: re-acknowledge what we have */
+            tcp_send_segment(c, TCP_ACK, c->snd_nxt, 0, 0, 0);
+            return;
+        }
+        if (dlen > 0 && (c->state == TCP_ESTABLISHED || c->state == TCP_FIN_WAIT_1 || c->state == TCP_FIN_WAIT_2)) {
+            c->rcv_nxt += dlen;
+            c->ops->recv(c, data, dlen);
+            if (c->state == TCP_CLOSED) return;
+        }
+        if (flags & TCP_FIN) {
+            c->rcv_nxt++;
+            tcp_send_segment(c, TCP_ACK, c->snd_nxt, 0, 0, 0);
+            if (c->state == TCP_ESTABLISHED) {
+                c->state = TCP_CLOSE_WAIT;
+                c->ops->recv(c, 0, 0);
+            } else if (c->state == TCP_FIN_WAIT_1 || c->state == TCP_FIN_WAIT_2) {
+                /* both sides done; no TIME_WAIT in this stack */
+                tcp_free(c);
+            }
+            return;
+        }
+        tcp_send_segment(c, TCP_ACK, c->snd_nxt, 0, 0, 0);
+    }
+    tcp_output(c);
+}
+
+/* Retransmission timers and deferred output; runs from net_poll */
+static void tcp_poll(void) {
+    for (int i = 0; i < TCP_MAX_CONNS; ++i) {
+        struct tcp_conn *c = &tcp_conns[i];
+        if (c->state == TCP_CLOSED) continue;
+        if (c->rto_at && (int32_t)(timer_ticks - c->rto_at) >= 0) {
+            if (++c->retries > TCP_MAX_RETRIES) {
+                klog(KLOG_WARN, "tcp: :%u <- " IP_FMT ":%u timed out", c->local_port, IP_ARGS(c->remote_ip), c->remote_port);
+                tcp_abort(c);
+                continue;
+            }
+            tcp_retransmits++;
+            c->rto_ticks *= 2;
+            if (c->state == TCP_SYN_SENT) {
+                tcp_send_segment(c, TCP_SYN, c->snd_una, 0, 0, 0);
+            } else if (c->state == TCP_SYN_RCVD) {
+                tcp_send_segment(c, TCP_SYN | TCP_ACK, c->snd_una, 0, 0, 0);
+            } else {
+                /* go back to the oldest unacknowledged byte */
+                if (c->fin_sent) {
+                    c->fin_sent = 0;
+                    c->state = (c->state == TCP_FIN_WAIT_1) ? TCP_ESTABLISHED : TCP_CLOSE_WAIT;
+                }
+                c->snd_nxt = c->snd_una;
+            }
+            c->rto_at = 0;
+            tcp_output(c);
+            if (c->rto_at == 0) tcp_arm_rto(c);
+        } else if (c->state == TCP_FIN_WAIT_2 && timer_ticks - c->last_rx > TCP_IDLE_TICKS) {
+            tcp_free(c);
+        } else if (c->txq_count && c->rto_at == 0 && timer_ticks - c->last_rx > TCP_IDLE_TICKS) {
+            tcp_abort(c); /* a zero window that never opens would hold the queued data forever */
+        } else {
+            tcp_output(c); /* retry anything the NIC had no room for */
+        }
+    }
+}
+
+static void tcp_status(void) {
+    kprintf("  tcp: %u retransmits\n", tcp_retransmits);
+    for (int i = 0; i < TCP_MAX_CONNS; ++i) if (tcp_conns[i].state != TCP_CLOSED) {
+        struct tcp_conn *c = &tcp_conns[i];
+        kprintf("    :%u %s ", c->local_port, c->state == TCP_SYN_SENT ? "->" : "<-"); kput_ip(c->remote_ip);
+        kprintf(":%u %s, %u bytes queued\n", c->remote_port, tcp_state_names[c->state], c->txq_bytes);
+    }
+}
+
+static void ip_input(struct netif *nif, const uint8_t *eth_src, const uint8_t *ip, uint32_t len) {
+    if (len < IP_HDR_LEN || (ip[0] >> 4) != 4) return;
+    uint32_t ihl = (ip[0] & 0xF) * 4;
+    uint32_t tot = rd16be(ip + 2);
+    if (ihl < IP_HDR_LEN || tot < ihl || tot > len) return;
+    if (csum_fold(csum_add(0, ip, ihl)) != 0) { nif->rx_dropped++; return; }
+    if (rd16be(ip + 6) & 0x3FFF) { nif->rx_dropped++; return; } /* no fragment reassembly */
+    uint32_t src = rd32be(ip + 12), dst = rd32be(ip + 16);
+    if (nif->loopback) {
+        if ((dst & nif->netmask) != (nif->ip & nif->netmask) && dst != e1000_if.ip) return;
+    } else {
+        if (dst != nif->ip && dst != 0xFFFFFFFFu) return;
+        /* remember how to reach the sender (or the router it came through) */
+        arp_learn(((src & nif->netmask) == (nif->ip & nif->netmask)) ? src : nif->gw, eth_src);
+    }
+    if (ip[9] == 1) icmp_input(src, ip + ihl, tot - ihl);
+    else if (ip[9] == 17) udp_input(src, ip + ihl, tot - ihl);
+    else if (ip[9] == 6) tcp_input(src, dst, ip + ihl, tot - ihl);
+}
+
+static void net_rx(struct netif *nif, const uint8_t *frame, uint32_t len) {
+    nif->rx_packets++; nif->rx_bytes += len;
+    if (len < ETH_HDR_LEN) { nif->rx_dropped++; return; }
+    uint16_t type = rd16be(frame + 12);
+    if (type == 0x0806) arp_input(nif, frame + ETH_HDR_LEN, len - ETH_HDR_LEN);
+    else if (type == 0x0800) ip_input(nif, frame + 6, frame + ETH_HDR_LEN, len - ETH_HDR_LEN);
+}
+
+/* Packets in and out on both interfaces */
+static uint32_t net_packets(void) {
+    return lo_if.rx_packets + lo_if.tx_packets + e1000_if.rx_packets + e1000_if.tx_packets;
+}
+
+/* Called whenever the kernel is idle (e.g. waiting for a key) */
+static void net_poll(void) {
+    static int polling = 0;
+    if (polling) return;
+    polling = 1;
+    /* the poll counts as network time only if a packet came or went */
+    uint32_t packets = net_packets();
+    int prev = task_switch(TASK_NET);
+    e1000_poll();
+    tcp_poll();
+    logship_poll();
+    task_account(net_packets() != packets ? TASK_NET : prev, prev);
+    polling = 0;
+}
+
+static void net_status(void) {
+    struct netif *const ifs[] = { &lo_if, &e1000_if };
+    for (int k = 0; k < 2; ++k) {
+        struct netif *nif = ifs[k];
+        if (!nif->up) continue;
+        kprintf("%s: ", nif->name);
+        kput_ip(nif->ip);
+        if (!nif->loopback) {
+            kprintf(" gw "); kput_ip(nif->gw);
+            kprintf(" mac ");
+            for (int i = 0; i < 6; ++i) kprintf(i ? ":%x" : "%x", nif->mac[i]);
+        }
+        kprintf("\n  rx %u pkts %u bytes %u dropped\n", nif->rx_packets, nif->rx_bytes, nif->rx_dropped);
+        kprintf("  tx %u pkts %u bytes %u dropped %u zero-copy\n", nif->tx_packets, nif->tx_bytes, nif->tx_dropped, nif->tx_zerocopy);
+    }
+    if (!e1000_if.up) kprintf("eth0: no NIC\n");
+    tcp_status();
+}
+
+/* --- HTTP/1.1 server (read-only view of the in-memory FS) ---
+   One request is answered at a time per connection; a pipelined request
+   waits until the previous response has been acknowledged. File bodies are
+   queued by reference, so the NIC reads them straight from file storage. */
+#define HTTP_PORT 80
+#define HTTP_REQ_MAX 1024
+
+struct http_conn {
+    struct tcp_conn *tcp;
+    int keep_alive;
+    int pinned; /* files[] index of a body queued by reference, or -1 */
+    uint32_t len;
+    char req[HTTP_REQ_MAX];
+};
+
+static struct http_conn http_conns[TCP_MAX_CONNS];
+static uint32_t http_requests = 0;
+
+static int http_ieq(const char *a, const char *b, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        char x = a[i], y = b[i];
+        if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if (x != y) return 0;
+    }
+    return 1;
+}
+
+/* Value of a request header (case-insensitive name), or 0 */
+static const char *http_header(const char *req, uint32_t len, const char *name, uint32_t *vlen) {
+    uint32_t nlen = 0; while (name[nlen]) ++nlen;
+    for (uint32_t i = 0; i + nlen + 1 < len; ++i) {
+        if ((i == 0 || req[i - 1] != '\n') || !http_ieq(req + i, name, nlen) || req[i + nlen] != ':') continue;
+        uint32_t v = i + nlen + 1;
+        while (v < len && req[v] == ' ') ++v;
+        uint32_t e = v;
+        while (e < len && req[e] != '\r' && req[e] != '\n') ++e;
+        *vlen = e - v;
+        return req + v;
+    }
+    return 0;
+}
+
+static void http_unpin(struct http_conn *h) {
+    if (h->pinned >= 0) files[h->pinned].pins--;
+    h->pinned = -1;
+}
+
+/* by_ref is a files[] index whose data is the body, sent without a copy and
+   pinned until acknowledged, or -1 to copy the body */
+static void http_respond(struct http_conn *h, const char *status, const char *body, uint32_t body_len, int head_only, int by_ref) {
+    char hdr[192];
+    int n = ksnprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nServer: MiniOS\r\nContent-Type: text/plain\r\nContent-Length: %u\r\nConnection: %s\r\n\r\n",
+                      status, body_len, h->keep_alive ? "keep-alive" : "close");
+    int r = tcp_write(h->tcp, hdr, n);
+    if (r == 0 && !head_only) {
+        if (by_ref >= 0) {
+            r = tcp_write_ref(h->tcp, body, body_len);
+            if (r == 0 && body_len) { h->pinned = by_ref; files[by_ref].pins++; }
+        } else {
+            r = tcp_write(h->tcp, body, body_len);
+        }
+    }
+    if (r < 0) { /* no room for the whole response: a truncated one would desync the client */
+        klog(KLOG_WARN, "http: no room to queue a %u-byte response", body_len);
+        tcp_abort(h->tcp);
+        return;
+    }
+    if (!h->keep_alive) tcp_close(h->tcp);
+    tcp_flush(h->tcp);
+    http_requests++;
+}
+
+/* Answer the first complete request in the buffer; returns 1 if one was handled */
+static int http_process(struct http_conn *h) {
+    uint32_t end = 0;
+    for (uint32_t i = 3; i < h->len; ++i) if (h->req[i - 3] == '\r' && h->req[i - 2] == '\n' && h->req[i - 1] == '\r' && h->req[i] == '\n') { end = i + 1; break; }
+    if (!end) {
+        if (h->len == HTTP_REQ_MAX) { h->keep_alive = 0; http_respond(h, "400 Bad Request", "request too large\n", 18, 0, -1); }
+        return 0;
+    }
+
+    const char *r = h->req;
+    int head_only = 0;
+    uint32_t p;
+    if (end > 4 && r[0] == 'G' && r[1] == 'E' && r[2] == 'T' && r[3] == ' ') p = 4;
+    else if (end > 5 && r[0] == 'H' && r[1] == 'E' && r[2] == 'A' && r[3] == 'D' && r[4] == ' ') { p = 5; head_only = 1; }
+    else p = 0;
+
+    /* /<file> for a file; /proc/<file> is kept whole, as procfs names it */
+    char path[MAX_NAME + 2];
+    uint32_t pl = 0;
+    int too_long = 0;
+    if (p) {
+        if (r[p] == '/') ++p;
+        while (p < end && r[p] != ' ' && r[p] != '?' && r[p] != '\r') {
+            if (pl < MAX_NAME) path[1 + pl++] = r[p]; else too_long = 1;
+            ++p;
+        }
+        while (p < end && r[p] != ' ' && r[p] != '\r') ++p;
+    }
+    path[0] = '/';
+    path[1 + pl] = '\0';
+    klog(KLOG_DEBUG, "http: %s %s", p ? (head_only ? "HEAD" : "GET") : "?", path);
+    /* HTTP/1.1 defaults to keep-alive, 1.0 to close */
+    int http11 = p + 9 <= end && r[p] == ' ' && r[p + 8] == '1' && r[p + 6] == '1';
+    uint32_t vlen;
+    const char *conn = http_header(r, end, "Connection", &vlen);
+    h->keep_alive = conn ? (vlen >= 10 && http_ieq(conn, "keep-alive", 10)) : http11;
+
+    /* consume the request before answering so pipelined data stays in order */
+    h->len -= end;
+    for (uint32_t i = 0; i < h->len; ++i) h->req[i] = h->req[end + i];
+
+    if (!p) { h->keep_alive = 0; http_respond(h, "405 Method Not Allowed", "read-only server: GET and HEAD only\n", 36, 0, -1); return 1; }
+    if (pl == 0) {
+        char list[TCP_TXBUF - 256];
+        int n = 0;
+        for (int i = 0; i < (int)fs_max_files; ++i) if (files[i].used)
+            n += ksnprintf(list + n, sizeof(list) - n, "%s %d\n", files[i].name, files[i].size);
+#ifdef CONFIG_PROCFS
+        n += proc_index(list + n, (int)sizeof(list) - n);
+#endif
+        http_respond(h, "200 OK", list, n, head_only, -1);
+        return 1;
+    }
+#ifdef CONFIG_PROCFS
+    if (!too_long && proc_path(path)) {
+        int size;
+        const char *data = fs_data(path, &size);
+        if (!data) { http_respond(h, "404 Not Found", "no such file\n", 13, head_only, -1); return 1; }
+        http_respond(h, "200 OK", data, (uint32_t)size, head_only, -1); /* the next read reuses the buffer */
+        return 1;
+    }
+#endif
+    int idx = too_long ? -1 : fs_find(path + 1);
+    if (idx < 0) { http_respond(h, "404 Not Found", "no such file\n", 13, head_only, -1); return 1; }
+    http_respond(h, "200 OK", files[idx].data, files[idx].size, head_only, idx);
+    return 1;
+}
+
+static void http_accepted(struct tcp_conn *c) {
+    struct http_conn *h = &http_conns[c - tcp_conns];
+    h->tcp = c; h->len = 0; h->keep_alive = 1; h->pinned = -1;
+    c->app = h;
+}
+
+static void http_recv(struct tcp_conn *c, const uint8_t *data, uint32_t len) {
+    struct http_conn *h = (struct http_conn *)c->app;
+    if (len == 0) { tcp_close(c); return; } /* client is done */
+    for (uint32_t i = 0; i < len && h->len < HTTP_REQ_MAX; ++i) h->req[h->len++] = (char)data[i];
+    if (tcp_queue_empty(c)) http_process(h);
+}
+
+static void http_sent(struct tcp_conn *c) {
+    struct http_conn *h = (struct http_conn *)c->app;
+    if (tcp_queue_empty(c)) http_unpin(h);
+    if (tcp_queue_empty(c) && h->len && h->keep_alive && c->state == TCP_ESTABLISHED) http_process(h);
+}
+
+static void http_closed(struct tcp_conn *c) {
+    struct http_conn *h = (struct http_conn *)c->app;
+    if (h) { h->tcp = 0; http_unpin(h); }
+}
+
+static const struct tcp_ops http_ops = { http_accepted, http_recv, http_sent, http_closed };
+
+static void http_status(void) {
+    kprintf("http: tcp port %d, %u requests served\n", HTTP_PORT, http_requests);
+}
+
+/* --- Network benchmarks over loopback (netbench) ---
+   TCP and UDP throughput and round-trip latency through the full socket
+   path (IP, checksums, TCP state machine) with no NIC involved. Timing
+   uses the TSC with the boot-time calibration (see "Wall clock"). */
+#define NETBENCH_TCP_SINK 5001
+#define NETBENCH_TCP_ECHO 5002
+#define NETBENCH_UDP_SINK 5003
+#define NETBENCH_UDP_ECHO 5004
+#define NETBENCH_UDP_CLIENT 5005
+#define NETBENCH_ROUNDS 2000
+#define NETBENCH_MSG 64
+#define NETBENCH_TIMEOUT_TICKS (10 * TIMER_HZ)
+#define NETBENCH_MAX_KIB 1048576 /* the byte count must fit in 32 bits */
+
+static uint8_t netbench_buf[16384];
+static uint32_t nb_sink_bytes, nb_replies;
+static int nb_client_state; /* 0 connecting, 1 established, -1 closed */
+static int nb_ready = 0;
+
+static void nb_sink_recv(struct tcp_conn *c, const uint8_t *data, uint32_t len) {
+    (void)data;
+    if (len == 0) tcp_close(c); else nb_sink_bytes += len;
+}
+
+static void nb_echo_recv(struct tcp_conn *c, const uint8_t *data, uint32_t len) {
+    if (len == 0) { tcp_close(c); return; }
+    if (tcp_write(c, data, len) < 0) { tcp_abort(c); return; }
+    tcp_flush(c);
+}
+
+static void nb_client_accepted(struct tcp_conn *c) { (void)c; nb_client_state = 1; }
+static void nb_client_recv(struct tcp_conn *c, const uint8_t *data, uint32_t len) { (void)c; (void)data; nb_replies += len; }
+static void nb_client_closed(struct tcp_conn *c) { (void)c; nb_client_state = -1; }
+
+static const struct tcp_ops nb_sink_ops = { 0, nb_sink_recv, 0, 0 };
+static const struct tcp_ops nb_echo_ops = { 0, nb_echo_recv, 0, 0 };
+static const struct tcp_ops nb_client_ops = { nb_client_accepted, nb_client_recv, 0, nb_client_closed };
+
+static void nb_udp_sink(uint32_t src_ip, uint16_t src_port, uint16_t dst_port, const uint8_t *data, uint32_t len) {
+    (void)src_ip; (void)src_port; (void)dst_port; (void)data;
+    nb_sink_bytes += len;
+}
+
+static void nb_udp_echo(uint32_t src_ip, uint16_t src_port, uint16_t dst_port, const uint8_t *data, uint32_t len) {
+    udp_send(src_ip, dst_port, src_port, data, len);
+}
+
+static void nb_udp_client(uint32_t src_ip, uint16_t src_port, uint16_t dst_port, const uint8_t *data, uint32_t len) {
+    (void)src_ip; (void)src_port; (void)dst_port; (void)data;
+    nb_replies += len;
+}
+
+/* Every netbench wait loop checks this, so it also keeps the soft watchdog quiet */
+static int nb_timed_out(uint32_t start) {
+    watchdog_touch();
+    return timer_ticks - start > NETBENCH_TIMEOUT_TICKS;
+}
+
+static void netbench_report(const char *what, uint32_t bytes, uint32_t ops, uint64_t cycles, uint32_t khz) {
+    uint32_t us = (uint32_t)div64_32(cycles * 1000, khz);
+    if (us == 0) us = 1;
+    kprintf("  %s: %u ops, %u KiB in %u us", what, ops, bytes / 1024, us);
+    if (bytes >= 1024 * 16) kprintf(", %u KiB/s", (uint32_t)div64_32((uint64_t)bytes * 1000000 / 1024, us));
+    if (ops) kprintf(", %u ns/op", (uint32_t)div64_32(div64_32(cycles * 1000000, khz), ops));
+    kprintf("\n");
+}
+
+static void netbench(uint32_t total) {
+    if (!nb_ready) {
+        tcp_listen(NETBENCH_TCP_SINK, &nb_sink_ops);
+        tcp_listen(NETBENCH_TCP_ECHO, &nb_echo_ops);
+        udp_bind(NETBENCH_UDP_SINK, nb_udp_sink);
+        udp_bind(NETBENCH_UDP_ECHO, nb_udp_echo);
+        udp_bind(NETBENCH_UDP_CLIENT, nb_udp_client);
+        nb_ready = 1;
+    }
+    for (uint32_t i = 0; i < sizeof(netbench_buf); ++i) netbench_buf[i] = (uint8_t)i;
+    uint32_t khz = tsc_khz;
+    kprintf("netbench over lo (TSC %u MHz), %u KiB per stream test\n", khz / 1000, total / 1024);
+    const uint32_t lo = lo_if.ip;
+
+    /* TCP stream: queue the same buffer by reference until total is acknowledged */
+    nb_sink_bytes = 0; nb_client_state = 0;
+    uint32_t start = timer_ticks;
+    uint64_t c0 = rdtsc();
+    struct tcp_conn *c = tcp_connect(lo, NETBENCH_TCP_SINK, &nb_client_ops, 0);
+    uint32_t queued = 0;
+    while (c && nb_client_state == 1 && nb_sink_bytes < total && !nb_timed_out(start)) {
+        while (queued < total && c->txq_count < TCP_TXQ) {
+            uint32_t n = total - queued < sizeof(netbench_buf) ? total - queued : sizeof(netbench_buf);
+            if (tcp_write_ref(c, netbench_buf, n) < 0) break;
+            queued += n;
+        }
+        tcp_flush(c);
+        tcp_poll();
+    }
+    uint64_t c1 = rdtsc();
+    if (c && nb_client_state == 1) tcp_close(c);
+    if (nb_sink_bytes < total) kprintf("  tcp stream: failed after %u bytes\n", nb_sink_bytes);
+    else netbench_report("tcp stream", nb_sink_bytes, 0, c1 - c0, khz);
+
+    /* TCP request/response round trips */
+    nb_replies = 0; nb_client_state = 0;
+    start = timer_ticks;
+    c = tcp_connect(lo, NETBENCH_TCP_ECHO, &nb_client_ops, 0);
+    uint32_t rounds = 0;
+    c0 = rdtsc();
+    while (c && nb_client_state == 1 && rounds < NETBENCH_ROUNDS && !nb_timed_out(start)) {
+        uint32_t want = nb_replies + NETBENCH_MSG;
+        if (tcp_write(c, netbench_buf, NETBENCH_MSG) < 0) break;
+        tcp_flush(c);
+        while (nb_replies < want && nb_client_state == 1 && !nb_timed_out(start)) tcp_poll();
+        if (nb_replies < want) break;
+        ++rounds;
+    }
+    c1 = rdtsc();
+    if (c && nb_client_state == 1) tcp_close(c);
+    if (rounds < NETBENCH_ROUNDS) kprintf("  tcp rtt: failed after %u round trips\n", rounds);
+    else netbench_report("tcp rtt", rounds * NETBENCH_MSG * 2, rounds, c1 - c0, khz);
+
+    /* UDP datagram stream */
+    nb_sink_bytes = 0;
+    uint32_t sent = 0, dgrams = 0;
+    c0 = rdtsc();
+    while (sent < total) {
+        uint32_t n = total - sent < 1024 ? total - sent : 1024;
+        if (udp_send(lo, NETBENCH_UDP_CLIENT, NETBENCH_UDP_SINK, netbench_buf, n) < 0) break;
+        sent += n; ++dgrams;
+    }
+    c1 = rdtsc();
+    if (nb_sink_bytes < total) kprintf("  udp stream: %u of %u bytes arrived\n", nb_sink_bytes, total);
+    else netbench_report("udp stream", nb_sink_bytes, dgrams, c1 - c0, khz);
+
+    /* UDP echo round trips (the reply arrives before udp_send returns) */
+    nb_replies = 0;
+    c0 = rdtsc();
+    for (rounds = 0; rounds < NETBENCH_ROUNDS; ++rounds) {
+        udp_send(lo, NETBENCH_UDP_CLIENT, NETBENCH_UDP_ECHO, netbench_buf, NETBENCH_MSG);
+        if (nb_replies != (rounds + 1) * NETBENCH_MSG) break;
+    }
+    c1 = rdtsc();
+    if (rounds < NETBENCH_ROUNDS) kprintf("  udp rtt: failed after %u round trips\n", rounds);
+    else netbench_report("udp rtt", rounds * NETBENCH_MSG * 2, rounds, c1 - c0, khz);
+}
+
+/* --- Code paths by CPU feature ---
+   Each hot routine lists its variants, best first, with the feature each
+   one needs. cpu_select() stores the first one this CPU has in the
+   routine's pointer at boot, so calls never test features. The
+   cpu.generic tunable keeps every routine on its baseline, which makes
+   it easy to compare the two with bench. */
+struct cpu_variant {
+    const char *name;
+    int feature; /* CPUF_BASE: always usable */
+    void (*fn)(void);
+};
+
+struct cpu_path {
+    const char *name;
+    const struct cpu_variant *variants; /* ends with a CPUF_BASE entry */
+    const struct cpu_variant *chosen;
+};
+
+#define CPU_FN(f) ((void (*)(void))(f))
+
+static const struct cpu_variant memcpy_variants[] = {
+    { "erms", CPUF_ERMS, CPU_FN(memcpy_erms) },
+    { "sse2", CPUF_SSE2, CPU_FN(memcpy_sse2) },
+    { "movsl", CPUF_BASE, CPU_FN(memcpy_movsl) },
+};
+static const struct cpu_variant memset_variants[] = {
+    { "erms", CPUF_ERMS, CPU_FN(memset_erms) },
+    { "stosl", CPUF_BASE, CPU_FN(memset_stosl) },
+};
+static const struct cpu_variant crc32c_variants[] = {
+    { "sse4.2", CPUF_SSE42, CPU_FN(crc32c_update_sse42) },
+    { "table", CPUF_BASE, CPU_FN(crc32c_update_table) },
+};
+static const struct cpu_variant csum_variants[] = {
+    { "sse2", CPUF_SSE2, CPU_FN(csum_add_sse2) },
+    { "generic", CPUF_BASE, CPU_FN(csum_add_generic) },
+};
+static const struct cpu_variant memmem_variants[] = {
+    { "sse2", CPUF_SSE2, CPU_FN(memmem_sse2) },
+    { "generic", CPUF_BASE, CPU_FN(memmem_generic) },
+};
+
+enum { PATH_MEMCPY, PATH_MEMSET, PATH_CRC32C, PATH_CSUM, PATH_MEMMEM, NUM_CPU_PATHS };
+static struct cpu_path cpu_paths[NUM_CPU_PATHS] = {
+    { "memcpy", memcpy_variants, 0 },
+    { "memset", memset_variants, 0 },
+    { "crc32c", crc32c_variants, 0 },
+    { "ip checksum", csum_variants, 0 },
+    { "memmem", memmem_variants, 0 },
+};
+static uint32_t cpu_generic = 0;
+
+static void cpu_select(void) {
+    for (int i = 0; i < NUM_CPU_PATHS; ++i) {
+        const struct cpu_variant *v = cpu_paths[i].variants;
+        while (v->feature != CPUF_BASE && (cpu_generic || !cpu_has(v->feature))) ++v;
+        cpu_paths[i].chosen = v;
+    }
+    memcpy_impl = (void *(*)(void *, const void *, size_t))cpu_paths[PATH_MEMCPY].chosen->fn;
+    memset_impl = (void *(*)(void *, int, size_t))cpu_paths[PATH_MEMSET].chosen->fn;
+    crc32c_update = (uint32_t (*)(uint32_t, const void *, uint32_t))cpu_paths[PATH_CRC32C].chosen->fn;
+    csum_add = (uint32_t (*)(uint32_t, const void *, uint32_t))cpu_paths[PATH_CSUM].chosen->fn;
+    kmemmem = (const char *(*)(const char *, uint32_t, const char *, uint32_t))cpu_paths[PATH_MEMMEM].chosen->fn;
+}
+
+static void cpuinfo(void) {
+    if (!cpu_vendor[0]) kprintf("cpu: no CPUID instruction\n");
+    else kprintf("cpu: %s, family %u model %u stepping %u\n", cpu_vendor, cpu_family, cpu_model, cpu_stepping);
+    const char *brand = cpu_brand;
+    while (*brand == ' ') ++brand;
+    if (*brand) kprintf("     %s\n", brand);
+    kprintf("features:");
+    int col = 9;
+    for (int f = CPUF_BASE + 1; f < CPUF_COUNT; ++f) {
+        if (!cpu_has(f)) continue;
+        int n = 0;
+        while (cpu_feature_names[f][n]) ++n;
+        if (col + 1 + n > 78) { kprintf("\n         "); col = 9; }
+        kprintf(" %s", cpu_feature_names[f]);
+        col += 1 + n;
+    }
+    kprintf("\ncode paths (* in use, - needs a feature this CPU lacks)%s:\n", cpu_generic ? ", cpu.generic set" : "");
+    for (int i = 0; i < NUM_CPU_PATHS; ++i) {
+        kprintf("  %s:", cpu_paths[i].name);
+        const struct cpu_variant *v = cpu_paths[i].variants;
+        do {
+            kprintf(" %s%s", v == cpu_paths[i].chosen ? "*" : cpu_has(v->feature) ? "" : "-", v->name);
+        } while ((v++)->feature != CPUF_BASE);
+        kprintf("\n");
+    }
+}
+
+/* --- CPU benchmarks (bench) ---
+   Times hot kernel paths with the TSC so the i386 and x86_64 builds can be
+   compared on the same machine: boot each image and run `bench`. Each case
+   reports the best of a few runs, in cycles per operation. */
+#ifdef __x86_64__
+#define KERNEL_ARCH "x86_64"
+#else
+#define KERNEL_ARCH "i386"
+#endif
+#define BENCH_BUF 16384
+#define BENCH_RUNS 5
+
+static uint8_t bench_dst[BENCH_BUF];
+static volatile uint32_t bench_sink;
+
+struct bench_case {
+    const char *name;
+    uint32_t reps;
+    void (*run)(uint32_t reps);
+};
+
+static void bench_memcpy(uint32_t reps) { while (reps--) memcpy(bench_dst, netbench_buf, BENCH_BUF); }
+static void bench_memmove(uint32_t reps) { while (reps--) memmove(bench_dst + 1, bench_dst, BENCH_BUF - 1); }
+static void bench_crc32c(uint32_t reps) { while (reps--) bench_sink = crc32c_update(0, netbench_buf, BENCH_BUF); }
+static void bench_csum(uint32_t reps) { while (reps--) bench_sink = csum_fold(csum_add(0, netbench_buf, 1500)); }
+
+static void bench_div64(uint32_t reps) {
+    uint64_t n = 0x123456789ABCDEFull;
+    while (reps--) n = div64_32(n, 3) * 3 + reps;
+    bench_sink = (uint32_t)n;
+}
+
+static void bench_format(uint32_t reps) {
+    char line[KLOG_MSG];
+    while (reps--) bench_sink = ksnprintf(line, sizeof(line), "%s %u %u %c %s", "minios", reps, 0xDEADu, 'I', "tcp: retransmit");
+}
+
+static void bench_fs_find(uint32_t reps) { while (reps--) bench_sink = fs_find("no-such-file"); }
+static void bench_memmem(uint32_t reps) { while (reps--) bench_sink = kmemmem((const char *)netbench_buf, BENCH_BUF, "no such text", 12) != 0; }
+
+static const struct bench_case bench_cases[] = {
+    { "memcpy 16 KiB", 64, bench_memcpy },
+    { "memmove 16 KiB", 64, bench_memmove },
+    { "crc32c 16 KiB", 16, bench_crc32c },
+    { "ip checksum 1500 B", 256, bench_csum },
+    { "64/32 division", 4096, bench_div64 },
+    { "ksnprintf line", 1024, bench_format },
+    { "fs_find miss", 1024, bench_fs_find },
+    { "memmem 16 KiB miss", 64, bench_memmem },
+};
+
+static void bench(void) {
+    for (uint32_t i = 0; i < BENCH_BUF; ++i) netbench_buf[i] = (uint8_t)(i * 7);
+    kprintf("bench (%s, TSC %u MHz), best of %d runs:\n", KERNEL_ARCH, tsc_khz / 1000, BENCH_RUNS);
+    for (uint32_t c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); ++c) {
+        const struct bench_case *b = &bench_cases[c];
+        uint64_t best = ~0ull;
+        for (int r = 0; r < BENCH_RUNS; ++r) {
+            uint64_t c0 = rdtsc();
+            b->run(b->reps);
+            uint64_t t = rdtsc() - c0;
+            if (t < best) best = t;
+        }
+        uint32_t per_op = (uint32_t)div64_32(best, b->reps);
+        kprintf("  %s: %u cycles/op", b->name, per_op);
+        if (tsc_khz) kprintf(", %u ns/op", (uint32_t)div64_32((uint64_t)per_op * 1000000, tsc_khz));
+        kprintf("\n");
+    }
+}
+
+/* --- gcov counters for profile-guided builds (make pgo) ---
+   With -fprofile-arcs GCC counts every arc in static arrays and registers
+   each object's gcov_info from a constructor. This is the minimal runtime
+   behind that: constructors are run at boot, `gcov` prints the counters
+   as text (to the serial console when run there) and tools/pgo.py turns
+   the dump back into .gcda files for -fprofile-use. The layout matches
+   GCC 10 and newer; GCC 12 added the checksum field and GCC 14 a ninth
+   counter kind (condition coverage). */
+#ifdef KERNEL_GCOV
+#if __GNUC__ >= 14
+#define GCOV_COUNTERS 9
+#elif __GNUC__ >= 10
+#define GCOV_COUNTERS 8
+#else
+#error "the gcov runtime needs GCC 10 or newer"
+#endif
+#define GCOV_NOPROF __attribute__((no_profile_instrument_function, noinline))
+
+typedef uint64_t gcov_type;
+
+struct gcov_ctr_info {
+    uint32_t num;
+    gcov_type *values;
+};
+
+struct gcov_info;
+
+struct gcov_fn_info {
+    const struct gcov_info *key;
+    uint32_t ident;
+    uint32_t lineno_checksum;
+    uint32_t cfg_checksum;
+    struct gcov_ctr_info ctrs[1]; /* one per counter kind that has a merge function */
+};
+
+struct gcov_info {
+    uint32_t version;
+    struct gcov_info *next;
+    uint32_t stamp;
+#if __GNUC__ >= 12
+    uint32_t checksum;
+#endif
+    const char *filename;
+    void (*merge[GCOV_COUNTERS])(gcov_type *, uint32_t);
+    uint32_t n_functions;
+    const struct gcov_fn_info *const *functions;
+};
+
+static struct gcov_info *gcov_list = 0;
+
+GCOV_NOPROF void __gcov_init(struct gcov_info *info) { info->next = gcov_list; gcov_list = info; }
+GCOV_NOPROF void __gcov_exit(void) {}
+GCOV_NOPROF void __gcov_merge_add(gcov_type *counters, uint32_t n) { (void)counters; (void)n; }
+
+/* Constructor tables from the linker script */
+extern void (*__init_array_start[])(void);
+extern void (*__init_array_end[])(void);
+
+GCOV_NOPROF static void gcov_run_ctors(void) {
+    for (void (**f)(void) = __init_array_start; f < __init_array_end; ++f) (*f)();
+}
+
+GCOV_NOPROF static void gcov_reset(void) {
+    for (const struct gcov_info *info = gcov_list; info; info = info->next)
+        for (uint32_t f = 0; f < info->n_functions; ++f) {
+            const struct gcov_fn_info *fi = info->functions[f];
+            if (!fi || fi->key != info) continue; /* function dropped from this object */
+            const struct gcov_ctr_info *c = fi->ctrs;
+            for (int k = 0; k < GCOV_COUNTERS; ++k) if (info->merge[k]) { memset(c->values, 0, c->num * sizeof(gcov_type)); ++c; }
+        }
+}
+
+/* Dump format, one record per line:
+     gcov: file <path> <version> <stamp> [<checksum>]  (checksum from GCC 12 on)
+     gcov: fn <ident> <lineno_checksum> <cfg_checksum>
+     gcov: ctr <kind> <n> <value>...
+     gcov: end
+   Numbers are hex; the fn line precedes the counter lines of its function. */
+GCOV_NOPROF static void gcov_put64(gcov_type v) {
+    char buf[17];
+    int n = 16;
+    buf[n] = '\0';
+    do { buf[--n] = "0123456789abcdef"[v & 15]; v >>= 4; } while (v);
+    kprintf(" %s", buf + n);
+}
+
+GCOV_NOPROF static void gcov_dump(void) {
+    for (const struct gcov_info *info = gcov_list; info; info = info->next) {
+        kprintf("gcov: file %s %x %x", info->filename, info->version, info->stamp);
+#if __GNUC__ >= 12
+        kprintf(" %x", info->checksum);
+#endif
+        kprintf("\n");
+        for (uint32_t f = 0; f < info->n_functions; ++f) {
+            const struct gcov_fn_info *fi = info->functions[f];
+            if (!fi || fi->key != info) continue;
+            watchdog_touch(); /* the dump takes a while at 115200 baud */
+            kprintf("gcov: fn %x %x %x\n", fi->ident, fi->lineno_checksum, fi->cfg_checksum);
+            const struct gcov_ctr_info *c = fi->ctrs;
+            for (int k = 0; k < GCOV_COUNTERS; ++k) {
+                if (!info->merge[k]) continue;
+                kprintf("gcov: ctr %d %x", k, c->num);
+                for (uint32_t i = 0; i < c->num; ++i) gcov_put64(c->values[i]);
+                kprintf("\n");
+                ++c;
+            }
+        }
+    }
+    kprintf("gcov: end\n");
+}
+
+GCOV_NOPROF static void gcov_command(const char *arg) {
+    if (arg[0] == 'r' && arg[1] == 'e' && arg[2] == 's' && arg[3] == 'e' && arg[4] == 't' && arg[5] == '\0') {
+        gcov_reset();
+        kprintf("gcov: counters zeroed\n");
+    } else if (arg[0] == '\0') {
+        gcov_dump();
+    } else {
+        kprintf("Usage: gcov [reset]\n");
+    }
+}
+#endif
+
+#ifdef CONFIG_MODULES
+/* --- Loadable modules ---
+   insmod links an ELF relocatable object (gcc -c; see modules/) into a
+   pool set aside at boot: the SHF_ALLOC sections are laid out in one
+   block, undefined symbols resolve against ksymtab, the relocations are
+   applied and init_module() runs. Objects come from the FS or from the
+   Multiboot modules the loader brought along (GRUB `module`, QEMU
+   -initrd). Modules add shell commands with register_command(); rmmod
+   calls cleanup_module(), drops whatever commands are left and frees the
+   block. A module links against the kernel only, not against another
+   module, so nothing needs reference counts. */
+#define MAX_MODULES 8
+#define MAX_MOD_COMMANDS 16
+#define MOD_POOL (64 * 1024) /* default of mod.pool */
+#define MOD_MAX_SECTIONS 64
+#define MOD_MAX_ALIGN 4096
+
+#define ELF_MAGIC 0x464C457Fu
+#define ET_REL 1
+#define SHT_SYMTAB 2
+#define SHT_NOBITS 8
+#define SHF_ALLOC 2
+#define SHN_UNDEF 0
+#define SHN_LORESERVE 0xFF00
+#define SHN_ABS 0xFFF1
+#define SHN_COMMON 0xFFF2
+#define STB_GLOBAL 1
+#define STB_WEAK 2
+
+#ifdef __x86_64__
+#define ELF_CLASS 2
+#define ELF_MACHINE 62 /* EM_X86_64 */
+#define SHT_RELOC 4    /* SHT_RELA */
+struct elf_ehdr {
+    uint8_t ident[16];
+    uint16_t type, machine;
+    uint32_t version;
+    uint64_t entry, phoff, shoff;
+    uint32_t flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+struct elf_shdr { uint32_t name, type; uint64_t flags, addr, offset, size; uint32_t link, info; uint64_t addralign, entsize; };
+struct elf_sym { uint32_t name; uint8_t info, other; uint16_t shndx; uint64_t value, size; };
+struct elf_rel { uint64_t offset, info; int64_t addend; };
+#define ELF_R_SYM(i) ((uint32_t)((i) >> 32))
+#define ELF_R_TYPE(i) ((uint32_t)(i))
+#else
+#define ELF_CLASS 1
+#define ELF_MACHINE 3 /* EM_386 */
+#define SHT_RELOC 9   /* SHT_REL: addends are in place */
+struct elf_ehdr {
+    uint8_t ident[16];
+    uint16_t type, machine;
+    uint32_t version, entry, phoff, shoff, flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+struct elf_shdr { uint32_t name, type, flags, addr, offset, size, link, info, addralign, entsize; };
+struct elf_sym { uint32_t name, value, size; uint8_t info, other; uint16_t shndx; };
+struct elf_rel { uint32_t offset, info; };
+#define ELF_R_SYM(i) ((i) >> 8)
+#define ELF_R_TYPE(i) ((i) & 0xFF)
+#endif
+
+/* A shell command added by a module; see modules/module.h */
+struct kcommand {
+    const char *name;
+    const char *usage; /* e.g. "hexdump <file>", for help */
+    const char *desc;
+    void (*fn)(char *args);
+};
+
+struct module {
+    char name[MAX_NAME];
+    int used;
+    uintptr_t base;
+    uint32_t size;
+    void (*cleanup)(void);
+};
+
+static uint32_t mod_pool_size = MOD_POOL, mod_autoload = 1;
+static uintptr_t mod_pool;
+static struct module modules[MAX_MODULES];
+static const struct kcommand *mod_commands[MAX_MOD_COMMANDS];
+static const struct multiboot_module *boot_mods; /* the loader's modules: .ko files to insmod */
+static uint32_t boot_mods_count;
+
+static int register_command(const struct kcommand *c);
+static void unregister_command(const struct kcommand *c);
+static char *skip_spaces(char *s);
+static char *parse_uint(char *s, uint32_t *out);
+
+/* What modules may link against. Taking the address also keeps GCC from
+   giving these functions a private calling convention. */
+struct ksym {
+    const char *name;
+    void *addr;
+};
+#define KSYM(s) { #s, (void *)&s }
+
+static const struct ksym ksymtab[] = {
+    KSYM(memcpy), KSYM(memmove), KSYM(memset), KSYM(memcmp),
+    KSYM(kprintf), KSYM(ksnprintf), KSYM(klog), KSYM(out_write),
+    KSYM(skip_spaces), KSYM(parse_uint),
+    KSYM(fs_data), KSYM(fs_write), KSYM(fs_remove),
+    KSYM(clock_now), KSYM(clock_format), KSYM(timer_ticks), KSYM(tsc_khz),
+    KSYM(crc32c_update),
+    KSYM(register_command), KSYM(unregister_command),
+};
+#define NUM_KSYMS (int)(sizeof(ksymtab) / sizeof(ksymtab[0]))
+
+static int str_eq(const char *a, const char *b) {
+    while (*a && *a == *b) { ++a; ++b; }
+    return *a == *b;
+}
+
+static void *ksym_find(const char *name) {
+    for (int i = 0; i < NUM_KSYMS; ++i) if (str_eq(ksymtab[i].name, name)) return ksymtab[i].addr;
+    return 0;
+}
+
+static void modules_init(const struct multiboot_info *mbi) {
+    mod_pool = (uintptr_t)kmem_alloc(mod_pool_size, "mod.pool");
+    if (mbi && (mbi->flags & MB_INFO_MODS)) {
+        boot_mods = (const struct multiboot_module *)(uintptr_t)mbi->mods_addr;
+        boot_mods_count = mbi->mods_count;
+    }
+}
+
+static struct module *module_find(const char *name) {
+    for (int i = 0; i < MAX_MODULES; ++i) if (modules[i].used && str_eq(modules[i].name, name)) return &modules[i];
+    return 0;
+}
+
+/* The module whose block holds addr (its code or data), if any */
+static struct module *module_at(uintptr_t addr) {
+    for (int i = 0; i < MAX_MODULES; ++i)
+        if (modules[i].used && addr - modules[i].base < modules[i].size) return &modules[i];
+    return 0;
+}
+
+/* Lowest gap in the pool that fits size bytes at the given alignment */
+static uintptr_t mod_pool_find(uint32_t size, uint32_t align) {
+    uintptr_t p = (mod_pool + align - 1) & ~(uintptr_t)(align - 1);
+    for (int moved = 1; moved;) {
+        moved = 0;
+        for (int i = 0; i < MAX_MODULES; ++i) {
+            const struct module *m = &modules[i];
+            if (m->used && p < m->base + m->size && m->base < p + size) {
+                p = (m->base + m->size + align - 1) & ~(uintptr_t)(align - 1);
+                moved = 1;
+            }
+        }
+    }
+    return p + size <= mod_pool + mod_pool_size ? p : 0;
+}
+
+/* Base name of a Multiboot module: the first word of its string
+   ("/boot/hexdump.ko hexdump.ko" -> "hexdump.ko") */
+static void boot_mod_name(const struct multiboot_module *m, char *out) {
+    const char *s = m->string ? (const char *)(uintptr_t)m->string : "";
+    const char *base = s;
+    for (const char *q = s; *q && *q != ' '; ++q) if (*q == '/') base = q + 1;
+    int n = 0;
+    while (base[n] && base[n] != ' ' && n < MAX_NAME - 1) { out[n] = base[n]; ++n; }
+    out[n] = '\0';
+}
+
+/* The object for module `name`: an FS file called name or name.ko, else
+   a Multiboot module with that base name */
+static const uint8_t *module_source(const char *name, uint32_t *len, const char **where) {
+    char ko[MAX_NAME + 3];
+    int size;
+    ksnprintf(ko, sizeof(ko), "%s.ko", name);
+    const char *d = fs_data(name, &size);
+    if (!d) d = fs_data(ko, &size);
+    if (d) { *len = (uint32_t)size; *where = "fs"; return (const uint8_t *)d; }
+    for (uint32_t i = 0; i < boot_mods_count; ++i) {
+        char bn[MAX_NAME];
+        boot_mod_name(&boot_mods[i], bn);
+        if (str_eq(bn, name) || str_eq(bn, ko)) {
+            *len = boot_mods[i].mod_end - boot_mods[i].mod_start;
+            *where = "boot";
+            return (const uint8_t *)(uintptr_t)boot_mods[i].mod_start;
+        }
+    }
+    return 0;
+}
+
+/* Apply one relocation at p, which has room bytes of its section left;
+   s is the symbol's address. 0, or -1 if the type is unknown or the value
+   does not fit. */
+static int mod_reloc(uint32_t type, uint8_t *p, uint64_t room, uintptr_t s, const struct elf_rel *r) {
+    if (room < 4) return -1;
+#ifdef __x86_64__
+    int64_t v = (int64_t)s + r->addend;
+    switch (type) {
+    case 1: /* R_X86_64_64 */
+        if (room < 8) return -1;
+        __builtin_memcpy(p, &v, 8);
+        return 0;
+    case 2: case 4: /* R_X86_64_PC32, R_X86_64_PLT32: no PLT, calls go straight to the kernel */
+        v -= (int64_t)(uintptr_t)p;
+        /* fall through */
+    case 11: /* R_X86_64_32S */
+        if (v != (int32_t)v) return -1;
+        break;
+    case 10: /* R_X86_64_32 */
+        if ((uint64_t)v >> 32) return -1;
+        break;
+    default:
+        return -1;
+    }
+    uint32_t v32 = (uint32_t)v;
+    __builtin_memcpy(p, &v32, 4);
+    return 0;
+#else
+    uint32_t v;
+    (void)r;
+    __builtin_memcpy(&v, p, 4);
+    switch (type) {
+    case 1: v += s; break;                            /* R_386_32 */
+    case 2: case 4: v += s - (uintptr_t)p; break;     /* R_386_PC32, R_386_PLT32 */
+    default: return -1;
+    }
+    __builtin_memcpy(p, &v, 4);
+    return 0;
+#endif
+}
+
+/* Link the object at img into the pool and run its init_module(). 0 or -1
+   (with the reason printed). */
+static int module_load(const char *name, const uint8_t *img, uint32_t len) {
+    static uintptr_t sec_addr[MOD_MAX_SECTIONS];
+    const struct elf_ehdr *eh = (const struct elf_ehdr *)img;
+    if (len < sizeof(*eh) || *(const uint32_t *)img != ELF_MAGIC || eh->ident[4] != ELF_CLASS || eh->type != ET_REL
+        || eh->machine != ELF_MACHINE || eh->shentsize != sizeof(struct elf_shdr)) {
+        kprintf("insmod: %s: not an ELF relocatable object for %s\n", name, KERNEL_ARCH);
+        return -1;
+    }
+    if (eh->shnum > MOD_MAX_SECTIONS || eh->shoff > len || (uint32_t)eh->shnum * sizeof(struct elf_shdr) > len - eh->shoff) {
+        kprintf("insmod: %s: bad or too many sections (at most %d)\n", name, MOD_MAX_SECTIONS);
+        return -1;
+    }
+    const struct elf_shdr *sh = (const struct elf_shdr *)(img + eh->shoff);
+    const struct elf_sym *syms = 0;
+    const char *strtab = 0;
+    uint32_t nsyms = 0, strsz = 0, size = 0, align = 16;
+    for (uint32_t i = 0; i < eh->shnum; ++i) {
+        if (sh[i].type != SHT_NOBITS && (sh[i].offset > len || sh[i].size > len - sh[i].offset)) {
+            kprintf("insmod: %s: section %u runs past the end of the file\n", name, i);
+            return -1;
+        }
+        if (sh[i].type == SHT_SYMTAB && sh[i].link < eh->shnum) {
+            syms = (const struct elf_sym *)(img + sh[i].offset);
+            nsyms = (uint32_t)(sh[i].size / sizeof(struct elf_sym));
+            strtab = (const char *)img + sh[sh[i].link].offset;
+            /* its offset and size are checked against len on its own turn */
+            strsz = sh[sh[i].link].type == SHT_NOBITS ? 0 : (uint32_t)sh[sh[i].link].size;
+        }
+        /* first pass: offsets within the block */
+        sec_addr[i] = 0;
+        if (!(sh[i].flags & SHF_ALLOC) || !sh[i].size) continue;
+        if (sh[i].addralign > MOD_MAX_ALIGN || (sh[i].addralign & (sh[i].addralign - 1))) {
+            kprintf("insmod: %s: section %u has a bad alignment\n", name, i);
+            return -1;
+        }
+        uint32_t a = sh[i].addralign > 1 ? (uint32_t)sh[i].addralign : 1;
+        if (a > align) align = a;
+        if (sh[i].size > mod_pool_size || size > mod_pool_size - sh[i].size) { /* also keeps the sizes in 32 bits */
+            kprintf("insmod: %s: too big for the module pool (mod.pool)\n", name);
+            return -1;
+        }
+        size = (size + a - 1) & ~(a - 1);
+        sec_addr[i] = size + 1; /* +1: zero means not loaded */
+        size += (uint32_t)sh[i].size;
+    }
+    if (!syms) { kprintf("insmod: %s: no symbol table\n", name); return -1; }
+    /* every name must end inside the string table */
+    if (!strsz || strtab[strsz - 1]) { kprintf("insmod: %s: bad string table\n", name); return -1; }
+    for (uint32_t i = 0; i < nsyms; ++i) if (syms[i].name >= strsz) {
+        kprintf("insmod: %s: bad name for symbol %u\n", name, i);
+        return -1;
+    }
+    struct module *m = 0;
+    for (int i = 0; i < MAX_MODULES; ++i) if (!modules[i].used) { m = &modules[i]; break; }
+    uintptr_t base = size ? mod_pool_find(size, align) : 0;
+    if (!m || !base) {
+        kprintf("insmod: %s: %s\n", name, !m ? "too many modules loaded" : "not enough room in the module pool (mod.pool)");
+        return -1;
+    }
+    for (uint32_t i = 0; i < eh->shnum; ++i) {
+        if (!sec_addr[i]) continue;
+        sec_addr[i] += base - 1;
+        if (sh[i].type == SHT_NOBITS) memset((void *)sec_addr[i], 0, sh[i].size);
+        else memcpy((void *)sec_addr[i], img + sh[i].offset, sh[i].size);
+    }
+
+    /* relocations for the sections that were loaded */
+    for (uint32_t i = 0; i < eh->shnum; ++i) {
+        if (sh[i].type != SHT_RELOC || sh[i].info >= eh->shnum || !sec_addr[sh[i].info]) continue;
+        const struct elf_rel *r = (const struct elf_rel *)(img + sh[i].offset);
+        uint32_t n = (uint32_t)(sh[i].size / sizeof(*r));
+        for (uint32_t k = 0; k < n; ++k, ++r) {
+            uint32_t si = ELF_R_SYM(r->info);
+            if (si >= nsyms) { kprintf("insmod: %s: bad symbol index %u\n", name, si); return -1; }
+            const struct elf_sym *s = &syms[si];
+            const char *sname = strtab + s->name;
+            uintptr_t addr;
+            if (s->shndx == SHN_UNDEF) {
+                addr = (uintptr_t)ksym_find(sname);
+                if (!addr && (s->info >> 4) != STB_WEAK) { kprintf("insmod: %s: unknown symbol %s\n", name, sname); return -1; }
+            } else if (s->shndx == SHN_ABS) {
+                addr = (uintptr_t)s->value;
+            } else if (s->shndx < eh->shnum && sec_addr[s->shndx]) {
+                addr = sec_addr[s->shndx] + (uintptr_t)s->value;
+            } else {
+                kprintf("insmod: %s: symbol %s is %s\n", name, sname,
+                        s->shndx == SHN_COMMON ? "common (build with -fno-common)" : "in a section that is not loaded");
+                return -1;
+            }
+            const struct elf_shdr *t = &sh[sh[i].info];
+            if (r->offset >= t->size
+                || mod_reloc(ELF_R_TYPE(r->info), (uint8_t *)(sec_addr[sh[i].info] + r->offset), t->size - r->offset, addr, r) < 0) {
+                kprintf("insmod: %s: cannot apply relocation type %u against %s\n", name, (uint32_t)ELF_R_TYPE(r->info), sname);
+                return -1;
+            }
+        }
+    }
+
+    int (*init)(void) = 0;
+    void (*cleanup)(void) = 0;
+    for (uint32_t i = 1; i < nsyms; ++i) {
+        const struct elf_sym *s = &syms[i];
+        if ((s->info >> 4) != STB_GLOBAL || s->shndx == SHN_UNDEF || s->shndx >= SHN_LORESERVE || !sec_addr[s->shndx]) continue;
+        uintptr_t addr = sec_addr[s->shndx] + (uintptr_t)s->value;
+        if (str_eq(strtab + s->name, "init_module")) init = (int (*)(void))addr;
+        else if (str_eq(strtab + s->name, "cleanup_module")) cleanup = (void (*)(void))addr;
+    }
+    int n = 0;
+    while (name[n] && n < MAX_NAME - 1) { m->name[n] = name[n]; ++n; }
+    m->name[n] = '\0';
+    m->base = base;
+    m->size = size;
+    m->cleanup = cleanup;
+    m->used = 1;
+    int rc = init ? init() : 0;
+    if (rc != 0) {
+        for (int i = 0; i < MAX_MOD_COMMANDS; ++i)
+            if (mod_commands[i] && module_at((uintptr_t)mod_commands[i]->fn) == m) mod_commands[i] = 0;
+        m->used = 0;
+        kprintf("insmod: %s: init_module failed (%d)\n", name, rc);
+        return -1;
+    }
+    klog(KLOG_INFO, "module: %s loaded at 0x%x, %u bytes", m->name, (uint32_t)base, size);
+    return 0;
+}
+
+static int module_unload(struct module *m) {
+    if (m->cleanup) m->cleanup();
+    for (int i = 0; i < MAX_MOD_COMMANDS; ++i)
+        if (mod_commands[i] && module_at((uintptr_t)mod_commands[i]->fn) == m) mod_commands[i] = 0;
+    m->used = 0;
+    klog(KLOG_INFO, "module: %s unloaded", m->name);
+    return 0;
+}
+
+/* A command belongs to the module whose code it runs, and goes with it. */
+static int register_command(const struct kcommand *c) {
+    int slot = -1;
+    if (!module_at((uintptr_t)c->fn)) return -1;
+    for (int i = 0; i < MAX_MOD_COMMANDS; ++i) {
+        if (mod_commands[i] && str_eq(mod_commands[i]->name, c->name)) return -1;
+        if (!mod_commands[i] && slot < 0) slot = i;
+    }
+    if (slot >= 0) mod_commands[slot] = c;
+    return slot >= 0 ? 0 : -1;
+}
+
+static void unregister_command(const struct kcommand *c) {
+    for (int i = 0; i < MAX_MOD_COMMANDS; ++i) if (mod_commands[i] == c) mod_commands[i] = 0;
+}
+
+/* insmod <name>: the module name is the file name without .ko */
+static void insmod_command(char *arg) {
+    char name[MAX_NAME];
+    int n = 0;
+    while (arg[n] && arg[n] != ' ' && n < MAX_NAME - 1) { name[n] = arg[n]; ++n; }
+    name[n] = '\0';
+    if (n > 3 && name[n - 3] == '.' && name[n - 2] == 'k' && name[n - 1] == 'o') name[n - 3] = '\0';
+    if (!name[0]) { kprintf("Usage: insmod <name>\n"); return; }
+    if (module_find(name)) { kprintf("insmod: %s is already loaded\n", name); return; }
+    uint32_t len;
+    const char *where;
+    const uint8_t *img = module_source(name, &len, &where);
+    if (!img) { kprintf("insmod: no %s or %s.ko in the FS or the boot modules\n", name, name); return; }
+    if (module_load(name, img, len) == 0) kprintf("%s: loaded from %s\n", name, where);
+}
+
+static void rmmod_command(char *arg) {
+    struct module *m = *arg ? module_find(arg) : 0;
+    if (!*arg) kprintf("Usage: rmmod <name>\n");
+    else if (!m) kprintf("rmmod: %s is not loaded\n", arg);
+    else module_unload(m);
+}
+
+static void lsmod_command(void) {
+    uint32_t used = 0;
+    kprintf("Module            Size     Address Commands\n");
+    for (int i = 0; i < MAX_MODULES; ++i) {
+        const struct module *m = &modules[i];
+        if (!m->used) continue;
+        used += m->size;
+        char col[16];
+        int n = 0;
+        while (m->name[n]) ++n;
+        kprintf("%s", m->name);
+        for (; n < 16; ++n) kprintf(" ");
+        for (n = ksnprintf(col, sizeof(col), "%u", m->size); n < 6; ++n) kprintf(" ");
+        kprintf("%s  ", col);
+        for (n = ksnprintf(col, sizeof(col), "0x%x", (uint32_t)m->base); n < 10; ++n) kprintf(" ");
+        kprintf("%s", col);
+        for (int k = 0; k < MAX_MOD_COMMANDS; ++k)
+            if (mod_commands[k] && module_at((uintptr_t)mod_commands[k]->fn) == m) kprintf(" %s", mod_commands[k]->name);
+        kprintf("\n");
+    }
+    kprintf("pool: %u of %u KiB used\n", (used + 1023) / 1024, mod_pool_size / 1024);
+    if (boot_mods_count) {
+        kprintf("boot modules:");
+        for (uint32_t i = 0; i < boot_mods_count; ++i) {
+            char bn[MAX_NAME];
+            boot_mod_name(&boot_mods[i], bn);
+            kprintf(" %s", bn);
+        }
+        kprintf("\n");
+    }
+}
+
+static void module_help(void) {
+    for (int i = 0; i < MAX_MOD_COMMANDS; ++i) {
+        const struct kcommand *c = mod_commands[i];
+        if (!c) continue;
+        int n = 0;
+        while (c->usage[n]) ++n;
+        kprintf("  %s", c->usage);
+        for (int pad = n < 15 ? 15 - n : 1; pad > 0; --pad) kprintf(" ");
+        kprintf("- %s (module %s)\n", c->desc, module_at((uintptr_t)c->fn)->name);
+    }
+}
+
+/* Run p if its first word is a module command. With mod.autoload, a word
+   that names no command but has a module object (<word>.ko) loads it
+   first. Returns 0 if p is not a module command. */
+static int module_command(char *p) {
+    char word[MAX_NAME];
+    int n = 0;
+    while (p[n] && p[n] != ' ' && n < MAX_NAME - 1) { word[n] = p[n]; ++n; }
+    if (p[n] && p[n] != ' ') return 0;
+    word[n] = '\0';
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < MAX_MOD_COMMANDS; ++i)
+            if (mod_commands[i] && str_eq(mod_commands[i]->name, word)) { mod_commands[i]->fn(skip_spaces(p + n)); return 1; }
+        char ko[MAX_NAME + 3];
+        uint32_t len;
+        const char *where;
+        const uint8_t *img;
+        ksnprintf(ko, sizeof(ko), "%s.ko", word);
+        if (pass || !mod_autoload || module_find(word) || !(img = module_source(ko, &len, &where))) return 0;
+        if (module_load(word, img, len) < 0) return 1;
+        klog(KLOG_INFO, "module: %s loaded on demand from %s", word, where);
+    }
+    return 0;
+}
+#endif
+
+/* --- top ---
+   Samples the CPU accounting counters once a second and shows the
+   differences: the CPU's busy, interrupt and idle shares, each task, and
+   each interrupt vector's rate, next to memory use. On the screen it
+   redraws in place until a key is pressed; into a pipe or a remote shell
+   it prints the given number of samples (default one). */
+#define TOP_INTERVAL TIMER_HZ /* ticks per sample */
+
+struct top_sample {
+    uint64_t tsc, irq, task[NUM_TASKS], vec_cycles[STAT_VECTORS];
+    uint32_t ticks, vec_count[STAT_VECTORS];
+};
+
+static void top_take(struct top_sample *t) {
+    struct cpu_stat *s = &cpu0_stat;
+    task_switch(s->task); /* charge the running task up to now */
+    t->tsc = s->task_since;
+    t->ticks = timer_ticks;
+    t->irq = cpu_stat_read(&s->irq_cycles);
+    for (int i = 0; i < NUM_TASKS; ++i) t->task[i] = s->task_cycles[i];
+    for (int v = 0; v < STAT_VECTORS; ++v) {
+        t->vec_cycles[v] = cpu_stat_read(&s->vec_cycles[v]);
+        t->vec_count[v] = s->vec_count[v];
+    }
+}
+
+/* part of whole in tenths of a percent */
+static uint32_t top_permille(uint64_t part, uint64_t whole) {
+    while (whole > 0xFFFFFFFFu / 1000) { part >>= 8; whole >>= 8; }
+    return whole ? (uint32_t)div64_32(part * 1000, (uint32_t)whole) : 0;
+}
+
+static void top_percent(const char *before, uint64_t part, uint64_t whole, const char *after) {
+    uint32_t pm = top_permille(part, whole);
+    kprintf("%s%u.%u%%%s", before, pm / 10, pm % 10, after);
+}
+
+static const char *top_vector_name(int v) {
+    switch (v) {
+    case VEC_NMI: return "NMI";
+    case 0x20: return "timer";
+    case 0x21: return "keyboard";
+    case 0x2C: return "mouse";
+    }
+    return "irq";
+}
+
+static void task_put_name(int i) {
+    if (i >= TASK_TTY1 && i < TASK_TTY1 + NUM_VTS) kprintf("tty%d", i - TASK_TTY1 + 1);
+    else kprintf("%s", i == TASK_IDLE ? "idle" : i == TASK_NET ? "net" : "rsh");
+}
+
+static void top_show(const struct top_sample *a, const struct top_sample *b) {
+    uint64_t wall = b->tsc - a->tsc, busy = 0;
+    uint32_t ticks = b->ticks - a->ticks, up = b->ticks / TIMER_HZ;
+    for (int i = 0; i < NUM_TASKS; ++i) if (i != TASK_IDLE) busy += b->task[i] - a->task[i];
+    kprintf("top - up %u:%u%u:%u%u, %u CPU%s in the MADT, 1 running\n", up / 3600, up / 600 % 6, up / 60 % 10,
+            up % 60 / 10, up % 10, acpi.num_cpus ? acpi.num_cpus : 1, acpi.num_cpus > 1 ? "s" : "");
+    top_percent("cpu0: busy ", busy, wall, "");
+    top_percent(", irq ", b->irq - a->irq, wall, "");
+    top_percent(", idle ", b->task[TASK_IDLE] - a->task[TASK_IDLE], wall, "\n");
+    kprintf("mem: kernel %u KiB, boot allocations %u KiB, free %u KiB\n",
+            (uint32_t)((uintptr_t)__kernel_end - 0x100000) / 1024, (uint32_t)(kmem_next - kmem_start) / 1024,
+            (uint32_t)(kmem_limit - kmem_next) / 1024);
+    uint32_t nfiles = 0, bytes = 0;
+    for (uint32_t i = 0; i < fs_max_files; ++i) if (files[i].used) { ++nfiles; bytes += (uint32_t)files[i].size; }
+    kprintf("fs: %u of %u files, %u of %u KiB\n", nfiles, fs_max_files, (bytes + 1023) / 1024,
+            fs_max_files * fs_file_size / 1024);
+#ifdef CONFIG_MODULES
+    uint32_t pool = 0;
+    for (int i = 0; i < MAX_MODULES; ++i) if (modules[i].used) pool += modules[i].size;
+    kprintf("modules: %u of %u KiB pool\n", (pool + 1023) / 1024, mod_pool_size / 1024);
+#endif
+    kprintf("\ntask\tcpu\ttotal\n");
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        task_put_name(i);
+        top_percent("\t", b->task[i] - a->task[i], wall, "");
+        kprintf("\t%u ms\n", tsc_khz ? (uint32_t)div64_32(b->task[i], tsc_khz) : 0);
+    }
+    kprintf("\nvector\t\tper s\tcpu\ttotal\n");
+    for (int v = 0; v < STAT_VECTORS; ++v) {
+        if (!b->vec_count[v]) continue;
+        uint32_t n = b->vec_count[v] - a->vec_count[v];
+        int vec = STAT_VECTOR(v);
+        kprintf(vec < 0x10 ? "0x0%x %s\t%u" : "0x%x %s\t%u", vec, top_vector_name(vec), ticks ? n * TIMER_HZ / ticks : 0);
+        top_percent("\t", b->vec_cycles[v] - a->vec_cycles[v], wall, "");
+        kprintf("\t%u\n", b->vec_count[v]);
+    }
 }
 
-static void vga_scroll(void) {
-    for (int r = 0; r < VGA_HEIGHT - 1; ++r) {
-        for (int c = 0; c < VGA_WIDTH; ++c) {
-            vga_buffer[r * VGA_WIDTH + c] = vga_buffer[(r + 1) * VGA_WIDTH + c];
+/* top [samples] */
+static void top_command(const char *arg) {
+    uint32_t count = 0;
+    while (*arg >= '0' && *arg <= '9') count = count * 10 + (uint32_t)(*arg++ - '0');
+    if (*arg) { kprintf("Usage: top [samples]\n"); return; }
+    if (!console_may_wait("top")) return;
+    int interactive = cur_out->interactive;
+    if (!count && !interactive) count = 1;
+    struct vt *t = vt_out;
+    static struct top_sample samples[2];
+    int cur = 0;
+    top_take(&samples[cur]);
+    for (uint32_t n = 0; !count || n < count; ++n) {
+        uint32_t start = timer_ticks;
+        char c;
+        while (timer_ticks - start < TOP_INTERVAL) {
+            if (interactive && vt_getc(t, &c)) return;
+            console_idle();
         }
+        top_take(&samples[!cur]);
+        if (interactive) kprintf("\x1b[H\x1b[2J");
+        else if (n) kprintf("\n");
+        top_show(&samples[cur], &samples[!cur]);
+        cur = !cur;
+        if (interactive) kprintf("\n(any key quits)");
     }
-    /* clear last line */
-    const uint16_t blank = (uint16_t)' ' | ((uint16_t)term_color << 8);
-    for (int c = 0; c < VGA_WIDTH; ++c) vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + c] = blank;
+    if (interactive) kprintf("\n");
 }
 
-static void vga_putc(char c) {
-    if (c == '\n') {
-        term_col = 0;
-        if (++term_row == VGA_HEIGHT) { term_row = VGA_HEIGHT - 1; vga_scroll(); }
-    } else if (c == '\r') {
-        term_col = 0;
-    } else if (c == '\b') {
-        if (term_col > 0) {
-            --term_col;
-            vga_putat(' ', term_color, term_row, term_col);
-        }
-    } else {
-        vga_putat(c, term_color, term_row, term_col);
-        if (++term_col >= VGA_WIDTH) { term_col = 0; if (++term_row == VGA_HEIGHT) { term_row = VGA_HEIGHT - 1; vga_scroll(); } }
+#ifdef CONFIG_PROCFS
+/* --- procfs ---
+   Read-only files under /proc, made from live counters each time one is
+   read: fs_data() calls the file's generator then, and nothing is kept
+   in between. The generators print with kprintf into a buffer, so cat,
+   pipes, more, nano, send and the HTTP server read them like any file.
+   There is a buffer per terminal and one for the network (HTTP, remote
+   shell), picked by the running task, so a terminal paging a /proc file
+   is not overwritten by a read from another terminal. A file fits one
+   HTTP response, which is copied out rather than sent by reference;
+   longer output is cut at a line and ends with a PROC_TRUNCATED line. */
+#define PROC_BUF (TCP_TXBUF - 256)
+#define PROC_TRUNCATED "...truncated\n"
+
+struct proc_file {
+    const char *name;
+    void (*show)(void);
+};
+
+static char proc_bufs[NUM_VTS + 1][PROC_BUF];
+
+static void proc_meminfo(void) {
+    kprintf("MemTotal:\t%u kB\n", (uint32_t)(kmem_limit / 1024));
+    kprintf("Kernel:\t\t%u kB\n", (uint32_t)((uintptr_t)__kernel_end - 0x100000) / 1024);
+    kprintf("BootAlloc:\t%u kB\n", (uint32_t)(kmem_next - kmem_start) / 1024);
+    kprintf("MemFree:\t%u kB\n", (uint32_t)(kmem_limit - kmem_next) / 1024);
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < fs_max_files; ++i) if (files[i].used) bytes += (uint32_t)files[i].size;
+    kprintf("FsTotal:\t%u kB\n", fs_max_files * fs_file_size / 1024);
+    kprintf("FsUsed:\t\t%u kB\n", (bytes + 1023) / 1024);
+#ifdef CONFIG_MODULES
+    uint32_t pool = 0;
+    for (int i = 0; i < MAX_MODULES; ++i) if (modules[i].used) pool += modules[i].size;
+    kprintf("ModPoolTotal:\t%u kB\n", mod_pool_size / 1024);
+    kprintf("ModPoolUsed:\t%u kB\n", (pool + 1023) / 1024);
+#endif
+}
+
+/* vector, count, time in handlers, name */
+static void proc_interrupts(void) {
+    for (int v = 0; v < STAT_VECTORS; ++v) {
+        uint32_t n = cpu0_stat.vec_count[v];
+        if (!n) continue;
+        uint64_t cycles = cpu_stat_read(&cpu0_stat.vec_cycles[v]);
+        int vec = STAT_VECTOR(v);
+        kprintf(vec < 0x10 ? "0x0%x\t%u\t%u ms\t%s\n" : "0x%x\t%u\t%u ms\t%s\n", vec, n,
+                tsc_khz ? (uint32_t)div64_32(cycles, tsc_khz) : 0, top_vector_name(vec));
     }
-    update_cursor();
 }
 
-static void vga_puts(const char *s) {
-    for (int i = 0; s[i]; ++i) vga_putc(s[i]);
+/* seconds up and seconds idle, to the hundredth */
+static void proc_uptime(void) {
+    task_switch(cpu0_stat.task);
+    uint32_t up = timer_ticks * (100 / TIMER_HZ);
+    uint32_t idle = tsc_khz ? (uint32_t)div64_32(cpu0_stat.task_cycles[TASK_IDLE], tsc_khz * 10) : 0;
+    kprintf("%u.%u%u %u.%u%u\n", up / 100, up / 10 % 10, up % 10, idle / 100, idle / 10 % 10, idle % 10);
 }
 
-static void vga_clear(void) {
-    const uint16_t blank = (uint16_t)' ' | ((uint16_t)term_color << 8);
-    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; ++i) vga_buffer[i] = blank;
-    term_row = term_col = 0;
-    update_cursor();
+static void proc_fsstat(void) {
+    uint32_t used = 0, bytes = 0;
+    for (uint32_t i = 0; i < fs_max_files; ++i) if (files[i].used) { ++used; bytes += (uint32_t)files[i].size; }
+    kprintf("files\t%u of %u\nbytes\t%u of %u\nlargest\t%u\n", used, fs_max_files, bytes,
+            fs_max_files * fs_file_size, fs_file_size);
+    for (uint32_t i = 0; i < fs_max_files; ++i) if (files[i].used) {
+        char when[20];
+        clock_format(files[i].mtime, when);
+        kprintf("%s\t%d\t%s\n", files[i].name, files[i].size, when);
+    }
 }
 
-/* Minimal integer -> string helpers */
-static void kputu(uint32_t val, int base) {
-    char buf[33]; int i = 0;
-    if (val == 0) { vga_putc('0'); return; }
-    while (val) {
-        uint32_t d = val % base;
-        buf[i++] = (d < 10) ? ('0' + d) : ('a' + d - 10);
-        val /= base;
+/* milliseconds: cpu0 busy, irq and idle, then each task */
+static void proc_stat(void) {
+    task_switch(cpu0_stat.task);
+    const uint64_t *t = cpu0_stat.task_cycles;
+    uint64_t busy = 0;
+    for (int i = 0; i < NUM_TASKS; ++i) if (i != TASK_IDLE) busy += t[i];
+    uint32_t khz = tsc_khz ? tsc_khz : 1;
+    kprintf("cpu0 %u %u %u\n", (uint32_t)div64_32(busy, khz),
+            (uint32_t)div64_32(cpu_stat_read(&cpu0_stat.irq_cycles), khz), (uint32_t)div64_32(t[TASK_IDLE], khz));
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        kprintf("task ");
+        task_put_name(i);
+        kprintf(" %u\n", (uint32_t)div64_32(t[i], khz));
     }
-    while (i--) vga_putc(buf[i]);
 }
 
-static void kputi(int32_t val, int base) {
-    if (val < 0) { vga_putc('-'); kputu((uint32_t)(-val), base); }
-    else kputu((uint32_t)val, base);
+static const struct proc_file proc_files[] = {
+    { "meminfo",    proc_meminfo },
+    { "interrupts", proc_interrupts },
+    { "uptime",     proc_uptime },
+    { "fsstat",     proc_fsstat },
+    { "stat",       proc_stat },
+};
+#define NUM_PROC_FILES (int)(sizeof(proc_files) / sizeof(proc_files[0]))
+
+/* name is the part after /proc/ */
+static const char *proc_read(const char *name, int *size) {
+    for (int i = 0; i < NUM_PROC_FILES; ++i) {
+        const char *f = proc_files[i].name, *n = name;
+        while (*f && *f == *n) { ++f; ++n; }
+        if (*f || *n) continue;
+        int task = cpu0_stat.task;
+        char *buf = proc_bufs[task >= TASK_TTY1 && task < TASK_TTY1 + NUM_VTS ? task - TASK_TTY1 : NUM_VTS];
+        struct buf_stream b = { { buf_stream_putc, 0, buf_stream_write }, buf, 0, PROC_BUF };
+        struct out_stream *prev = cur_out;
+        cur_out = &b.out;
+        proc_files[i].show();
+        cur_out = prev;
+        if (b.len == PROC_BUF - 1) { /* full: assume more was cut */
+            int n = PROC_BUF - (int)sizeof(PROC_TRUNCATED);
+            while (n > 0 && buf[n - 1] != '\n') --n;
+            memcpy(buf + n, PROC_TRUNCATED, sizeof(PROC_TRUNCATED) - 1);
+            b.len = n + (int)sizeof(PROC_TRUNCATED) - 1;
+        }
+        *size = b.len;
+        return buf;
+    }
+    return 0;
 }
 
-/* minimal printf: supports %s, %d, %u, %x, %c */
-static void kprintf(const char *fmt, ... ) {
-    __builtin_va_list args;
-    __builtin_va_start(args, fmt);
-    for (int i = 0; fmt[i]; ++i) {
-        if (fmt[i] != '%') { vga_putc(fmt[i]); continue; }
-        ++i;
-        char f = fmt[i];
-        if (f == 's') { const char *s = __builtin_va_arg(args, const char*); vga_puts(s ? s : "(null)"); }
-        else if (f == 'd') { kputi(__builtin_va_arg(args, int), 10); }
-        else if (f == 'u') { kputu(__builtin_va_arg(args, unsigned int), 10); }
-        else if (f == 'x') { kputu(__builtin_va_arg(args, unsigned int), 16); }
-        else if (f == 'c') { char c = (char)__builtin_va_arg(args, int); vga_putc(c); }
-        else { vga_putc('%'); vga_putc(f); }
+/* "/proc/<name> <size>" lines for the HTTP index, sized by reading them now */
+static int proc_index(char *out, int cap) {
+    int n = 0;
+    for (int i = 0; i < NUM_PROC_FILES && n < cap; ++i) {
+        int size;
+        proc_read(proc_files[i].name, &size);
+        n += ksnprintf(out + n, cap - n, PROC_DIR "%s %d\n", proc_files[i].name, size);
     }
-    __builtin_va_end(args);
+    return n;
 }
 
-/* Simple scancode -> ASCII (set 1) for main keys. Non-exhaustive. */
-static const char scancode_map[128] = {
-    0, 27, '1','2','3','4','5','6','7','8','9','0','-','=','\b', /* 0x0 */
-    '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n', 0, /* 0x10 */
-    'a','s','d','f','g','h','j','k','l',';','\'', '`', 0,'\\','z','x', /* 0x20 */
-    'c','v','b','n','m',',','.','/', 0,'*', 0,' ', /* 0x30 */
+#ifdef CONFIG_FS_COMMANDS
+static void proc_list(void) {
+    kprintf("  " PROC_DIR " (generated on read):");
+    for (int i = 0; i < NUM_PROC_FILES; ++i) kprintf(" %s", proc_files[i].name);
+    kprintf("\n");
+}
+#endif
+#endif
+
+#ifdef CONFIG_WATCHDOG
+/* --- Watchdogs ---
+   Soft: the timer tick checks that the shell loop has run within
+   watchdog.soft seconds, which catches a command spinning with interrupts
+   on. Hard: an NMI, which arrives even with interrupts off, checks that
+   the timer tick itself moved within watchdog.hard seconds, which catches
+   a handler spinning with interrupts off. The NMI comes from the local
+   APIC's performance counter interrupt (unhalted cycles, about once a
+   second) or, without an architectural PMU (QEMU without KVM), from the
+   PIT: its I/O APIC pin is set to NMI delivery while the 8259 keeps
+   delivering IRQ0. A report gives the interrupted instruction pointer and
+   the return addresses found on the stack (addr2line -fe kernel.bin
+   names them), in the kernel log and on COM1, and repeats while the hang
+   lasts. */
+#define MSR_APIC_BASE 0x1B
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_PMC0 0xC1
+#define MSR_PERF_GLOBAL_CTRL 0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+#define APIC_BASE_X2APIC (1u << 10)
+#define APIC_BASE_ENABLE (1u << 11)
+#define LAPIC_ID 0x20
+#define LAPIC_SVR 0xF0
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_LVT_PMC 0x340
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define APIC_DM_NMI 0x400
+#define APIC_DM_EXTINT 0x700
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL 0x10
+#define IOAPIC_ACTIVE_LOW (1u << 13)
+#define EVTSEL_CYCLES 0x3C /* architectural event: unhalted core cycles */
+#define EVTSEL_USR (1u << 16)
+#define EVTSEL_OS (1u << 17)
+#define EVTSEL_INT (1u << 20)
+#define EVTSEL_EN (1u << 22)
+#define WATCHDOG_TRACE 12 /* return addresses per report */
+
+enum { WD_NMI_NONE, WD_NMI_PERF, WD_NMI_PIT };
+static const char *const wd_sources[] = { "none", "perf counter", "PIT via I/O APIC" };
+
+extern char __text_start[], __text_end[]; /* linker script */
+extern char stack_bottom[], stack_top[];   /* boot.S */
+static uint32_t watchdog_hard = WATCHDOG_HARD;
+static volatile uint32_t *lapic = 0;
+static int wd_source = WD_NMI_NONE;
+static uint32_t wd_pmu_version, wd_pmc_period;
+static uint64_t wd_pmc_sign;  /* the counter's top bit, clear once it has overflowed */
+static uint32_t wd_nmi_ticks; /* timer_ticks when an NMI last saw it move */
+static uint64_t wd_nmi_tsc;   /* and the TSC then */
+static uint32_t wd_nmis, wd_other_nmis, wd_soft_reports, wd_hard_reports;
+
+/* Reports are made in the timer interrupt or in the NMI, which may have
+   stopped the CPU inside klog, kprintf or the console; none of those may
+   be entered again from there. So a report is formatted here, written
+   to COM1 by polling, and queued in a buffer that console_idle moves
+   into the kernel log, and so onto the screen, once the shell loop runs
+   again (watchdog_flush). Each context has its own buffer with a single
+   writer: the timer tick (soft) and the NMI (hard), which may interrupt
+   the tick. The handler publishes a whole line by moving head; only
+   console_idle moves tail. */
+#define WD_LOG_SIZE 1024
+
+struct wd_log {
+    char buf[WD_LOG_SIZE];
+    volatile uint32_t head, tail; /* bytes queued and bytes moved to the kernel log */
+    volatile uint32_t dropped;    /* lines that did not fit */
+    char line[KLOG_MSG];
+    int len;
 };
+static struct wd_log wd_logs[2]; /* timer tick, NMI */
 
-/* Keyboard buffer for IRQ-driven input */
-#define KBUF_SIZE 256
-static volatile char kbuf[KBUF_SIZE];
-static volatile int kbuf_head = 0;
-static volatile int kbuf_tail = 0;
+static void wd_puts(struct wd_log *l, const char *s) {
+    while (*s && l->len < KLOG_MSG - 1) l->line[l->len++] = *s++;
+}
 
-/* Forward declaration for assembly stub */
-extern void irq1_entry(void);
+static void wd_putu(struct wd_log *l, uint32_t v, uint32_t base) {
+    char tmp[12];
+    int n = 0;
+    do { tmp[n++] = "0123456789abcdef"[v % base]; v /= base; } while (v);
+    if (base == 16) wd_puts(l, "0x");
+    while (n && l->len < KLOG_MSG - 1) l->line[l->len++] = tmp[--n];
+}
 
-/* PIC remap and IDT setup (minimal) */
-struct idt_entry {
-    uint16_t offset_low;
-    uint16_t selector;
-    uint8_t zero;
-    uint8_t flags;
-    uint16_t offset_high;
-} __attribute__((packed));
+/* End the line: out on COM1 now, queued for the kernel log */
+static void wd_end(struct wd_log *l) {
+    if (serial_present) {
+        serial_write_buf((const uint8_t *)l->line, (uint32_t)l->len);
+        serial_write_buf((const uint8_t *)"\r\n", 2);
+    }
+    uint32_t head = l->head;
+    if (head - l->tail + (uint32_t)l->len + 1 > WD_LOG_SIZE) {
+        ++l->dropped;
+    } else {
+        for (int i = 0; i < l->len; ++i) l->buf[(head + (uint32_t)i) % WD_LOG_SIZE] = l->line[i];
+        l->buf[(head + (uint32_t)l->len) % WD_LOG_SIZE] = '\n';
+        __asm__ volatile ("" ::: "memory"); /* the line before the new head */
+        l->head = head + (uint32_t)l->len + 1;
+    }
+    l->len = 0;
+}
 
-struct idt_ptr {
-    uint16_t limit;
-    uint32_t base;
-} __attribute__((packed));
+/* Called from console_idle: queued report lines into the kernel log. They
+   are on COM1 already, so the console echo is kept off the serial mirror. */
+static void watchdog_flush(void) {
+    for (int k = 0; k < 2; ++k) {
+        struct wd_log *l = &wd_logs[k];
+        if (l->tail == l->head && !l->dropped) continue;
+        int prev = serial_console;
+        serial_console = 0;
+        while (l->tail != l->head) {
+            char msg[KLOG_MSG];
+            int n = 0;
+            char c;
+            while ((c = l->buf[l->tail % WD_LOG_SIZE]) != '\n') {
+                if (n < KLOG_MSG - 1) msg[n++] = c;
+                ++l->tail;
+            }
+            ++l->tail;
+            msg[n] = '\0';
+            klog(KLOG_ERR, "%s", msg);
+        }
+        if (l->dropped) {
+            klog(KLOG_ERR, "watchdog: %u report lines lost (buffer full)", l->dropped);
+            l->dropped = 0;
+        }
+        serial_console = prev;
+    }
+}
 
-static struct idt_entry idt[256];
-static struct idt_ptr idtp;
+/* Inside kernel or module code, right after a call instruction */
+static int watchdog_return_addr(uintptr_t a) {
+    uintptr_t lo = (uintptr_t)__text_start, hi = (uintptr_t)__text_end;
+#ifdef CONFIG_MODULES
+    struct module *m = module_at(a);
+    if (m) { lo = m->base; hi = m->base + m->size; }
+#endif
+    if (a < lo + 7 || a >= hi) return 0;
+    const uint8_t *p = (const uint8_t *)a;
+    if (p[-5] == 0xE8) return 1; /* call rel32 */
+    /* call r/m (FF /2): opcode and ModRM, then up to a SIB byte and a 32-bit displacement */
+    for (int n = 2; n <= 7; ++n)
+        if (p[-n] == 0xFF && ((p[1 - n] >> 3) & 7) == 2) return 1;
+    return 0;
+}
 
-static void idt_set_gate(uint8_t n, uint32_t handler) {
-    idt[n].offset_low = handler & 0xFFFF;
-    idt[n].selector = 0x08; /* kernel code segment */
-    idt[n].zero = 0;
-    idt[n].flags = 0x8E; /* present, ring0, 32-bit interrupt gate */
-    idt[n].offset_high = (handler >> 16) & 0xFFFF;
+static void wd_addr(struct wd_log *l, uintptr_t a) {
+    wd_puts(l, " ");
+#ifdef CONFIG_MODULES
+    struct module *m = module_at(a);
+    if (m) { wd_puts(l, m->name); wd_puts(l, "+"); wd_putu(l, (uint32_t)(a - m->base), 16); return; }
+#endif
+    wd_putu(l, (uint32_t)a, 16);
 }
 
-static void idt_init(void) {
-    for (int i = 0; i < 256; ++i) {
-        idt[i].offset_low = 0;
-        idt[i].selector = 0;
-        idt[i].zero = 0;
-        idt[i].flags = 0;
-        idt[i].offset_high = 0;
+static void watchdog_report(struct wd_log *l, const struct irq_frame *f, const char *what, uint32_t secs) {
+#ifdef __x86_64__
+    uintptr_t sp = (uintptr_t)f->sp;
+#else
+    uintptr_t sp = (uintptr_t)(&f->flags + 1);
+#endif
+    int on_stack = sp >= (uintptr_t)stack_bottom && sp < (uintptr_t)stack_top;
+    wd_puts(l, "watchdog: ");
+    wd_puts(l, what);
+    if (secs) { wd_puts(l, " for "); wd_putu(l, secs, 10); wd_puts(l, " s"); }
+    wd_end(l);
+    wd_puts(l, "watchdog: ip");
+    wd_addr(l, f->ip);
+    wd_puts(l, ", sp ");
+    wd_putu(l, (uint32_t)sp, 16);
+    wd_puts(l, ", flags ");
+    wd_putu(l, (uint32_t)f->flags, 16);
+    wd_end(l);
+    wd_puts(l, "watchdog: call trace:");
+    int found = 0;
+    if (on_stack) {
+        for (const uintptr_t *w = (const uintptr_t *)sp; w < (const uintptr_t *)stack_top && found < WATCHDOG_TRACE; ++w) {
+            if (!watchdog_return_addr(*w)) continue;
+            if (l->len > KLOG_MSG - 24) { wd_end(l); wd_puts(l, "watchdog:  "); }
+            wd_addr(l, *w);
+            ++found;
+        }
     }
-    idtp.limit = sizeof(idt) - 1;
-    idtp.base = (uint32_t)&idt;
+    if (!found) wd_puts(l, on_stack ? " none found" : " sp is not on the kernel stack");
+    wd_end(l);
 }
 
-static void idt_load(void) {
-    __asm__ volatile ("lidt (%0)" : : "r"(&idtp));
+static void watchdog_soft_fire(const struct irq_frame *f) {
+    watchdog_touched = timer_ticks; /* again after another watchdog.soft seconds */
+    ++wd_soft_reports;
+    watchdog_report(&wd_logs[0], f, "soft lockup: the shell loop has not run", watchdog_soft);
 }
 
-static void pic_remap(void) {
-    uint8_t a1 = inb(0x21);
-    uint8_t a2 = inb(0xA1);
+static void watchdog_perf_arm(void) {
+    wrmsr(MSR_PMC0, (uint32_t)-wd_pmc_period); /* sign-extended: counts up to the overflow */
+    if (wd_pmu_version >= 2) wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+    lapic[LAPIC_LVT_PMC / 4] = APIC_DM_NMI; /* delivering the NMI masked it again */
+}
 
-    outb(0x20, 0x11);
-    outb(0xA0, 0x11);
-    outb(0x21, 0x20);
-    outb(0xA1, 0x28);
-    outb(0x21, 4);
-    outb(0xA1, 2);
-    outb(0x21, 0x01);
-    outb(0xA1, 0x01);
+static void watchdog_nmi(const struct irq_frame *f) {
+    ++wd_nmis;
+    if (wd_source == WD_NMI_PERF) {
+        if (rdmsr(MSR_PMC0) & wd_pmc_sign) {
+            /* not the counter: the NMI button, or QEMU's nmi monitor command */
+            ++wd_other_nmis;
+            watchdog_report(&wd_logs[1], f, "NMI from outside the watchdog", 0);
+            return;
+        }
+        watchdog_perf_arm();
+    } else if (wd_source == WD_NMI_NONE) {
+        ++wd_other_nmis;
+        watchdog_report(&wd_logs[1], f, "NMI from outside the watchdog", 0);
+        return;
+    }
+    uint64_t now = rdtsc();
+    if (timer_ticks != wd_nmi_ticks) { wd_nmi_ticks = timer_ticks; wd_nmi_tsc = now; return; }
+    if (!watchdog_hard || now - wd_nmi_tsc < (uint64_t)watchdog_hard * tsc_khz * 1000) return;
+    wd_nmi_tsc = now;
+    ++wd_hard_reports;
+    watchdog_report(&wd_logs[1], f, "hard lockup: no timer interrupt", watchdog_hard);
+}
 
-    outb(0x21, a1);
-    outb(0xA1, a2);
+/* Called from assembly stub (nmi_entry) */
+void nmi_handler(const struct irq_frame *f) {
+    uint64_t start = rdtsc();
+    watchdog_nmi(f);
+    irq_account(STAT_NMI, start);
 }
 
-static void pic_unmask_keyboard(void) {
-    uint8_t mask = inb(0x21);
-    mask &= ~(1 << 1); /* clear bit 1 (IRQ1 keyboard) */
-    outb(0x21, mask);
+/* xAPIC mode only. Firmware normally leaves the APIC on in virtual wire
+   mode; if it is software-disabled, set that up, so the 8259 still
+   reaches the CPU through LINT0. */
+static int lapic_init(void) {
+    if (!cpu_has(CPUF_APIC)) return -1;
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    if (!(base & APIC_BASE_ENABLE) || (base & APIC_BASE_X2APIC)) return -1;
+    lapic = (volatile uint32_t *)(uintptr_t)(base & 0xFFFFF000u);
+    if (!(lapic[LAPIC_SVR / 4] & LAPIC_SVR_ENABLE)) {
+        lapic[LAPIC_LVT_LINT0 / 4] = APIC_DM_EXTINT;
+        lapic[LAPIC_LVT_LINT1 / 4] = APIC_DM_NMI;
+        lapic[LAPIC_SVR / 4] = LAPIC_SVR_ENABLE | 0xFF;
+    }
+    return 0;
 }
 
-/* Called from assembly stub (irq1_entry) */
-void keyboard_handler(void) {
-    uint8_t sc = inb(0x60);
-    /* ignore key release */
-    if (sc & 0x80) return;
-    char c = 0;
-    if (sc < sizeof(scancode_map)) c = scancode_map[sc];
-    if (!c) return;
-    int next = (kbuf_head + 1) % KBUF_SIZE;
-    if (next != kbuf_tail) { kbuf[kbuf_head] = c; kbuf_head = next; }
+/* General counter 0 on unhalted cycles, overflowing into a local APIC NMI */
+static int watchdog_perf_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    if (a < 0xA) return -1;
+    cpuid(0xA, &a, &b, &c, &d);
+    uint32_t width = (a >> 16) & 0xFF;
+    /* a PMU version, a general counter, and the cycles event not flagged missing */
+    if (!(a & 0xFF) || !((a >> 8) & 0xFF) || width < 32 || (a >> 24) < 1 || (b & 1)) return -1;
+    wd_pmu_version = a & 0xFF;
+    wd_pmc_sign = 1ull << (width - 1);
+    /* counter writes sign-extend bit 31, so a period stays under 2^31 cycles */
+    wd_pmc_period = tsc_khz < 2147483 ? tsc_khz * 1000 : 0x7FFFFFFFu;
+    wrmsr(MSR_PERFEVTSEL0, 0);
+    watchdog_perf_arm();
+    if (wd_pmu_version >= 2) wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 1);
+    wrmsr(MSR_PERFEVTSEL0, EVTSEL_CYCLES | EVTSEL_USR | EVTSEL_OS | EVTSEL_INT | EVTSEL_EN);
+    return 0;
 }
 
-/* IRQ-based getchar: blocks (busy-wait) until character available */
-static char keyboard_getchar_irq(void) {
-    while (kbuf_head == kbuf_tail) {}
-    char c = kbuf[kbuf_tail];
-    kbuf_tail = (kbuf_tail + 1) % KBUF_SIZE;
-    return c;
+static uint32_t ioapic_read(volatile uint32_t *io, uint32_t reg) { io[0] = reg; return io[4]; }
+static void ioapic_write(volatile uint32_t *io, uint32_t reg, uint32_t v) { io[0] = reg; io[4] = v; }
+
+/* The PIT's I/O APIC pin (ISA IRQ0, usually moved to GSI 2 by an override) as an edge NMI */
+static int watchdog_pit_init(void) {
+    uint32_t gsi = 0, redir = APIC_DM_NMI;
+    for (int i = 0; i < acpi.num_overrides; ++i) {
+        if (acpi.overrides[i].irq != 0) continue;
+        gsi = acpi.overrides[i].gsi;
+        if ((acpi.overrides[i].flags & 3) == 3) redir |= IOAPIC_ACTIVE_LOW;
+    }
+    for (int i = 0; i < acpi.num_ioapics; ++i) {
+        volatile uint32_t *io = (volatile uint32_t *)(uintptr_t)acpi.ioapics[i].addr;
+        uint32_t pins = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+        if (gsi < acpi.ioapics[i].gsi_base || gsi - acpi.ioapics[i].gsi_base >= pins) continue;
+        uint32_t pin = gsi - acpi.ioapics[i].gsi_base;
+        ioapic_write(io, IOAPIC_REDTBL + 2 * pin + 1, lapic[LAPIC_ID / 4] & 0xFF000000u);
+        ioapic_write(io, IOAPIC_REDTBL + 2 * pin, redir);
+        return 0;
+    }
+    return -1;
 }
 
-/* Simple line reader (uses IRQ-driven getchar) */
-#define INPUT_BUF 128
-static void read_line(char *buf, int bufsize) {
-    int idx = 0;
-    while (1) {
-        char c = keyboard_getchar_irq();
-        if (c == '\n' || c == '\r') { vga_putc('\n'); buf[idx] = '\0'; return; }
-        else if (c == '\b') {
-            if (idx > 0) { --idx; vga_putc('\b'); }
+/* Needs the clock (tsc_khz) and ACPI; watchdog.hard=0 leaves the APICs alone */
+static void watchdog_init(void) {
+    watchdog_touch();
+    wd_nmi_ticks = timer_ticks;
+    wd_nmi_tsc = rdtsc();
+    if (!watchdog_hard || !tsc_khz || lapic_init() < 0) return;
+    if (watchdog_perf_init() == 0) wd_source = WD_NMI_PERF;
+    else if (watchdog_pit_init() == 0) wd_source = WD_NMI_PIT;
+}
+
+/* watchdog [test soft|hard] */
+static void watchdog_command(const char *arg) {
+    if (arg[0] == 't' && arg[1] == 'e' && arg[2] == 's' && arg[3] == 't' && arg[4] == ' ') {
+        const char *w = arg + 5;
+        while (*w == ' ') ++w;
+        if (w[0] == 's' && w[1] == 'o' && w[2] == 'f' && w[3] == 't' && w[4] == '\0') {
+            if (!watchdog_soft) { kprintf("watchdog: watchdog.soft is 0 (off)\n"); return; }
+            kprintf("watchdog: spinning %u s with interrupts on\n", watchdog_soft + 2);
+            uint32_t start = timer_ticks;
+            while (timer_ticks - start < (watchdog_soft + 2) * TIMER_HZ) {}
+        } else if (w[0] == 'h' && w[1] == 'a' && w[2] == 'r' && w[3] == 'd' && w[4] == '\0') {
+            if (wd_source == WD_NMI_NONE || !watchdog_hard) { kprintf("watchdog: no hard watchdog running\n"); return; }
+            kprintf("watchdog: spinning %u s with interrupts off\n", watchdog_hard + 2);
+            uint64_t end = rdtsc() + (uint64_t)(watchdog_hard + 2) * tsc_khz * 1000;
+            __asm__ volatile ("cli");
+            while (rdtsc() < end) {}
+            __asm__ volatile ("sti");
         } else {
-            if (idx < bufsize - 1) { buf[idx++] = c; vga_putc(c); }
+            kprintf("Usage: watchdog [test soft|hard]\n");
+            return;
         }
+        kprintf("watchdog: back (see dmesg)\n");
+        return;
     }
+    if (*arg) { kprintf("Usage: watchdog [test soft|hard]\n"); return; }
+    kprintf("soft: %u s without a shell loop pass (watchdog.soft), %u reports\n", watchdog_soft, wd_soft_reports);
+    kprintf("hard: %u s without a timer tick (watchdog.hard), NMI from %s", watchdog_hard, wd_sources[wd_source]);
+    if (wd_source == WD_NMI_PERF) kprintf(" every %u ms", tsc_khz ? wd_pmc_period / tsc_khz : 0);
+    if (wd_source == WD_NMI_PIT) kprintf(" at %u Hz", TIMER_HZ);
+    kprintf(", %u NMIs, %u reports\n", wd_nmis, wd_hard_reports);
+    if (wd_other_nmis) kprintf("other NMIs: %u\n", wd_other_nmis);
 }
+#else
+void nmi_handler(const struct irq_frame *f) { (void)f; }
+#endif
 
-/* --- Tiny in-memory filesystem --- */
-#define MAX_FILES 16
-#define MAX_NAME 16
-#define MAX_FILE_SIZE 512
+/* --- Tunables ---
+   Sizes and knobs that used to need a rebuild, set as name=value on the
+   kernel command line (the multiboot line in grub.cfg, or QEMU -append).
+   Boot tunables size tables at init and are fixed from then on; the others
+   can also be changed at run time with sysctl. The subsystem #defines are
+   the defaults. */
+enum { TUN_UINT, TUN_BOOL, TUN_IP };
+#define TUN_BOOT 1 /* command line only */
 
-struct file_entry {
-    char name[MAX_NAME];
-    int used;
-    int size;
-    char data[MAX_FILE_SIZE];
+struct tunable {
+    const char *name;
+    uint8_t type, flags;
+    uint32_t *value;
+    uint32_t min, max;
+    const char *desc;
 };
 
-static struct file_entry files[MAX_FILES];
+static const struct tunable tunables[] = {
+    { "kbd.queue",     TUN_UINT, TUN_BOOT, &kbuf_size,       16, 4096,          "keyboard queue per terminal, bytes" },
+    { "con.scrollback", TUN_UINT, TUN_BOOT, &con_scrollback,  0,  8192,          "scrollback lines per terminal" },
+    { "shell.line",    TUN_UINT, TUN_BOOT, &input_buf,       32, INPUT_MAX,     "longest shell line" },
+    { "klog.records",  TUN_UINT, TUN_BOOT, &klog_records,    16, 4096,          "kernel log ring size" },
+    { "klog.console",  TUN_UINT, 0,        &klog_console,    0,  KLOG_DEBUG,    "most verbose log level shown on the console" },
+    { "fs.files",      TUN_UINT, TUN_BOOT, &fs_max_files,    1,  256,           "file table slots" },
+    { "fs.file_size",  TUN_UINT, TUN_BOOT, &fs_file_size,    64, 65536,         "largest file, bytes" },
+#ifdef CONFIG_MOUSE
+    { "mouse",         TUN_BOOL, TUN_BOOT, &mouse_enable,    0,  1,             "probe for a PS/2 mouse" },
+#endif
+    { "net.ip",        TUN_IP,   TUN_BOOT, &net_ip,          0,  0xFFFFFFFFu,   "eth0 address" },
+    { "net.gateway",   TUN_IP,   TUN_BOOT, &net_gateway,     0,  0xFFFFFFFFu,   "eth0 default gateway" },
+    { "net.copybreak", TUN_UINT, 0,        &e1000_copybreak, 0,  E1000_BUF_SIZE, "smallest payload sent without a copy" },
+    { "logship.rate",  TUN_UINT, 0,        &logship_rate,    1,  1000,          "log datagrams per second" },
+    { "cpu.generic",   TUN_BOOL, TUN_BOOT, &cpu_generic,     0,  1,             "baseline code paths only" },
+#ifdef CONFIG_MODULES
+    { "mod.pool",      TUN_UINT, TUN_BOOT, &mod_pool_size,   4096, 16u << 20,   "memory for loaded modules, bytes" },
+    { "mod.autoload",  TUN_BOOL, 0,        &mod_autoload,    0,  1,             "load <command>.ko for an unknown command" },
+#endif
+#ifdef CONFIG_WATCHDOG
+    { "watchdog.soft", TUN_UINT, 0,        &watchdog_soft,   0,  600,           "seconds the shell loop may stall before a report (0: off)" },
+    { "watchdog.hard", TUN_UINT, 0,        &watchdog_hard,   0,  600,           "seconds without a timer tick before an NMI report (0 at boot: no NMI)" },
+#endif
+};
+#define NUM_TUNABLES (int)(sizeof(tunables) / sizeof(tunables[0]))
+#define CMDLINE_MAX 256
+#define CMDLINE_ERRORS 4
 
-static void fs_init(void) {
-    for (int i = 0; i < MAX_FILES; ++i) files[i].used = 0;
-    /* create a welcome file */
-    const char *w = "welcome: This is MiniOS (in-memory FS)\n";
-    int idx = -1;
-    for (int i = 0; i < MAX_FILES; ++i) if (!files[i].used) { idx = i; break; }
-    if (idx >= 0) {
-        files[idx].used = 1;
-        int n = 0; while (w[n] && n < MAX_FILE_SIZE) { files[idx].data[n] = w[n]; ++n; }
-        files[idx].size = n;
-        /* name it "welcome" */
-        int j; for (j = 0; j < MAX_NAME - 1 && "welcome"[j]; ++j) files[idx].name[j] = "welcome"[j];
-        files[idx].name[j] = '\0';
+static char kernel_cmdline[CMDLINE_MAX];
+static char cmdline_errors[CMDLINE_ERRORS][64]; /* logged once the kernel log is up */
+static int cmdline_nerrors = 0;
+
+static const struct tunable *tunable_find(const char *name, int len) {
+    for (int i = 0; i < NUM_TUNABLES; ++i) {
+        const char *n = tunables[i].name;
+        int k = 0;
+        while (k < len && n[k] == name[k]) ++k;
+        if (k == len && n[k] == '\0') return &tunables[i];
     }
+    return 0;
 }
 
-static int fs_find(const char *name) {
-    for (int i = 0; i < MAX_FILES; ++i) if (files[i].used) {
-        int k = 0; while (k < MAX_NAME && files[i].name[k] && name[k] && files[i].name[k] == name[k]) ++k;
-        if (files[i].name[k] == '\0' && name[k] == '\0') return i;
+/* Parse a value (len bytes at s) for t: decimal with an optional K or M
+   suffix, 0/1/on/off, or a dotted quad. Returns 0, or -1 if malformed or
+   out of range. */
+static int tunable_parse(const struct tunable *t, const char *s, int len, uint32_t *out) {
+    uint32_t v = 0;
+    if (len <= 0) return -1;
+    if (t->type == TUN_IP) {
+        const char *end = parse_ip(s, &v);
+        if (!end || end != s + len) return -1;
+    } else if (t->type == TUN_BOOL && len >= 2 && s[0] == 'o') {
+        if (len == 2 && s[1] == 'n') v = 1;
+        else if (len == 3 && s[1] == 'f' && s[2] == 'f') v = 0;
+        else return -1;
+    } else {
+        int i = 0;
+        for (; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+            if (v > 0xFFFFFFFFu / 10 - 1) return -1;
+            v = v * 10 + (uint32_t)(s[i] - '0');
+        }
+        if (i == 0) return -1;
+        if (i == len - 1 && (s[i] == 'K' || s[i] == 'k') && v < (1u << 22)) { v <<= 10; ++i; }
+        else if (i == len - 1 && (s[i] == 'M' || s[i] == 'm') && v < (1u << 12)) { v <<= 20; ++i; }
+        if (i != len) return -1;
     }
-    return -1;
+    if (v < t->min || v > t->max) return -1;
+    *out = v;
+    return 0;
 }
 
-static int fs_create(const char *name) {
-    if (fs_find(name) >= 0) return -1; /* already exists */
-    for (int i = 0; i < MAX_FILES; ++i) if (!files[i].used) {
-        files[i].used = 1; files[i].size = 0; int j=0; while (j < MAX_NAME - 1 && name[j]) { files[i].name[j] = name[j]; ++j; } files[i].name[j] = '\0'; return i;
+static void cmdline_error(const char *what, const char *s, int len) {
+    if (cmdline_nerrors == CMDLINE_ERRORS) return;
+    char tok[40];
+    int n = len < (int)sizeof(tok) - 1 ? len : (int)sizeof(tok) - 1;
+    for (int i = 0; i < n; ++i) tok[i] = s[i];
+    tok[n] = '\0';
+    ksnprintf(cmdline_errors[cmdline_nerrors++], sizeof(cmdline_errors[0]), "%s: %s", what, tok);
+}
+
+/* Apply name=value words from the Multiboot command line. The first word
+   is the kernel's own path under GRUB; words without '=' other than bool
+   tunable names are left for someone else. Runs before anything is sized. */
+static void tunables_init(const struct multiboot_info *mbi) {
+    if (!mbi || !(mbi->flags & MB_INFO_CMDLINE) || !mbi->cmdline) return;
+    const char *src = (const char *)(uintptr_t)mbi->cmdline;
+    int len = 0;
+    while (src[len] && len < CMDLINE_MAX - 1) { kernel_cmdline[len] = src[len]; ++len; }
+    kernel_cmdline[len] = '\0';
+    const char *p = kernel_cmdline;
+    while (*p) {
+        while (*p == ' ') ++p;
+        const char *w = p, *eq = 0;
+        while (*p && *p != ' ') { if (*p == '=' && !eq) eq = p; ++p; }
+        if (p == w) break;
+        const struct tunable *t = tunable_find(w, (int)((eq ? eq : p) - w));
+        uint32_t v;
+        if (!eq) {
+            if (t && t->type == TUN_BOOL) *t->value = 1;
+        } else if (!t) {
+            cmdline_error("unknown tunable", w, (int)(eq - w));
+        } else if (tunable_parse(t, eq + 1, (int)(p - eq - 1), &v) < 0) {
+            cmdline_error("bad value", w, (int)(p - w));
+        } else {
+            *t->value = v;
+        }
     }
-    return -1; /* no space */
 }
 
-static int fs_write(const char *name, const char *data, int len) {
-    int idx = fs_find(name);
-    if (idx < 0) idx = fs_create(name);
-    if (idx < 0) return -1;
-    int n = 0; while (n < len && n < MAX_FILE_SIZE) { files[idx].data[n] = data[n]; ++n; }
-    files[idx].size = n; return n;
+static void tunables_report(void) {
+    if (kernel_cmdline[0]) klog(KLOG_INFO, "cmdline: %s", kernel_cmdline);
+    for (int i = 0; i < cmdline_nerrors; ++i) klog(KLOG_WARN, "cmdline: %s", cmdline_errors[i]);
 }
 
-static int fs_read_to_console(const char *name) {
-    int idx = fs_find(name);
-    if (idx < 0) return -1;
-    for (int i = 0; i < files[idx].size; ++i) vga_putc(files[idx].data[i]);
-    return files[idx].size;
+static int tunable_format(const struct tunable *t, char *buf, int cap) {
+    uint32_t v = *t->value;
+    if (t->type == TUN_IP) return ksnprintf(buf, cap, IP_FMT, IP_ARGS(v));
+    if (t->type == TUN_BOOL) return ksnprintf(buf, cap, v ? "on" : "off");
+    return ksnprintf(buf, cap, "%u", v);
 }
 
-static void fs_list(void) {
-    kprintf("Files:\n");
-    for (int i = 0; i < MAX_FILES; ++i) if (files[i].used) {
-        kprintf("  %s (%d bytes)\n", files[i].name, files[i].size);
-    }
+static void tunable_show(const struct tunable *t) {
+    char val[16];
+    int n = 0, w = tunable_format(t, val, sizeof(val));
+    while (t->name[n]) ++n;
+    kprintf("  %s", t->name);
+    for (; n < 15; ++n) kprintf(" ");
+    kprintf("%s", val);
+    for (; w < 16; ++w) kprintf(" ");
+    kprintf("%s%s\n", t->desc, t->flags & TUN_BOOT ? " (boot)" : "");
 }
 
-static int fs_remove(const char *name) {
-    int idx = fs_find(name);
-    if (idx < 0) return -1;
-    files[idx].used = 0; return 0;
+/* sysctl [name [value] | name=value] */
+static void sysctl_command(char *arg) {
+    if (!*arg) {
+        for (int i = 0; i < NUM_TUNABLES; ++i) tunable_show(&tunables[i]);
+        kprintf("kmem: %u KiB allocated at boot, %u KiB free\n", (uint32_t)(kmem_next - kmem_start) / 1024,
+                (uint32_t)(kmem_limit - kmem_next) / 1024);
+        return;
+    }
+    char *p = arg;
+    while (*p && *p != '=' && *p != ' ') ++p;
+    const struct tunable *t = tunable_find(arg, (int)(p - arg));
+    if (!t) { kprintf("sysctl: no tunable named that (run sysctl for the list)\n"); return; }
+    char *v = *p ? p + 1 : p;
+    while (*v == ' ') ++v;
+    int vlen = 0;
+    while (v[vlen] && v[vlen] != ' ') ++vlen;
+    if (!vlen) { tunable_show(t); return; }
+    if (t->flags & TUN_BOOT) {
+        kprintf("sysctl: %s sizes boot-time tables; set %s=<value> on the kernel command line\n", t->name, t->name);
+        return;
+    }
+    uint32_t val;
+    if (tunable_parse(t, v, vlen, &val) < 0) {
+        if (t->type == TUN_UINT) kprintf("sysctl: %s takes %u..%u\n", t->name, t->min, t->max);
+        else kprintf("sysctl: bad value for %s\n", t->name);
+        return;
+    }
+    *t->value = val;
+    char buf[16];
+    tunable_format(t, buf, sizeof(buf));
+    klog(KLOG_INFO, "sysctl: %s = %s", t->name, buf);
+    tunable_show(t);
 }
 
+#ifdef CONFIG_NANO
 /* Simple nano-like line editor (very small): append-only editor. Commands start with '.' */
 static void nano_edit(const char *filename) {
-    char buf[MAX_FILE_SIZE];
+    if (!console_may_wait("nano")) return;
+    char *buf = fs_scratch[vt_out - vts];
+    const int max = (int)fs_file_size;
     int len = 0;
-    int idx = fs_find(filename);
-    if (idx >= 0) {
-        len = files[idx].size;
-        if (len > MAX_FILE_SIZE) len = MAX_FILE_SIZE;
-        for (int i = 0; i < len; ++i) buf[i] = files[idx].data[i];
+    const char *data = fs_data(filename, &len);
+    if (data) {
+        if (len > max) len = max;
+        for (int i = 0; i < len; ++i) buf[i] = data[i];
+    } else {
+        len = 0;
     }
-    kprintf("--- nano: editing %s (max %d bytes) ---\n", filename, MAX_FILE_SIZE);
+    kprintf("--- nano: editing %s (max %d bytes) ---\n", filename, max);
     kprintf("Commands: .help .save .wq .quit\n");
     if (len > 0) {
         kprintf("--- current contents ---\n");
-        for (int i = 0; i < len; ++i) vga_putc(buf[i]);
+        for (int i = 0; i < len; ++i) console_putc(buf[i]);
         kprintf("--- end ---\n");
     }
 
-    char line[INPUT_BUF];
+    char line[INPUT_MAX];
     while (1) {
         kprintf("edit> ");
-        read_line(line, INPUT_BUF);
+        read_line(line, input_buf);
         if (line[0] == '\0') continue;
         if (line[0] == '.') {
             /* command */
@@ -352,52 +5636,363 @@ static void nano_edit(const char *filename) {
         /* append line and newline */
         int i = 0;
         while (line[i]) {
-            if (len < MAX_FILE_SIZE) buf[len++] = line[i++]; else { kprintf("Buffer full\n"); break; }
+            if (len < max) buf[len++] = line[i++]; else { kprintf("Buffer full\n"); break; }
         }
-        if (len < MAX_FILE_SIZE) { buf[len++] = '\n'; } else { kprintf("Buffer full, no newline\n"); }
+        if (len < max) { buf[len++] = '\n'; } else { kprintf("Buffer full, no newline\n"); }
     }
 
     kprintf("Exiting editor\n");
 }
+#endif
+
+/* --- Pager ---
+   more/less for a file or for the output of a pipe. The text is indexed
+   once into display lines (split at newlines and at the screen width), so
+   any line can be reached in O(1) and drawing a screen only touches the
+   lines on it. Screens are drawn with VT100 sequences, so the pager works
+   the same way on the serial console. */
+#define PIPE_BUF 16384
+
+static char pipe_buf[PIPE_BUF];
+static const char *pipe_in; /* output of the left side of a pipe, read by the right side */
+static uint32_t pipe_in_len;
+static int pipe_busy;
+
+/* Offset of each display line. A line holds at least one byte, so the
+   longest text the pager gets (a pipe or a file of fs.file_size bytes;
+   /proc files are shorter) needs one more entry than it has bytes. */
+static uint32_t *pager_index;
+static uint32_t pager_max_lines;
+static int pager_busy; /* one pager at a time; the index is shared */
+
+static void pager_init(void) {
+    pager_max_lines = (fs_file_size > PIPE_BUF ? fs_file_size : PIPE_BUF) + 1;
+    pager_index = kmem_alloc(pager_max_lines * sizeof(*pager_index), "pager");
+}
+
+static uint32_t pager_build_index(const char *data, uint32_t len) {
+    uint32_t n = 0, col = 0;
+    pager_index[n++] = 0;
+    for (uint32_t i = 0; i < len && n < pager_max_lines; ++i) {
+        if (data[i] == '\n') {
+            if (i + 1 < len) pager_index[n++] = i + 1;
+            col = 0;
+            continue;
+        }
+        uint32_t w = data[i] == '\t' ? 8 - (col & 7) : 1;
+        if (col + w > (uint32_t)con_cols) { pager_index[n++] = i; col = 0; }
+        col += w;
+    }
+    return n;
+}
+
+/* Draw display line k on screen row 'row' (1-based), control characters shown as '.' */
+static void pager_draw_line(const char *data, uint32_t len, uint32_t n, uint32_t k, int row) {
+    char buf[CON_MAX_COLS];
+    int col = 0;
+    if (k < n) {
+        uint32_t end = k + 1 < n ? pager_index[k + 1] : len;
+        for (uint32_t i = pager_index[k]; i < end && data[i] != '\n' && col < con_cols; ++i) {
+            if (data[i] == '\t') { do buf[col++] = ' '; while ((col & 7) && col < con_cols); }
+            else buf[col++] = ((uint8_t)data[i] < 0x20 || data[i] == 0x7F) ? '.' : data[i];
+        }
+    }
+    kprintf("\033[%d;1H\033[K", row);
+    out_write(buf, col);
+}
+
+/* First display line at or after 'from' that contains pat, or -1 */
+static int pager_search(const char *data, uint32_t len, uint32_t n, uint32_t from, const char *pat) {
+    uint32_t plen = 0;
+    while (pat[plen]) ++plen;
+    if (!plen || from >= n) return -1;
+    const char *hit = kmemmem(data + pager_index[from], len - pager_index[from], pat, plen);
+    if (!hit) return -1;
+    /* the last line starting at or before the match */
+    uint32_t i = (uint32_t)(hit - data), lo = from, hi = n - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (pager_index[mid] <= i) lo = mid; else hi = mid - 1;
+    }
+    return (int)lo;
+}
+
+static void pager(const char *name, const char *data, uint32_t len) {
+    if (!cur_out->interactive) {
+        /* nobody to press keys: behave like cat */
+        out_write(data, len);
+        if (len && data[len - 1] != '\n') out_putc('\n');
+        return;
+    }
+    if (pager_busy) { kprintf("more: the pager is in use on another terminal\n"); return; }
+    if (!console_may_wait("more")) return;
+    pager_busy = 1;
+    uint32_t n = pager_build_index(data, len);
+    uint32_t page = con_rows - 1, top = 0, count = 0;
+    char pat[INPUT_MAX];
+    const char *msg = 0;
+    pat[0] = '\0';
+    kprintf("\033[?25l");
+    for (;;) {
+        uint32_t max_top = n > page ? n - page : 0;
+        if (top > max_top) top = max_top;
+        for (uint32_t r = 0; r < page; ++r) pager_draw_line(data, len, n, top + r, (int)r + 1);
+        kprintf("\033[%d;1H\033[K\033[7m %s ", con_rows, name);
+        if (msg) kprintf(" %s ", msg);
+        else if (top + page >= n) kprintf(" lines %u-%u/%u (END) ", top + 1, n, n);
+        else kprintf(" lines %u-%u/%u (%u%%) ", top + 1, top + page, n, (top + page) * 100 / n);
+        kprintf("\033[m");
+        msg = 0;
+
+        char c = keyboard_getchar_irq();
+        if (c >= '0' && c <= '9') {
+            /* count prefix, e.g. 120g */
+            do { count = count * 10 + (c - '0'); c = keyboard_getchar_irq(); } while (c >= '0' && c <= '9');
+        }
+        uint32_t step = count ? count : 1;
+        if (c == 'q' || c == 'Q') break;
+        else if (c == ' ' || c == 'f') top += page;
+        else if (c == 'b') top = top > page ? top - page : 0;
+        else if (c == 'd') top += page / 2;
+        else if (c == 'u') top = top > page / 2 ? top - page / 2 : 0;
+        else if (c == '\n' || c == 'j') top += step;
+        else if (c == 'k') top = top > step ? top - step : 0;
+        else if (c == 'g') top = count ? count - 1 : 0;
+        else if (c == 'G') top = count ? count - 1 : max_top;
+        else if (c == '/' || c == 'n') {
+            if (c == '/') {
+                kprintf("\033[%d;1H\033[K/\033[?25h", con_rows);
+                read_line(pat, input_buf);
+                kprintf("\033[?25l");
+            }
+            int hit = pager_search(data, len, n, top + 1, pat);
+            if (hit < 0) msg = pat[0] ? "Pattern not found" : "No previous search";
+            else top = (uint32_t)hit;
+        } else if (c == 'h') msg = "SPACE/f b d u ENTER/j k [n]g [n]G /text n q";
+        count = 0;
+    }
+    kprintf("\033[%d;1H\033[K\033[?25h", con_rows);
+    pager_busy = 0;
+}
+
+/* more/less [file]: page a file, or the output of a pipe */
+static void pager_command(const char *arg) {
+    if (*arg) {
+        int size;
+        const char *data = fs_data(arg, &size);
+        if (!data) { kprintf("No such file: %s\n", arg); return; }
+        pager(arg, data, (uint32_t)size);
+    } else if (pipe_in) {
+        pager("(pipe)", pipe_in, pipe_in_len);
+    } else {
+        kprintf("Usage: more <file>  or  <command> | more\n");
+    }
+}
 
 /* helper: skip leading spaces */
 static char *skip_spaces(char *s) { while (*s == ' ') ++s; return s; }
 
+/* helper: parse a decimal number (saturating at 0xFFFFFFFF); returns the
+   position after it or 0 */
+static char *parse_uint(char *s, uint32_t *out) {
+    if (*s < '0' || *s > '9') return 0;
+    uint32_t v = 0;
+    while (*s >= '0' && *s <= '9') {
+        uint32_t d = (uint32_t)(*s++ - '0');
+        v = v > (0xFFFFFFFFu - d) / 10 ? 0xFFFFFFFFu : v * 10 + d;
+    }
+    *out = v;
+    return s;
+}
+
+/* logship [off | <ip> <port> [name]] */
+static void logship_command(char *arg) {
+    if (!*arg) { logship_status(); return; }
+    if (arg[0]=='o' && arg[1]=='f' && arg[2]=='f' && arg[3]=='\0') { logship_enabled = 0; klog(KLOG_INFO, "logship: stopped"); return; }
+    uint32_t ip, port;
+    char *q = (char *)parse_ip(arg, &ip);
+    if (!q || *q != ' ' || !(q = parse_uint(skip_spaces(q), &port)) || port == 0 || port > 0xFFFF) {
+        kprintf("Usage: logship [off | <ip> <port> [name]]\n"); return;
+    }
+    char name[24];
+    q = skip_spaces(q);
+    if (*q) { int i = 0; while (q[i] && q[i] != ' ' && i < 23) { name[i] = q[i]; ++i; } name[i] = '\0'; }
+    else ksnprintf(name, sizeof(name), "%x%x%x", e1000_if.mac[3], e1000_if.mac[4], e1000_if.mac[5]);
+    logship_start(ip, (uint16_t)port, name);
+    klog(KLOG_INFO, "logship: shipping to " IP_FMT ":%u as %s", IP_ARGS(ip), port, name);
+}
+
+static void rsh_status(void);
+
+/* Commands that read pipe_in; anything else on the right of a pipe would drop it */
+static int pipe_reader(const char *s) {
+    static const char *const readers[] = {
+        "more", "less",
+#ifdef CONFIG_FS_COMMANDS
+        "cat", "write",
+#endif
+    };
+    for (uint32_t i = 0; i < sizeof(readers) / sizeof(readers[0]); ++i) {
+        const char *r = readers[i], *q = s;
+        while (*r && *r == *q) { ++r; ++q; }
+        if (!*r && (*q == '\0' || *q == ' ')) return 1;
+    }
+    return 0;
+}
+
 /* command runner */
 static void run_command(char *line) {
     char *p = skip_spaces(line);
     if (p[0] == '\0') return;
+    /* <command> | <command>: the left side's output becomes the right side's
+       input. Only a '|' with a space on each side splits, so it can still
+       appear inside arguments (write f a|b). */
+    char *bar = p;
+    while (*bar && !(bar[0] == ' ' && bar[1] == '|' && bar[2] == ' ')) ++bar;
+    if (*bar) {
+        if (pipe_busy) { kprintf("pipe: the pipe buffer is in use\n"); return; }
+        char *right = skip_spaces(bar + 3);
+        if (!pipe_reader(right)) { kprintf("pipe: the right side does not read its input (see help)\n"); return; }
+        char *end = bar;
+        while (end > p && end[-1] == ' ') --end;
+        *end = '\0';
+        pipe_busy = 1;
+        struct buf_stream b = { { buf_stream_putc, 0, buf_stream_write }, pipe_buf, 0, PIPE_BUF };
+        struct out_stream *prev = cur_out;
+        cur_out = &b.out;
+        run_command(p);
+        cur_out = prev;
+        if (b.len == PIPE_BUF - 1) klog(KLOG_WARN, "pipe: output truncated to %d bytes", PIPE_BUF - 1);
+        pipe_in = pipe_buf;
+        pipe_in_len = (uint32_t)b.len;
+        run_command(right);
+        pipe_in = 0;
+        pipe_in_len = 0;
+        pipe_busy = 0;
+        return;
+    }
     if (p[0]=='h' && p[1]=='e' && p[2]=='l' && p[3]=='p' && p[4]=='\0') {
         kprintf("Available commands:\n");
         kprintf("  help           - show this message\n");
         kprintf("  clear          - clear the screen\n");
         kprintf("  echo <text>    - echo text\n");
         kprintf("  version        - show kernel version\n");
+#ifdef CONFIG_FS_COMMANDS
         kprintf("  ls             - list files\n");
-        kprintf("  cat <file>     - show file contents\n");
-        kprintf("  write <file> <text> - write text to file (overwrite)\n");
+        kprintf("  cat [file]     - show file contents or piped output\n");
+#endif
+        kprintf("  more [file]    - page through a file or piped output (also: less)\n");
+#ifdef CONFIG_FS_COMMANDS
+        kprintf("  write <file> <text> - write text (or piped output) to file (overwrite)\n");
         kprintf("  touch <file>   - create empty file\n");
         kprintf("  rm <file>      - remove file\n");
+#endif
+#ifdef CONFIG_NANO
         kprintf("  nano <file>    - edit/create a file with simple editor\n");
+#endif
+#ifdef CONFIG_SERIAL_XFER
+        kprintf("  recv <file>    - receive a file over serial (tools/sercp.py put)\n");
+        kprintf("  send <file>    - send a file over serial (tools/sercp.py get)\n");
+#endif
+        kprintf("  net            - show network interface, connections and services\n");
+        kprintf("  netbench [kib] - TCP/UDP throughput and latency over loopback\n");
+        kprintf("  bench          - time kernel hot paths (compare the i386 and x86_64 builds)\n");
+        kprintf("  cpuinfo        - CPU model, features and the code path picked for each hot routine\n");
+        kprintf("  top [samples]  - CPU, task and interrupt use per second, memory (any key quits)\n");
+#ifdef KERNEL_GCOV
+        kprintf("  gcov [reset]   - dump (or zero) the profile counters for tools/pgo.py\n");
+#endif
+        kprintf("  date           - show the date and time (UTC)\n");
+        kprintf("  clocksource    - list clock sources, their rating and cost per read\n");
+        kprintf("  acpi           - show the parsed ACPI tables (CPUs, I/O APICs, HPET, FADT)\n");
+        kprintf("  dmesg          - show the kernel log\n");
+        kprintf("  logship [off | <ip> <port> [name]] - ship the kernel log over UDP\n");
+        kprintf("  sysctl [name [value]] - show or change tunables (boot ones: kernel command line)\n");
+#ifdef CONFIG_WATCHDOG
+        kprintf("  watchdog [test soft|hard] - lockup detector status, or hang the shell to try it\n");
+#endif
+#ifdef CONFIG_MODULES
+        kprintf("  insmod <name>  - load <name>.ko from the FS or the boot modules\n");
+        kprintf("  rmmod <name>   - unload a module\n");
+        kprintf("  lsmod          - list loaded modules and the boot modules\n");
+        module_help();
+#endif
+#ifdef CONFIG_FS_COMMANDS
+        kprintf("Pipes: <command> | more, cat or write <file>\n");
+#else
+        kprintf("Pipes: <command> | more\n");
+#endif
+        kprintf("Keys: Alt+F1..F%d switch terminals, Shift+PgUp/PgDn scroll back\n", NUM_VTS);
         return;
     }
+#ifdef CONFIG_NANO
     /* nano editor: nano <file> */
+    if (p[0]=='n' && p[1]=='a' && p[2]=='n' && p[3]=='o' && (p[4]=='\0' || p[4]==' ') && !cur_out->interactive) { kprintf("nano: not available in a remote session\n"); return; }
     if (p[0]=='n' && p[1]=='a' && p[2]=='n' && p[3]=='o' && (p[4]=='\0' || p[4]==' ')) { char *arg = skip_spaces(p+4); if (*arg) { nano_edit(arg); } else kprintf("Usage: nano <file>\n"); return; }
-    if (p[0]=='c' && p[1]=='l' && p[2]=='e' && p[3]=='a' && p[4]=='r' && (p[5]=='\0' || p[5]==' ')) { vga_clear(); return; }
-    if (p[0]=='v' && p[1]=='e' && p[2]=='r' && p[3]=='s' && p[4]=='i' && p[5]=='o' && p[6]=='n' && (p[7]=='\0' || p[7]==' ')) { kprintf("MiniOS version 0.2\n"); return; }
+#endif
+    if (p[0]=='c' && p[1]=='l' && p[2]=='e' && p[3]=='a' && p[4]=='r' && (p[5]=='\0' || p[5]==' ')) { if (cur_out->interactive) vga_clear(); return; }
+    if (p[0]=='v' && p[1]=='e' && p[2]=='r' && p[3]=='s' && p[4]=='i' && p[5]=='o' && p[6]=='n' && (p[7]=='\0' || p[7]==' ')) { kprintf("MiniOS version 0.2 (%s, config %s)\n", KERNEL_ARCH, CONFIG_NAME); return; }
     if (p[0]=='e' && p[1]=='c' && p[2]=='h' && p[3]=='o' && (p[4]=='\0' || p[4]==' ')) {
         char *arg = skip_spaces(p+4); kprintf("%s\n", arg); return; }
+#ifdef CONFIG_SERIAL_XFER
+    /* recv / send over serial */
+    if (p[0]=='r' && p[1]=='e' && p[2]=='c' && p[3]=='v' && (p[4]=='\0' || p[4]==' ')) { char *arg = skip_spaces(p+4); if (*arg) xfer_command(arg, 0); else kprintf("Usage: recv <file>\n"); return; }
+    if (p[0]=='s' && p[1]=='e' && p[2]=='n' && p[3]=='d' && (p[4]=='\0' || p[4]==' ')) { char *arg = skip_spaces(p+4); if (*arg) xfer_command(arg, 1); else kprintf("Usage: send <file>\n"); return; }
+#endif
+    /* netbench [kib] */
+    if (p[0]=='n' && p[1]=='e' && p[2]=='t' && p[3]=='b' && p[4]=='e' && p[5]=='n' && p[6]=='c' && p[7]=='h' && (p[8]=='\0' || p[8]==' ')) {
+        uint32_t kib = 4096;
+        char *arg = skip_spaces(p+8);
+        if (*arg && (!parse_uint(arg, &kib) || kib == 0 || kib > NETBENCH_MAX_KIB)) { kprintf("Usage: netbench [kib], kib 1..%u\n", NETBENCH_MAX_KIB); return; }
+        netbench(kib * 1024);
+        return;
+    }
+    /* date */
+    if (p[0]=='d' && p[1]=='a' && p[2]=='t' && p[3]=='e' && (p[4]=='\0' || p[4]==' ')) {
+        char now[20];
+        clock_format(clock_now(), now);
+        kprintf("%s UTC, up %u s\n", now, timer_ticks / TIMER_HZ);
+        return;
+    }
+    if (p[0]=='c' && p[1]=='l' && p[2]=='o' && p[3]=='c' && p[4]=='k' && p[5]=='s' && p[6]=='o' && p[7]=='u' && p[8]=='r' && p[9]=='c' && p[10]=='e' && (p[11]=='\0' || p[11]==' ')) { clocksource_list(); return; }
+    if (p[0]=='a' && p[1]=='c' && p[2]=='p' && p[3]=='i' && (p[4]=='\0' || p[4]==' ')) { acpi_dump(); return; }
+    if (p[0]=='b' && p[1]=='e' && p[2]=='n' && p[3]=='c' && p[4]=='h' && (p[5]=='\0' || p[5]==' ')) { bench(); return; }
+    if (p[0]=='c' && p[1]=='p' && p[2]=='u' && p[3]=='i' && p[4]=='n' && p[5]=='f' && p[6]=='o' && (p[7]=='\0' || p[7]==' ')) { cpuinfo(); return; }
+    if (p[0]=='t' && p[1]=='o' && p[2]=='p' && (p[3]=='\0' || p[3]==' ')) { top_command(skip_spaces(p+3)); return; }
+#ifdef KERNEL_GCOV
+    if (p[0]=='g' && p[1]=='c' && p[2]=='o' && p[3]=='v' && (p[4]=='\0' || p[4]==' ')) { gcov_command(skip_spaces(p+4)); return; }
+#endif
+    /* dmesg / logship */
+    if (p[0]=='d' && p[1]=='m' && p[2]=='e' && p[3]=='s' && p[4]=='g' && (p[5]=='\0' || p[5]==' ')) { klog_dump(); return; }
+    if (p[0]=='l' && p[1]=='o' && p[2]=='g' && p[3]=='s' && p[4]=='h' && p[5]=='i' && p[6]=='p' && (p[7]=='\0' || p[7]==' ')) { logship_command(skip_spaces(p+7)); return; }
+    if (p[0]=='s' && p[1]=='y' && p[2]=='s' && p[3]=='c' && p[4]=='t' && p[5]=='l' && (p[6]=='\0' || p[6]==' ')) { sysctl_command(skip_spaces(p+6)); return; }
+#ifdef CONFIG_WATCHDOG
+    if (p[0]=='w' && p[1]=='a' && p[2]=='t' && p[3]=='c' && p[4]=='h' && p[5]=='d' && p[6]=='o' && p[7]=='g' && (p[8]=='\0' || p[8]==' ')) { watchdog_command(skip_spaces(p+8)); return; }
+#endif
+#ifdef CONFIG_MODULES
+    /* insmod / rmmod / lsmod */
+    if (p[0]=='i' && p[1]=='n' && p[2]=='s' && p[3]=='m' && p[4]=='o' && p[5]=='d' && (p[6]=='\0' || p[6]==' ')) { insmod_command(skip_spaces(p+6)); return; }
+    if (p[0]=='r' && p[1]=='m' && p[2]=='m' && p[3]=='o' && p[4]=='d' && (p[5]=='\0' || p[5]==' ')) { rmmod_command(skip_spaces(p+5)); return; }
+    if (p[0]=='l' && p[1]=='s' && p[2]=='m' && p[3]=='o' && p[4]=='d' && (p[5]=='\0' || p[5]==' ')) { lsmod_command(); return; }
+#endif
+    /* net */
+    if (p[0]=='n' && p[1]=='e' && p[2]=='t' && (p[3]=='\0' || p[3]==' ')) { net_status(); http_status(); rsh_status(); return; }
+#ifdef CONFIG_FS_COMMANDS
     /* ls */
     if (p[0]=='l' && p[1]=='s' && (p[2]=='\0' || p[2]==' ')) { fs_list(); return; }
     /* cat */
-    if (p[0]=='c' && p[1]=='a' && p[2]=='t' && p[3]==' '){ char *arg = skip_spaces(p+4); if (*arg) { if (fs_read_to_console(arg) < 0) kprintf("No such file: %s\n", arg); else kprintf("\n"); } else kprintf("Usage: cat <file>\n"); return; }
+    if (p[0]=='c' && p[1]=='a' && p[2]=='t' && (p[3]=='\0' || p[3]==' ')){ char *arg = skip_spaces(p+3); if (*arg) { if (fs_read_to_console(arg) < 0) kprintf("No such file: %s\n", arg); else kprintf("\n"); } else if (pipe_in) out_write(pipe_in, pipe_in_len); else kprintf("Usage: cat <file>\n"); return; }
+#endif
+    /* more / less */
+    if (((p[0]=='m' && p[1]=='o' && p[2]=='r' && p[3]=='e') || (p[0]=='l' && p[1]=='e' && p[2]=='s' && p[3]=='s')) && (p[4]=='\0' || p[4]==' ')) { pager_command(skip_spaces(p+4)); return; }
+#ifdef CONFIG_FS_COMMANDS
     /* touch */
     if (p[0]=='t' && p[1]=='o' && p[2]=='u' && p[3]=='c' && p[4]=='h' && (p[5]==' ')) { char *arg = skip_spaces(p+6); if (*arg) { if (fs_create(arg) < 0) kprintf("Cannot create file: %s\n", arg); } else kprintf("Usage: touch <file>\n"); return; }
     /* rm */
-    if (p[0]=='r' && p[1]=='m' && p[2]==' '){ char *arg = skip_spaces(p+3); if (*arg) { if (fs_remove(arg) < 0) kprintf("No such file: %s\n", arg); } else kprintf("Usage: rm <file>\n"); return; }
+    if (p[0]=='r' && p[1]=='m' && p[2]==' '){ char *arg = skip_spaces(p+3); if (*arg) { int r = fs_remove(arg); if (r == -2) kprintf("rm: %s is being sent over HTTP\n", arg); else if (r < 0) kprintf("No such file: %s\n", arg); } else kprintf("Usage: rm <file>\n"); return; }
     /* write */
-    if (p[0]=='w' && p[1]=='r' && p[2]=='i' && p[3]=='t' && p[4]=='e' && p[5]==' '){
-        char *arg = skip_spaces(p+6);
+    if (p[0]=='w' && p[1]=='r' && p[2]=='i' && p[3]=='t' && p[4]=='e' && (p[5]=='\0' || p[5]==' ')){
+        char *arg = skip_spaces(p+5);
         if (!*arg) { kprintf("Usage: write <file> <text>\n"); return; }
         /* file name is first token */
         char fname[MAX_NAME]; int fi = 0;
@@ -405,41 +6000,258 @@ static void run_command(char *line) {
         fname[fi] = '\0';
         arg = skip_spaces(arg);
         if (!*fname) { kprintf("Invalid file name\n"); return; }
-        if (!*arg) { kprintf("No text provided\n"); return; }
         int len = 0; while (arg[len]) ++len;
+        if (!*arg && pipe_in) { arg = (char *)pipe_in; len = (int)pipe_in_len; } /* <command> | write <file> */
+        else if (!*arg) { kprintf("No text provided\n"); return; }
         int written = fs_write(fname, arg, len);
         if (written < 0) kprintf("Failed to write file\n"); else kprintf("Wrote %d bytes to %s\n", written, fname);
         return;
     }
+#endif
+#ifdef CONFIG_MODULES
+    if (module_command(p)) return;
+#endif
     kprintf("Unknown command: %s\n", p);
 }
 
+/* --- Remote shell over UDP ---
+   Request: 2-byte id (big endian) followed by a command line.
+   Reply: one or more datagrams of [id, flags, output bytes]; flags bit 0 marks the last one.
+   Each peer (ip:port) gets its own session and output stream. */
+#define RSH_PORT 2323
+#define RSH_MAX_SESSIONS 4
+#define RSH_CHUNK 1024
+#define RSH_FLAG_LAST 0x01
+
+struct rsh_session {
+    struct out_stream out; /* first member: stream callbacks cast back to the session */
+    int used;
+    uint32_t ip;
+    uint16_t port;
+    uint16_t last_id;
+    uint32_t stamp;
+    uint32_t commands;
+    uint32_t len;
+    uint8_t buf[3 + RSH_CHUNK];
+};
+
+static struct rsh_session rsh_sessions[RSH_MAX_SESSIONS];
+static uint32_t rsh_clock = 0;
+
+static void rsh_flush(struct rsh_session *s, int last) {
+    s->buf[0] = s->last_id >> 8; s->buf[1] = s->last_id & 0xFF;
+    s->buf[2] = last ? RSH_FLAG_LAST : 0;
+    udp_send(s->ip, RSH_PORT, s->port, s->buf, 3 + s->len);
+    s->len = 0;
+}
+
+static void rsh_putc(struct out_stream *o, char c) {
+    struct rsh_session *s = (struct rsh_session *)o;
+    s->buf[3 + s->len++] = (uint8_t)c;
+    if (s->len == RSH_CHUNK) rsh_flush(s, 0);
+}
+
+static struct rsh_session *rsh_session_for(uint32_t ip, uint16_t port) {
+    struct rsh_session *victim = &rsh_sessions[0];
+    for (int i = 0; i < RSH_MAX_SESSIONS; ++i) {
+        struct rsh_session *s = &rsh_sessions[i];
+        if (s->used && s->ip == ip && s->port == port) return s;
+        if (!s->used || (victim->used && s->stamp < victim->stamp)) victim = s;
+    }
+    /* reuse a free or the least recently active session */
+    klog(KLOG_INFO, "rsh: session %d for " IP_FMT ":%u", (int)(victim - rsh_sessions), IP_ARGS(ip), port);
+    victim->used = 1; victim->ip = ip; victim->port = port;
+    victim->last_id = 0xFFFF; victim->commands = 0; victim->len = 0;
+    victim->out.putc = rsh_putc; victim->out.interactive = 0;
+    return victim;
+}
+
+static void rsh_input(uint32_t src_ip, uint16_t src_port, uint16_t dst_port, const uint8_t *data, uint32_t len) {
+    (void)dst_port;
+    if (len < 3) return;
+    struct rsh_session *s = rsh_session_for(src_ip, src_port);
+    s->stamp = ++rsh_clock;
+    uint16_t id = rd16be(data);
+    if (id == s->last_id) return; /* duplicate of a command already run */
+    s->last_id = id;
+
+    char line[INPUT_MAX];
+    uint32_t n = 0;
+    for (uint32_t i = 2; i < len && n < input_buf - 1; ++i) {
+        if (data[i] == '\n' || data[i] == '\r') break;
+        line[n++] = (char)data[i];
+    }
+    line[n] = '\0';
+
+    klog(KLOG_DEBUG, "rsh: %s", line);
+    struct out_stream *prev = cur_out;
+    int prev_task = task_switch(TASK_RSH);
+    cur_out = &s->out;
+    s->len = 0;
+    run_command(line);
+    rsh_flush(s, 1);
+    cur_out = prev;
+    task_switch(prev_task);
+    s->commands++;
+}
+
+static void rsh_status(void) {
+    kprintf("rsh: udp port %d\n", RSH_PORT);
+    for (int i = 0; i < RSH_MAX_SESSIONS; ++i) if (rsh_sessions[i].used) {
+        kprintf("  session %d: ", i); kput_ip(rsh_sessions[i].ip);
+        kprintf(":%u, %u commands\n", rsh_sessions[i].port, rsh_sessions[i].commands);
+    }
+}
+
+/* --- Virtual terminal shells ---
+   Every terminal runs its own shell on its own input queue. There is a
+   single kernel stack, so a terminal whose command waits for input (nano,
+   for example) keeps servicing the other terminals from its wait loop;
+   the busy flag stops a terminal from being re-entered. */
+static void vt_prompt(void) { kprintf("mini> "); }
+
+static void vt_shell_poll(struct vt *t) {
+    char c;
+    while (!t->busy && vt_getc(t, &c)) {
+        if (c == '\n' || c == '\r') {
+            console_putc('\n');
+            t->line[t->line_len] = '\0';
+            t->line_len = 0;
+            if (t->line[0] != '\0') {
+                int prev = task_switch(TASK_TTY1 + (int)(t - vts));
+                t->busy = 1;
+                run_command(t->line);
+                t->busy = 0;
+                task_switch(prev);
+            }
+            vt_prompt();
+        } else if (c == '\b') {
+            if (t->line_len > 0) { --t->line_len; console_write("\b \b", 3); }
+        } else if (t->line_len < (int)input_buf - 1) {
+            t->line[t->line_len++] = c;
+            console_putc(c);
+        }
+    }
+}
+
+static void vt_service(void) {
+    struct vt *prev_vt = vt_out;
+    struct out_stream *prev_out = cur_out;
+    cur_out = &vga_out;
+    for (int i = 0; i < NUM_VTS; ++i) {
+        vt_out = &vts[i];
+        vt_shell_poll(&vts[i]);
+    }
+    vt_out = prev_vt;
+    cur_out = prev_out;
+}
+
 /* Install PIC and IDT for keyboard IRQ */
 static void interrupts_install(void) {
-    /* reset keyboard buffer */
-    kbuf_head = kbuf_tail = 0;
     pic_remap();
     idt_init();
-    idt_set_gate(0x21, (uint32_t)irq1_entry);
+    idt_set_gate(0x20, (uintptr_t)irq0_entry);
+    idt_set_gate(0x21, (uintptr_t)irq1_entry);
+#ifdef CONFIG_WATCHDOG
+    idt_set_gate(2, (uintptr_t)nmi_entry);
+#endif
     idt_load();
-    pic_unmask_keyboard();
+    pit_init();
+    pic_unmask_irq(0);
+    pic_unmask_irq(1);
+    if (mouse_enable && mouse_init() == 0) {
+        idt_set_gate(0x2C, (uintptr_t)irq12_entry);
+        pic_unmask_irq(12);
+    }
     /* enable interrupts */
     __asm__ volatile ("sti");
 }
 
-void kernel_main(void) {
-    vga_clear();
+/* Microseconds from kernel entry to the first prompt. Not static, so it
+   keeps its name: tools/profilereport.py reads it through the QEMU monitor
+   and so times kernels built without the serial console too. */
+volatile uint32_t boot_us = 0;
+
+/* Written by the LZ4 stub (boot/unlz4.S) before it enters a kernel packed
+   into kernelz.bin: TSC at stub entry and after unpacking, packed and
+   unpacked sizes; all zero when the loader started the kernel directly.
+   tools/lz4pack.py finds it by name. unpack_us is the time spent in the
+   stub, for tools/profilereport.py. */
+volatile struct boot_unpack {
+    uint64_t start, end;
+    uint32_t packed, size;
+} boot_unpack;
+volatile uint32_t unpack_us = 0;
+
+void kernel_main(uint32_t magic, const struct multiboot_info *mbi) {
+    uint64_t boot_start = rdtsc();
+    if (magic != MULTIBOOT_MAGIC) mbi = 0;
+#ifdef KERNEL_GCOV
+    gcov_run_ctors();
+#endif
+    tunables_init(mbi);
+    cpu_probe();
+    cpu_select();
+    kmem_init(mbi);
+    klog_init();
+    serial_init();
+    crc32c_init();
+    int have_fb = fb_init(mbi) == 0;
+    vt_init();
+    acpi_init();
     interrupts_install();
+    clock_init();
+#ifdef CONFIG_WATCHDOG
+    watchdog_init();
+#endif
     fs_init();
+    pager_init();
+#ifdef CONFIG_MODULES
+    modules_init(mbi);
+#endif
     kprintf("MiniOS v0.3 - terminal + tiny FS\n");
+    klog(KLOG_INFO, "MiniOS booting%s", serial_present ? ", serial console on COM1" : "");
+    tunables_report();
+    klog(KLOG_INFO, "cpu: %s, memcpy %s, crc32c %s, checksum %s, memmem %s", cpu_vendor[0] ? cpu_vendor : "no CPUID",
+         cpu_paths[PATH_MEMCPY].chosen->name, cpu_paths[PATH_CRC32C].chosen->name, cpu_paths[PATH_CSUM].chosen->name,
+         cpu_paths[PATH_MEMMEM].chosen->name);
+    char boot_time[20];
+    clock_format(clock_base, boot_time);
+    klog(KLOG_INFO, "clock: RTC %s UTC, TSC %u.%u MHz, clocksource %s (%u cycles per read)", boot_time,
+         tsc_khz / 1000, tsc_khz % 1000 / 100, clock_cs->name, clock_cs->read_cycles);
+    if (acpi.present) klog(KLOG_INFO, "acpi: revision %u, %u tables, %u CPUs, %u I/O APICs, %u IRQ overrides", acpi.revision,
+                           acpi.num_tables, acpi.num_cpus, acpi.num_ioapics, acpi.num_overrides);
+    else klog(KLOG_WARN, "acpi: no valid RSDP found");
+#ifdef CONFIG_WATCHDOG
+    klog(KLOG_INFO, "watchdog: soft %u s, hard %u s, NMI from %s", watchdog_soft, watchdog_hard, wd_sources[wd_source]);
+#endif
+    if (mouse_present) klog(KLOG_INFO, "mouse: PS/2 on IRQ12 (left button selects, middle/right pastes)");
+    if (have_fb) klog(KLOG_INFO, "console: framebuffer %ux%ux%u at 0x%x, %dx%d cells", fb_width, fb_height, fb_bytespp * 8, (uint32_t)(uintptr_t)fb_base, con_cols, con_rows);
+    else klog(KLOG_INFO, "console: VGA text %dx%d", con_cols, con_rows);
+    if (e1000_init() < 0) klog(KLOG_WARN, "net: no e1000 NIC found");
+    else {
+        udp_bind(RSH_PORT, rsh_input);
+        tcp_listen(HTTP_PORT, &http_ops);
+        kprintf("eth0: "); kput_ip(e1000_if.ip); kprintf(", remote shell on udp port %d, http on tcp port %d\n", RSH_PORT, HTTP_PORT);
+    }
     kprintf("Type 'help' for commands.\n\n");
 
-    char line[INPUT_BUF];
-    for (;;) {
-        kprintf("mini> ");
-        read_line(line, INPUT_BUF);
-        if (line[0] == '\0') continue;
-        run_command(line);
+    for (int i = 0; i < NUM_VTS; ++i) {
+        vt_out = &vts[i];
+        if (i) kprintf("MiniOS terminal %d (Alt+F%d)\n\n", i + 1, i + 1);
+        vt_prompt();
+    }
+    vt_out = &vts[0];
+    if (tsc_khz) {
+        if (boot_unpack.end) {
+            unpack_us = (uint32_t)div64_32((boot_unpack.end - boot_unpack.start) * 1000, tsc_khz);
+            klog(KLOG_INFO, "boot: LZ4 image unpacked in %u.%u ms (%u -> %u bytes)", unpack_us / 1000,
+                 unpack_us % 1000 / 100, boot_unpack.packed, boot_unpack.size);
+        }
+        boot_us = (uint32_t)div64_32((rdtsc() - boot_start) * 1000, tsc_khz);
+        klog(KLOG_INFO, "boot: %u.%u ms from kernel entry to the shell (config %s)", boot_us / 1000, boot_us % 1000 / 100, CONFIG_NAME);
     }
+    cpu_stat_start();
+    for (;;) console_idle();
 }
 
@@ -0,0 +1,48 @@
+/* hexdump <file> [offset]: a file in hex and ASCII, 16 bytes per line.
+   An example module: `insmod hexdump`, or just type `hexdump` with
+   mod.autoload on and hexdump.ko in the FS or the boot modules. */
+#include "module.h"
+
+static const char hex[] = "0123456789abcdef";
+
+static void put_hex(char *p, uint32_t v, int digits) {
+    while (digits--) { p[digits] = hex[v & 15]; v >>= 4; }
+}
+
+static void hexdump(char *args) {
+    char name[16];
+    int n = 0;
+    while (args[n] && args[n] != ' ' && n < 15) { name[n] = args[n]; ++n; }
+    name[n] = '\0';
+    uint32_t off = 0;
+    char *q = skip_spaces(args + n);
+    if (!name[0] || (*q && !parse_uint(q, &off))) { kprintf("Usage: hexdump <file> [offset]\n"); return; }
+    int size;
+    const uint8_t *d = (const uint8_t *)fs_data(name, &size);
+    if (!d) { kprintf("No such file: %s\n", name); return; }
+    for (uint32_t at = off; at < (uint32_t)size; at += 16) {
+        char line[80];
+        memset(line, ' ', sizeof(line));
+        put_hex(line, at, 8);
+        line[60] = '|';
+        uint32_t k = 0;
+        for (; k < 16 && at + k < (uint32_t)size; ++k) {
+            uint8_t c = d[at + k];
+            put_hex(line + 10 + k * 3 + (k >= 8), c, 2);
+            line[61 + k] = c >= 32 && c < 127 ? (char)c : '.';
+        }
+        line[61 + k] = '|';
+        line[62 + k] = '\n';
+        out_write(line, 63 + k);
+    }
+}
+
+static const struct kcommand hexdump_cmd = { "hexdump", "hexdump <file> [off]", "show a file in hex and ASCII", hexdump };
+
+int init_module(void) {
+    return register_command(&hexdump_cmd);
+}
+
+void cleanup_module(void) {
+    unregister_command(&hexdump_cmd);
+}
@@ -0,0 +1,52 @@
+/* MiniOS module interface: what a module (.ko, an ELF object from gcc -c)
+   can call. Every name here is in the kernel's ksymtab; insmod refuses a
+   module that uses anything else. The kernel looks for two functions:
+
+     int init_module(void);      run by insmod; nonzero fails the load
+     void cleanup_module(void);  run by rmmod (optional)
+
+   Build with `make modules` (or `make modules64` for the x86_64 kernel). */
+#ifndef MINIOS_MODULE_H
+#define MINIOS_MODULE_H
+
+typedef unsigned int uint32_t;
+typedef unsigned char uint8_t;
+typedef __SIZE_TYPE__ size_t;
+
+enum { KLOG_ERR = 0, KLOG_WARN, KLOG_INFO, KLOG_DEBUG };
+
+/* A shell command; the structure must stay valid until it is unregistered
+   (commands still registered at rmmod are dropped by the kernel) */
+struct kcommand {
+    const char *name;
+    const char *usage; /* shown by help, e.g. "hexdump <file>" */
+    const char *desc;
+    void (*fn)(char *args);
+};
+
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+void *memset(void *dst, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+
+void kprintf(const char *fmt, ...); /* %s %d %u %x %c, to the current terminal or session */
+int ksnprintf(char *buf, int cap, const char *fmt, ...);
+void klog(int level, const char *fmt, ...);
+void out_write(const char *p, uint32_t n);
+char *skip_spaces(char *s);
+char *parse_uint(char *s, uint32_t *out); /* position after the number, or 0 */
+
+const char *fs_data(const char *name, int *size); /* file contents, or 0 */
+int fs_write(const char *name, const char *data, int len);
+int fs_remove(const char *name);
+
+uint32_t clock_now(void); /* Unix time */
+void clock_format(uint32_t t, char *buf); /* "YYYY-MM-DD HH:MM:SS", 20 bytes */
+extern volatile uint32_t timer_ticks; /* 100 Hz */
+extern uint32_t tsc_khz;
+extern uint32_t (*crc32c_update)(uint32_t crc, const void *data, uint32_t len);
+
+int register_command(const struct kcommand *c); /* 0, or -1 if taken or full */
+void unregister_command(const struct kcommand *c);
+
+#endif
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Turn a config file into config.h, the kernel's CONFIG_* switches.
+
+Kconfig lists the options with their defaults and dependencies; a config
+file (configs/defconfig, configs/appliance, ...) sets some of them with
+CONFIG_X=y / CONFIG_X=n / "# CONFIG_X is not set" lines. Options it does
+not mention take their default, and an option whose dependencies are off
+is off. The Makefile runs this on every build; config.h is only rewritten
+when its contents change, so switching configs rebuilds the kernel and
+re-running with the same one does not.
+
+    tools/genconfig.py --kconfig Kconfig configs/appliance config.h
+    tools/genconfig.py --list configs/tiny
+"""
+
+import argparse
+import os
+import re
+import sys
+
+
+def parse_kconfig(path):
+    """Kconfig -> ordered {name: {"prompt", "default", "depends", "help"}}"""
+    options, cur, help_indent = {}, None, None
+    with open(path) as f:
+        for lineno, raw in enumerate(f, 1):
+            line = raw.rstrip("\n").expandtabs(8)
+            indent = len(line) - len(line.lstrip())
+            # help text runs while lines are indented deeper than "help"
+            if help_indent is not None and (not line.strip() or indent > help_indent):
+                cur["help"].append(line.strip())
+                continue
+            help_indent = None
+            word = line.split()
+            if not word or word[0].startswith("#"):
+                continue
+            if word[0] == "config" and len(word) == 2:
+                cur = options.setdefault(word[1], {"prompt": "", "default": False, "depends": [], "help": []})
+            elif cur is None:
+                raise SyntaxError("%s:%d: %r outside a config entry" % (path, lineno, line.strip()))
+            elif word[0] == "bool":
+                cur["prompt"] = line.split("bool", 1)[1].strip().strip('"')
+            elif word[0] == "default" and len(word) == 2 and word[1] in ("y", "n"):
+                cur["default"] = word[1] == "y"
+            elif word[:2] == ["depends", "on"]:
+                cur["depends"] += [d.strip() for d in " ".join(word[2:]).split("&&")]
+            elif word[0] == "help":
+                help_indent = indent
+            else:
+                raise SyntaxError("%s:%d: cannot parse %r" % (path, lineno, line.strip()))
+    for name, opt in options.items():
+        for dep in opt["depends"]:
+            if dep not in options:
+                raise SyntaxError("%s: %s depends on unknown option %s" % (path, name, dep))
+    return options
+
+
+def parse_config(path, options):
+    """Config file -> {name: bool} for the options it sets"""
+    values = {}
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.strip()
+            m = re.match(r"^CONFIG_(\w+)=([yn])$", line) or re.match(r"^# CONFIG_(\w+) is not set$", line)
+            if not m:
+                if line and not line.startswith("#"):
+                    raise SyntaxError("%s:%d: cannot parse %r" % (path, lineno, line))
+                continue
+            if m.group(1) not in options:
+                raise SyntaxError("%s:%d: no option CONFIG_%s in Kconfig" % (path, lineno, m.group(1)))
+            values[m.group(1)] = m.lastindex == 2 and m.group(2) == "y"
+    return values
+
+
+def resolve(options, values):
+    """Final on/off per option; an option is on only if its dependencies are"""
+    result = {}
+
+    def on(name):
+        if name not in result:
+            want = values.get(name, options[name]["default"])
+            missing = [d for d in options[name]["depends"] if not on(d)]
+            if want and missing:
+                print("genconfig: CONFIG_%s needs CONFIG_%s; leaving it out" % (name, missing[0]), file=sys.stderr)
+            result[name] = want and not missing
+        return result[name]
+
+    for name in options:
+        on(name)
+    return result
+
+
+def header(result, config_path):
+    name = os.path.basename(config_path)
+    lines = ["/* Generated by tools/genconfig.py from %s and Kconfig; do not edit */" % config_path,
+             "#ifndef MINIOS_CONFIG_H", "#define MINIOS_CONFIG_H", "",
+             '#define CONFIG_NAME "%s"' % name]
+    for opt, on in result.items():
+        lines.append("#define CONFIG_%s 1" % opt if on else "/* CONFIG_%s is not set */" % opt)
+    lines += ["", "#endif", ""]
+    return "\r\n".join(lines)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--kconfig", default="Kconfig")
+    ap.add_argument("--list", action="store_true", help="print the resolved options instead of writing a header")
+    ap.add_argument("config", help="config file, e.g. configs/defconfig")
+    ap.add_argument("out", nargs="?", default="config.h")
+    args = ap.parse_args()
+    try:
+        options = parse_kconfig(args.kconfig)
+        result = resolve(options, parse_config(args.config, options))
+    except (OSError, SyntaxError) as e:
+        print("genconfig: %s" % e, file=sys.stderr)
+        return 1
+    if args.list:
+        for opt, on in result.items():
+            print("%-16s %s  %s" % (opt, "y" if on else "n", options[opt]["prompt"]))
+        return 0
+    text = header(result, args.config)
+    try:
+        with open(args.out, newline="") as f:
+            if f.read() == text:
+                return 0
+    except OSError:
+        pass
+    with open(args.out, "w", newline="") as f:
+        f.write(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
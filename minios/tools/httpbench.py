@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Throughput and latency test for the MiniOS HTTP server.
+
+Forward the guest's port 80 with QEMU user networking:
+
+    qemu-system-i386 -cdrom minios.iso -nic user,model=e1000,hostfwd=tcp::8080-:80
+
+then run, for example:
+
+    tools/httpbench.py --url http://127.0.0.1:8080/welcome -n 2000 -c 4
+    tools/httpbench.py --url http://127.0.0.1:8080/welcome -n 200 --no-keepalive
+"""
+
+import argparse
+import socket
+import sys
+import threading
+import time
+from urllib.parse import urlparse
+
+
+def read_response(sock, buf):
+    """Read one response; returns (status, body_len, leftover bytes)."""
+    while b"\r\n\r\n" not in buf:
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise ConnectionError("connection closed mid-response")
+        buf += chunk
+    head, buf = buf.split(b"\r\n\r\n", 1)
+    lines = head.decode("latin-1").split("\r\n")
+    status = int(lines[0].split()[1])
+    length = 0
+    for line in lines[1:]:
+        name, _, value = line.partition(":")
+        if name.strip().lower() == "content-length":
+            length = int(value.strip())
+    while len(buf) < length:
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise ConnectionError("connection closed mid-body")
+        buf += chunk
+    return status, length, buf[length:]
+
+
+def worker(host, port, path, count, keepalive, timeout, latencies, totals, lock):
+    req = ("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n"
+           % (path, host, "keep-alive" if keepalive else "close")).encode()
+    sock, buf, nbytes, errors = None, b"", 0, 0
+    mine = []
+    for _ in range(count):
+        start = time.perf_counter()
+        try:
+            if sock is None:
+                sock = socket.create_connection((host, port), timeout=timeout)
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                buf = b""
+            sock.sendall(req)
+            status, length, buf = read_response(sock, buf)
+            if status != 200:
+                errors += 1
+            nbytes += length
+        except (OSError, ConnectionError, ValueError):
+            errors += 1
+            if sock:
+                sock.close()
+            sock = None
+            continue
+        mine.append(time.perf_counter() - start)
+        if not keepalive:
+            sock.close()
+            sock = None
+    if sock:
+        sock.close()
+    with lock:
+        latencies.extend(mine)
+        totals[0] += nbytes
+        totals[1] += errors
+
+
+def percentile(sorted_vals, p):
+    if not sorted_vals:
+        return 0.0
+    k = min(len(sorted_vals) - 1, int(round(p / 100.0 * (len(sorted_vals) - 1))))
+    return sorted_vals[k]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--url", default="http://127.0.0.1:8080/welcome")
+    ap.add_argument("-n", "--requests", type=int, default=1000, help="total requests")
+    ap.add_argument("-c", "--connections", type=int, default=1, help="concurrent connections")
+    ap.add_argument("--no-keepalive", action="store_true", help="open a new connection per request")
+    ap.add_argument("--timeout", type=float, default=5.0)
+    args = ap.parse_args()
+
+    u = urlparse(args.url)
+    host, port, path = u.hostname, u.port or 80, u.path or "/"
+    per_conn = max(1, args.requests // args.connections)
+    latencies, totals, lock = [], [0, 0], threading.Lock()
+    threads = [threading.Thread(target=worker, args=(host, port, path, per_conn, not args.no_keepalive,
+                                                     args.timeout, latencies, totals, lock))
+               for _ in range(args.connections)]
+    t0 = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - t0
+
+    latencies.sort()
+    done = len(latencies)
+    print("requests: %d ok, %d errors in %.3f s" % (done, totals[1], elapsed))
+    print("rate:     %.1f req/s, %.1f KiB/s body" % (done / elapsed, totals[0] / 1024.0 / elapsed))
+    print("latency:  p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms" % tuple(
+        1000 * v for v in (percentile(latencies, 50), percentile(latencies, 90),
+                           percentile(latencies, 99), latencies[-1] if latencies else 0)))
+    return 1 if totals[1] else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
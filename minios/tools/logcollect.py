@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Collect kernel logs shipped by MiniOS guests over UDP.
+
+Each guest sends batches of lines "<name> <seq> <ms> <level> <message>"
+(see "Kernel log shipping" in kernel.c). Enable it in the guest with
+
+    logship 10.0.2.2 5140 vm17
+
+(10.0.2.2 is the host as seen from QEMU user networking). The collector
+prints merged lines and, with --dir, appends them to one file per guest.
+Gaps in a guest's sequence numbers are reported as lost records.
+"""
+
+import argparse
+import os
+import socket
+import sys
+import time
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--bind", default="0.0.0.0")
+    ap.add_argument("--port", type=int, default=5140)
+    ap.add_argument("--dir", help="write <dir>/<name>.log per guest")
+    ap.add_argument("--quiet", action="store_true", help="don't echo lines to stdout")
+    args = ap.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    sock.bind((args.bind, args.port))
+    if args.dir:
+        os.makedirs(args.dir, exist_ok=True)
+
+    next_seq = {}
+    files = {}
+    while True:
+        data, addr = sock.recvfrom(65536)
+        now = time.strftime("%H:%M:%S")
+        for raw in data.decode(errors="replace").splitlines():
+            parts = raw.split(" ", 4)
+            if len(parts) < 5 or not parts[1].isdigit():
+                continue
+            name, seq = parts[0], int(parts[1])
+            expected = next_seq.get(name)
+            if expected is not None and seq > expected:
+                note = "%s %s lost %d records" % (now, name, seq - expected)
+                print(note, file=sys.stderr)
+            next_seq[name] = max(seq + 1, expected or 0)
+            line = "%s %s" % (now, raw)
+            if not args.quiet:
+                print(line)
+            if args.dir:
+                f = files.get(name)
+                if f is None:
+                    f = files[name] = open(os.path.join(args.dir, name + ".log"), "a", buffering=1)
+                f.write(line + "\n")
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""Pack a Multiboot ELF kernel into an LZ4 payload for the boot stub.
+
+Takes the loadable part of the kernel (kernel.bin, or kernel64.bin for
+the x86_64 build) as one flat image from its lowest load address, LZ4
+block-compresses it and writes it behind a small header that the stub
+(boot/unlz4.S) reads at boot:
+
+    "LZ4K", load address, image size, end of bss, entry point,
+    address of the kernel's boot_unpack (0 if it has none), packed size
+
+all 32-bit little-endian, then the LZ4 block. The address the stub must
+be linked at, the first page above the kernel's bss, is printed on
+stdout for the linker (--defsym=STUB_BASE=...), so unpacking never
+overwrites the stub or its input. The Makefile runs it for kernelz.bin
+and kernel64z.bin:
+
+    tools/lz4pack.py kernel.bin kernel.lz4
+
+The compressor searches hash chains (--depth) and looks one byte ahead
+before taking a match; LZ4 decoding speed does not depend on how hard
+the compressor tried, so only the packed size changes. The result is
+decoded again and compared before it is written.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"LZ4K"
+PT_LOAD = 1
+SHT_SYMTAB = 2
+MIN_MATCH = 4
+MAX_OFFSET = 65535
+LAST_LITERALS = 5       # the block format ends with at least 5 literals
+MF_LIMIT = 12           # and no match starts in the last 12 bytes
+
+
+def read_elf(path):
+    """ELF32 kernel -> (flat image, load address, end of bss, entry, {symbol: address})"""
+    with open(path, "rb") as f:
+        elf = f.read()
+    if elf[:4] != b"\x7fELF" or elf[4] != 1:
+        raise ValueError("%s: not an ELF32 file" % path)
+    entry, phoff, shoff = struct.unpack_from("<III", elf, 24)
+    phentsize, phnum, shentsize, shnum = struct.unpack_from("<HHHH", elf, 42)
+    segments = []
+    for i in range(phnum):
+        p_type, p_offset, _, p_paddr, p_filesz, p_memsz = struct.unpack_from("<IIIIII", elf, phoff + i * phentsize)
+        if p_type == PT_LOAD and p_memsz:
+            segments.append((p_paddr, elf[p_offset:p_offset + p_filesz], p_memsz))
+    if not segments:
+        raise ValueError("%s: no loadable segments" % path)
+    load = min(s[0] for s in segments)
+    image = bytearray(max(s[0] + len(s[1]) for s in segments) - load)
+    for addr, data, _ in segments:
+        image[addr - load:addr - load + len(data)] = data
+    end = max(s[0] + s[2] for s in segments)
+
+    symbols = {}
+    for i in range(shnum):
+        sh = struct.unpack_from("<IIIIIIIIII", elf, shoff + i * shentsize)
+        if sh[1] != SHT_SYMTAB:
+            continue
+        strtab = struct.unpack_from("<IIIIIIIIII", elf, shoff + sh[6] * shentsize)
+        names = elf[strtab[4]:strtab[4] + strtab[5]]
+        for off in range(sh[4], sh[4] + sh[5], 16):
+            st_name, st_value = struct.unpack_from("<II", elf, off)
+            if st_name:
+                symbols[names[st_name:names.index(b"\0", st_name)].decode()] = st_value
+    end = max(end, symbols.get("__kernel_end", 0))
+    return bytes(image), load, end, entry, symbols
+
+
+def compress(data, depth):
+    """LZ4 block format; greedy matching with a one-byte lookahead."""
+    n, out = len(data), bytearray()
+    head, chain = {}, [-1] * n
+    inserted = 0
+
+    def insert_upto(pos):
+        nonlocal inserted
+        while inserted < pos:
+            key = data[inserted:inserted + MIN_MATCH]
+            chain[inserted] = head.get(key, -1)
+            head[key] = inserted
+            inserted += 1
+
+    def longest(pos):
+        insert_upto(pos)
+        best_len, best_off = 0, 0
+        limit = n - LAST_LITERALS
+        cand, tries = head.get(data[pos:pos + MIN_MATCH], -1), depth
+        while cand >= 0 and pos - cand <= MAX_OFFSET and tries:
+            length = 0
+            while pos + length < limit and data[cand + length] == data[pos + length]:
+                length += 1
+            if length > best_len:
+                best_len, best_off = length, pos - cand
+            cand, tries = chain[cand], tries - 1
+        return best_len, best_off
+
+    def length_bytes(v):
+        while v >= 255:
+            out.append(255)
+            v -= 255
+        out.append(v)
+
+    def sequence(literals, offset, length):
+        ml = length - MIN_MATCH
+        out.append((min(len(literals), 15) << 4) | (min(ml, 15) if offset else 0))
+        if len(literals) >= 15:
+            length_bytes(len(literals) - 15)
+        out.extend(literals)
+        if offset:
+            out.extend(struct.pack("<H", offset))
+            if ml >= 15:
+                length_bytes(ml - 15)
+
+    anchor = pos = 0
+    while pos < n - MF_LIMIT:
+        length, offset = longest(pos)
+        if length < MIN_MATCH:
+            pos += 1
+            continue
+        # a longer match one byte on is worth a literal
+        if pos + 1 < n - MF_LIMIT:
+            next_length, next_offset = longest(pos + 1)
+            if next_length > length + 1:
+                pos, length, offset = pos + 1, next_length, next_offset
+        sequence(data[anchor:pos], offset, length)
+        pos += length
+        anchor = pos
+    sequence(data[anchor:], 0, 0)
+    return bytes(out)
+
+
+def decompress(block):
+    out, i = bytearray(), 0
+    while i < len(block):
+        token = block[i]
+        i += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                length += block[i]
+                i += 1
+                if block[i - 1] != 255:
+                    break
+        out += block[i:i + length]
+        i += length
+        if i >= len(block):
+            break
+        offset = block[i] | block[i + 1] << 8
+        i += 2
+        length = token & 15
+        if length == 15:
+            while True:
+                length += block[i]
+                i += 1
+                if block[i - 1] != 255:
+                    break
+        for _ in range(length + MIN_MATCH):
+            out.append(out[-offset])
+    return bytes(out)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("kernel", help="Multiboot ELF32 image (kernel.bin, kernel64.bin)")
+    ap.add_argument("output", help="header + LZ4 block, linked into the stub")
+    ap.add_argument("--depth", type=int, default=64, help="hash chain entries tried per position")
+    args = ap.parse_args()
+
+    image, load, end, entry, symbols = read_elf(args.kernel)
+    block = compress(image, args.depth)
+    if decompress(block) != image:
+        print("lz4pack: round trip failed", file=sys.stderr)
+        return 1
+    stats = symbols.get("boot_unpack", 0)
+    with open(args.output, "wb") as f:
+        f.write(MAGIC + struct.pack("<6I", load, len(image), end, entry, stats, len(block)))
+        f.write(block)
+    print("%s: %d -> %d bytes (%.1f%%), unpacks to 0x%x-0x%x%s" % (
+        args.kernel, len(image), len(block), 100.0 * len(block) / len(image), load, end,
+        "" if stats else ", no boot_unpack symbol"), file=sys.stderr)
+    print("0x%x" % ((end + 4095) & ~4095))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
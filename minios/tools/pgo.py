@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+"""Collect a kernel profile in QEMU and write .gcda files for -fprofile-use.
+
+The instrumented kernel (make kernel.bin PGO=gen) counts arcs in memory;
+its `gcov` command prints the counters as text lines (see "gcov counters"
+in kernel.c). `run` boots the kernel headless, types a workload script at
+the shell, asks for the dump and converts it; `convert` does the last step
+for a dump captured some other way (e.g. -serial file:boot.log).
+
+    tools/pgo.py run --kernel kernel.bin --script tools/pgo-workload.txt
+    tools/pgo.py run --kernel kernel.bin --script tools/pgo-workload.txt --keys
+    tools/pgo.py run --qemu qemu-system-x86_64 --kernel kernel64.bin --script tools/pgo-workload.txt
+    tools/pgo.py convert boot.log
+
+With --keys the script is typed on the emulated PS/2 keyboard through the
+QEMU monitor instead of the serial line, so the keyboard IRQ path gets
+profiled as well. `make pgo` runs the whole pipeline.
+"""
+
+import argparse
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+GCDA_MAGIC = 0x67636461
+TAG_FUNCTION = 0x01000000
+TAG_COUNTER_BASE = 0x01A10000
+TAG_OBJECT_SUMMARY = 0xA1000000
+BANNER = b"Type 'help' for commands."
+PROMPT = b"mini> "
+
+# QEMU sendkey names for the characters a workload script may contain
+KEYS = {" ": "spc", "-": "minus", "=": "equal", ".": "dot", ",": "comma", "/": "slash", ";": "semicolon",
+        "'": "apostrophe", "[": "bracket_left", "]": "bracket_right", "\\": "backslash", "`": "grave_accent"}
+SHIFTED = {"_": "minus", "+": "equal", ">": "dot", "<": "comma", "?": "slash", ":": "semicolon",
+           '"': "apostrophe", "|": "backslash", "!": "1", "@": "2", "#": "3", "$": "4", "%": "5",
+           "^": "6", "&": "7", "*": "8", "(": "9", ")": "0", "~": "grave_accent"}
+
+
+def parse_dump(text):
+    """Dump lines -> list of (path, version, stamp, checksum or None, functions).
+
+    Each function is (ident, lineno_checksum, cfg_checksum, [(kind, values)])."""
+    objects, fn = [], None
+    for line in text.splitlines():
+        line = line.strip()
+        if not line.startswith("gcov: "):
+            continue
+        f = line.split()[1:]
+        if f[0] == "file":
+            checksum = int(f[4], 16) if len(f) > 4 else None
+            objects.append((f[1], int(f[2], 16), int(f[3], 16), checksum, []))
+        elif f[0] == "fn" and objects:
+            fn = (int(f[1], 16), int(f[2], 16), int(f[3], 16), [])
+            objects[-1][4].append(fn)
+        elif f[0] == "ctr" and fn is not None:
+            values = [int(v, 16) for v in f[3:]]
+            if len(values) != int(f[2], 16):
+                raise ValueError("truncated counter line (%d of %d values)" % (len(values), int(f[2], 16)))
+            fn[3].append((int(f[1]), values))
+        elif f[0] == "end":
+            return objects
+    raise ValueError("no 'gcov: end' line; is this an instrumented kernel (PGO=gen)?")
+
+
+def gcda_bytes(version, stamp, checksum, functions):
+    """GCC 10+ .gcda contents; GCC 12 (checksum present) counts lengths in bytes."""
+    unit = 4 if checksum is not None else 1
+    words = [GCDA_MAGIC, version, stamp]
+    if checksum is not None:
+        words.append(checksum)
+    sum_max = max((max(v) for fn in functions for kind, v in fn[3] if kind == 0 and v), default=0)
+    words += [TAG_OBJECT_SUMMARY, 2 * unit, 1, sum_max & 0xFFFFFFFF]
+    for ident, lineno_checksum, cfg_checksum, counters in functions:
+        words += [TAG_FUNCTION, 3 * unit, ident, lineno_checksum, cfg_checksum]
+        for kind, values in counters:
+            words += [TAG_COUNTER_BASE + (kind << 17), len(values) * 2 * unit]
+            for v in values:
+                words += [v & 0xFFFFFFFF, v >> 32]
+    return struct.pack("<%dI" % len(words), *words)
+
+
+def write_gcda(text, outdir, keep_paths):
+    for path, version, stamp, checksum, functions in parse_dump(text):
+        dest = path if keep_paths else os.path.join(outdir, os.path.basename(path))
+        with open(dest, "wb") as f:
+            f.write(gcda_bytes(version, stamp, checksum, functions))
+        print("%s: %d functions" % (dest, len(functions)))
+
+
+class Guest:
+    """QEMU with the serial console on stdio and, for --keys, a monitor socket."""
+
+    def __init__(self, qemu, kernel, keys):
+        cmd = [qemu, "-kernel", kernel, "-m", "64M", "-display", "none", "-serial", "stdio", "-no-reboot"]
+        self.mon = None
+        if keys:
+            self.mon_path = os.path.join(tempfile.mkdtemp(), "monitor")
+            cmd += ["-monitor", "unix:%s,server,nowait" % self.mon_path]
+        else:
+            cmd += ["-monitor", "none"]
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.out = b""
+        if keys:
+            for _ in range(50):
+                try:
+                    self.mon = socket.socket(socket.AF_UNIX)
+                    self.mon.connect(self.mon_path)
+                    break
+                except OSError:
+                    time.sleep(0.1)
+
+    def read_until(self, marker, timeout):
+        deadline = time.monotonic() + timeout
+        while marker not in self.out:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise TimeoutError("guest did not print %r" % marker)
+            ready, _, _ = select.select([self.proc.stdout], [], [], left)
+            if ready:
+                chunk = os.read(self.proc.stdout.fileno(), 65536)
+                if not chunk:
+                    raise ConnectionError("QEMU exited")
+                self.out += chunk
+        head, _, self.out = self.out.partition(marker)
+        return head
+
+    def drain(self, quiet):
+        """Discard output until the guest has been silent for `quiet` seconds."""
+        while select.select([self.proc.stdout], [], [], quiet)[0]:
+            if not os.read(self.proc.stdout.fileno(), 65536):
+                raise ConnectionError("QEMU exited")
+        self.out = b""
+
+    def type_line(self, line):
+        if not self.mon:
+            self.proc.stdin.write(line.encode() + b"\r")
+            self.proc.stdin.flush()
+            return
+        for ch in line + "\n":
+            if ch == "\n":
+                key = "ret"
+            elif ch.isalnum():
+                key = ("shift-" + ch.lower()) if ch.isupper() else ch
+            elif ch in KEYS:
+                key = KEYS[ch]
+            elif ch in SHIFTED:
+                key = "shift-" + SHIFTED[ch]
+            else:
+                raise ValueError("no key for %r" % ch)
+            self.mon.sendall(("sendkey %s\n" % key).encode())
+            time.sleep(0.02)
+
+    def close(self):
+        self.proc.kill()
+        self.proc.wait()
+
+
+def run(args):
+    guest = Guest(args.qemu, args.kernel, args.keys)
+    try:
+        # every terminal prints a prompt at boot; start from a quiet line
+        guest.read_until(BANNER, args.timeout)
+        guest.drain(1.0)
+        with open(args.script) as f:
+            for line in f:
+                line = line.strip()
+                if not line or line.startswith("#"):
+                    continue
+                print("> " + line)
+                guest.type_line(line)
+                guest.read_until(PROMPT, args.timeout)
+        guest.type_line("gcov")
+        dump = guest.read_until(b"gcov: end", args.timeout) + b"gcov: end\n"
+    finally:
+        guest.close()
+    write_gcda(dump.decode(errors="replace"), args.dir, args.keep_paths)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    r = sub.add_parser("run", help="boot, run the workload, dump and convert")
+    r.add_argument("--qemu", default="qemu-system-i386")
+    r.add_argument("--kernel", default="kernel.bin")
+    r.add_argument("--script", required=True, help="shell commands, one per line (# comments)")
+    r.add_argument("--keys", action="store_true", help="type on the PS/2 keyboard via the QEMU monitor")
+    r.add_argument("--timeout", type=float, default=120.0, help="seconds to wait for each prompt")
+    c = sub.add_parser("convert", help="convert a saved serial log")
+    c.add_argument("log")
+    for p in (r, c):
+        p.add_argument("--dir", default=".", help="where to write the .gcda files")
+        p.add_argument("--keep-paths", action="store_true", help="write to the paths recorded at compile time")
+    args = ap.parse_args()
+    if args.cmd == "run":
+        run(args)
+    else:
+        with open(args.log, errors="replace") as f:
+            write_gcda(f.read(), args.dir, args.keep_paths)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""Compare kernel build variants (make PROFILE=... CONFIG=...) by size and speed.
+
+Builds every profile, for every config file when --configs is given,
+records the section sizes of each image and, when QEMU is installed,
+boots each one headless. Boot time is read through the QEMU monitor from
+the kernel's boot_us variable (set at the first prompt), so kernels built
+without the serial console are timed too; where the serial console is
+compiled in, the kernel's `bench` command also runs and its cycles/op
+figures are collected. With --lz4 every build is also packed
+(kernelz.bin, see tools/lz4pack.py) and booted the same way; its boot
+time then includes the stub's unpacking, which the kernel reports
+separately (unpack_us). Run from the minios directory (or through
+`make report` / `make configreport` / `make packreport`):
+
+    tools/profilereport.py
+    tools/profilereport.py --arch x86_64 --make "make CC64=gcc AS64=as LD64=ld OBJCOPY64=objcopy"
+    tools/profilereport.py --no-bench --profiles default,small
+    tools/profilereport.py --profiles default --configs configs/defconfig,configs/appliance,configs/tiny
+    tools/profilereport.py --profiles default,small --lz4
+
+Images are kept in report/kernel-<profile>.bin (kernel-<config>-<profile>.bin
+with --configs, kernelz-... when packed) for later use.
+"""
+
+import argparse
+import os
+import re
+import select
+import shlex
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+PROFILES = ["default", "fast", "small", "debug"]
+BENCH_LINE = re.compile(r"^\s+(.+?): (\d+) cycles/op")
+XP_VALUE = re.compile(r"[0-9a-f]+: (0x[0-9a-f]+)")
+
+
+def build(make, profile, config, target, tools):
+    # objects record their flags (.flags) and config.h only changes with the
+    # config, so a profile or config switch rebuilds them
+    cmd = shlex.split(make) + ["-s", target] + ["%s=%s" % kv for kv in tools.items()]
+    if profile != "default":
+        cmd.append("PROFILE=" + profile)
+    if config:
+        cmd.append("CONFIG=" + config)
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def sizes(image):
+    """(text, data, bss) of an ELF image, from binutils size."""
+    out = subprocess.run(["size", image], check=True, capture_output=True, text=True).stdout
+    text, data, bss = out.splitlines()[1].split()[:3]
+    return int(text), int(data), int(bss)
+
+
+def symbol(elf, name):
+    """Address of a global symbol, from binutils nm."""
+    out = subprocess.run(["nm", elf], check=True, capture_output=True, text=True).stdout
+    for line in out.splitlines():
+        f = line.split()
+        if len(f) == 3 and f[2] == name:
+            return int(f[0], 16)
+    return None
+
+
+class Monitor:
+    """The QEMU human monitor on a unix socket."""
+
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX)
+        for _ in range(50):
+            try:
+                self.sock.connect(path)
+                break
+            except OSError:
+                time.sleep(0.1)
+        else:
+            raise ConnectionError("no QEMU monitor at " + path)
+        self.command(None)
+
+    def command(self, text):
+        if text:
+            self.sock.sendall(text.encode() + b"\n")
+        out = b""
+        while not out.endswith(b"(qemu) "):
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise ConnectionError("QEMU monitor closed")
+            out += chunk
+        return out.decode(errors="replace")
+
+    def read32(self, addr):
+        m = XP_VALUE.findall(self.command("xp /1wx 0x%x" % addr))
+        return int(m[-1], 16) if m else 0
+
+
+def run_guest(qemu, image, boot_us_addr, unpack_us_addr, bench, timeout):
+    """Boot image; returns (seconds to the prompt, kernel's own boot ms, unpack ms, {case: cycles})."""
+    mon_path = os.path.join(tempfile.mkdtemp(), "monitor")
+    proc = subprocess.Popen([qemu, "-kernel", image, "-m", "64M", "-display", "none", "-serial", "stdio",
+                             "-no-reboot", "-monitor", "unix:%s,server,nowait" % mon_path],
+                            stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    start = time.monotonic()
+    boot, kernel_ms, unpack_ms, results, out = None, None, None, {}, b""
+    try:
+        mon = Monitor(mon_path)
+        while boot is None and time.monotonic() - start < timeout:
+            us = mon.read32(boot_us_addr)
+            if us:
+                boot, kernel_ms = time.monotonic() - start, us / 1000.0
+            else:
+                time.sleep(0.01)
+        if boot is not None and unpack_us_addr is not None:
+            unpack_ms = mon.read32(unpack_us_addr) / 1000.0
+        if boot is not None and bench:
+            proc.stdin.write(b"bench\r")
+            proc.stdin.flush()
+            while time.monotonic() - start < timeout:
+                ready, _, _ = select.select([proc.stdout], [], [], 0.2)
+                if not ready:
+                    continue
+                chunk = os.read(proc.stdout.fileno(), 65536)
+                if not chunk:
+                    break
+                out += chunk
+                if b"fs_find" in out and out.endswith(b"\n"):
+                    break
+    finally:
+        proc.kill()
+        proc.wait()
+    for line in out.decode(errors="replace").splitlines():
+        m = BENCH_LINE.match(line)
+        if m:
+            results[m.group(1)] = int(m.group(2))
+    return boot, kernel_ms, unpack_ms, results
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--make", default="make", help="make command (may include variables)")
+    ap.add_argument("--cc", help="CC to pass to make")
+    ap.add_argument("--as", dest="as_", help="AS to pass to make")
+    ap.add_argument("--ld", help="LD to pass to make")
+    ap.add_argument("--arch", choices=["i386", "x86_64"], default="i386")
+    ap.add_argument("--profiles", default=",".join(PROFILES), help="comma-separated list")
+    ap.add_argument("--configs", default="", help="config files (comma- or space-separated); default: make's CONFIG")
+    ap.add_argument("--lz4", action="store_true", help="also build and boot the LZ4-packed image")
+    ap.add_argument("--no-bench", action="store_true", help="sizes only, do not boot")
+    ap.add_argument("--timeout", type=float, default=60.0, help="seconds allowed per boot")
+    args = ap.parse_args()
+
+    target, elf, packed = (("kernel.bin", "kernel.bin", "kernelz.bin") if args.arch == "i386"
+                           else ("kernel64.bin", "kernel64.elf", "kernel64z.bin"))
+    qemu = shutil.which("qemu-system-i386" if args.arch == "i386" else "qemu-system-x86_64")
+    if not args.no_bench and not qemu:
+        print("(QEMU not found: sizes only)", file=sys.stderr)
+    tools = {k: v for k, v in (("CC", args.cc), ("AS", args.as_), ("LD", args.ld)) if v}
+    configs = args.configs.replace(",", " ").split() or [None]
+    os.makedirs("report", exist_ok=True)
+
+    rows, cases = [], []
+    for config in configs:
+        for profile in args.profiles.split(","):
+            build(args.make, profile, config, target, tools)
+            name = "%s-%s" % (os.path.basename(config), profile) if config else profile
+            images = [(target, "kernel", profile)]
+            if args.lz4:
+                build(args.make, profile, config, packed, tools)
+                images.append((packed, "kernelz", profile + "+lz4"))
+            text, data, bss = sizes(elf)
+            with open("config.h") as f:
+                serial = "#define CONFIG_SERIAL 1" in f.read()
+            for built, prefix, label in images:
+                image = os.path.join("report", "%s-%s.bin" % (prefix, name))
+                shutil.copy(built, image)
+                boot, kernel_ms, unpack_ms, bench = None, None, None, {}
+                if qemu and not args.no_bench:
+                    boot, kernel_ms, unpack_ms, bench = run_guest(
+                        qemu, image, symbol(elf, "boot_us"), symbol(elf, "unpack_us") if built == packed else None,
+                        serial, args.timeout)
+                for case in bench:
+                    if case not in cases:
+                        cases.append(case)
+                rows.append((os.path.basename(config) if config else "-", label, text, data, bss,
+                             os.path.getsize(image), boot, kernel_ms, unpack_ms, bench))
+
+    header = ["config", "profile", "text", "data", "bss", "file", "boot s", "kernel ms"]
+    header += (["unpack ms"] if args.lz4 else []) + cases
+    print("| " + " | ".join(header) + " |")
+    print("|" + "---|" * len(header))
+    for config, profile, text, data, bss, fsize, boot, kernel_ms, unpack_ms, bench in rows:
+        cells = [config, profile, str(text), str(data), str(bss), str(fsize),
+                 "%.2f" % boot if boot is not None else "-", "%.1f" % kernel_ms if kernel_ms is not None else "-"]
+        if args.lz4:
+            cells.append("%.2f" % unpack_ms if unpack_ms is not None else "-")
+        cells += [str(bench[c]) if c in bench else "-" for c in cases]
+        print("| " + " | ".join(cells) + " |")
+    if rows and qemu and not args.no_bench:
+        print("\nboot s is QEMU start to the first prompt, kernel ms the kernel's own share (kernel entry to prompt);")
+        if args.lz4:
+            print("unpack ms is the LZ4 stub's time before kernel entry (TSC), included in boot s only;")
+        print("bench columns are cycles/op (lower is better), only for configs with the serial console")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Run MiniOS shell commands on many guests in parallel over UDP.
+
+Each guest listens on UDP port 2323 (see "Remote shell" in kernel.c).
+With QEMU user networking forward a host port per guest, e.g.:
+
+    qemu-system-i386 -cdrom minios.iso -nic user,model=e1000,hostfwd=udp::5001-:2323
+
+Examples:
+    tools/rsh.py 127.0.0.1:5001 127.0.0.1:5002 -c ls -c "cat welcome"
+    tools/rsh.py --ports 5001-5016 -c version
+"""
+
+import argparse
+import socket
+import struct
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
+FLAG_LAST = 0x01
+
+
+def run_one(target, commands, timeout):
+    host, port = target
+    out = []
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(timeout)
+    try:
+        for req_id, cmd in enumerate(commands):
+            sock.sendto(struct.pack(">H", req_id) + cmd.encode(), (host, port))
+            chunks = []
+            while True:
+                try:
+                    data, _ = sock.recvfrom(2048)
+                except socket.timeout:
+                    chunks.append("[timeout]\n")
+                    break
+                if len(data) < 3 or struct.unpack(">H", data[:2])[0] != req_id:
+                    continue  # stale reply to an earlier command
+                chunks.append(data[3:].decode(errors="replace"))
+                if data[2] & FLAG_LAST:
+                    break
+            out.append("".join(chunks))
+    finally:
+        sock.close()
+    return out
+
+
+def parse_target(s, default_host):
+    if ":" in s:
+        host, port = s.rsplit(":", 1)
+        return host or default_host, int(port)
+    return default_host, int(s)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("targets", nargs="*", help="host:port of each guest")
+    ap.add_argument("--ports", help="port range on --host, e.g. 5001-5016")
+    ap.add_argument("--host", default="127.0.0.1")
+    ap.add_argument("-c", "--command", action="append", required=True, help="command to run (repeatable)")
+    ap.add_argument("-t", "--timeout", type=float, default=2.0, help="seconds to wait for each reply")
+    ap.add_argument("-j", "--jobs", type=int, default=64, help="guests contacted at once")
+    args = ap.parse_args()
+
+    targets = [parse_target(t, args.host) for t in args.targets]
+    if args.ports:
+        lo, hi = (int(x) for x in args.ports.split("-"))
+        targets += [(args.host, p) for p in range(lo, hi + 1)]
+    if not targets:
+        ap.error("no targets given")
+
+    failed = 0
+    with ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        results = pool.map(lambda t: run_one(t, args.command, args.timeout), targets)
+        for (host, port), outputs in zip(targets, results):
+            for cmd, text in zip(args.command, outputs):
+                if text.endswith("[timeout]\n"):
+                    failed += 1
+                for line in text.splitlines():
+                    print("%s:%d [%s] %s" % (host, port, cmd, line))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+"""Copy files to and from a MiniOS guest over the serial console.
+
+Host side of the kernel's `recv`/`send` commands (see "Serial file
+transfer" in kernel.c). Start QEMU with the serial port on a TCP socket:
+
+    qemu-system-i386 -cdrom minios.iso -serial tcp::4555,server,nowait
+
+then, with the guest at the shell prompt:
+
+    tools/sercp.py tcp:127.0.0.1:4555 put notes.txt notes
+    tools/sercp.py tcp:127.0.0.1:4555 get notes notes.txt
+
+A serial device path (e.g. /dev/ttyUSB0 or a pty) works as well.
+"""
+
+import argparse
+import os
+import select
+import socket
+import struct
+import sys
+import termios
+import time
+import tty
+
+END, ESC, ESC_END, ESC_ESC = 0xC0, 0xDB, 0xDC, 0xDD
+CHUNK = 1024
+WINDOW = 8
+TIMEOUT = 0.5
+MAX_RETRIES = 10
+START_TIMEOUT = 10.0
+
+
+def _crc32c_table():
+    table = []
+    for i in range(256):
+        c = i
+        for _ in range(8):
+            c = (c >> 1) ^ 0x82F63B78 if c & 1 else c >> 1
+        table.append(c)
+    return table
+
+
+CRC_TABLE = _crc32c_table()
+
+
+def crc32c(data, crc=0):
+    crc ^= 0xFFFFFFFF
+    for b in data:
+        crc = CRC_TABLE[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+
+class Link:
+    """Byte pipe to the guest: a TCP socket or a raw serial device."""
+
+    def __init__(self, spec):
+        self.sock = self.fd = None
+        if spec.startswith("tcp:"):
+            _, host, port = spec.split(":")
+            self.sock = socket.create_connection((host, int(port)))
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        else:
+            self.fd = os.open(spec, os.O_RDWR | os.O_NOCTTY)
+            tty.setraw(self.fd)
+            attrs = termios.tcgetattr(self.fd)
+            attrs[4] = attrs[5] = termios.B115200
+            termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+        self.rx = bytearray()
+        self.frame = bytearray()
+        self.esc = False
+
+    def write(self, data):
+        if self.sock:
+            self.sock.sendall(data)
+        else:
+            while data:
+                data = data[os.write(self.fd, data):]
+            # wait until it is on the wire, so ACK timeouts start from there
+            termios.tcdrain(self.fd)
+
+    def _read_some(self, timeout):
+        handle = self.sock if self.sock else self.fd
+        ready, _, _ = select.select([handle], [], [], max(0.0, timeout))
+        if not ready:
+            return b""
+        data = self.sock.recv(65536) if self.sock else os.read(self.fd, 65536)
+        if not data:
+            raise ConnectionError("serial link closed")
+        return data
+
+    def send_frame(self, ftype, seq, payload=b""):
+        body = struct.pack("<BBH", ord(ftype), seq & 0xFF, len(payload)) + payload
+        body += struct.pack("<I", crc32c(body))
+        out = bytearray([END])
+        for b in body:
+            if b == END:
+                out += bytes([ESC, ESC_END])
+            elif b == ESC:
+                out += bytes([ESC, ESC_ESC])
+            else:
+                out.append(b)
+        out.append(END)
+        self.write(bytes(out))
+
+    def recv_frame(self, timeout):
+        """Next good frame as (type, seq, payload), or None on timeout."""
+        deadline = time.monotonic() + timeout
+        while True:
+            while self.rx:
+                b = self.rx.pop(0)
+                if b == END:
+                    frame, self.frame, self.esc = bytes(self.frame), bytearray(), False
+                    if len(frame) < 8:
+                        continue
+                    ftype, seq, length = struct.unpack("<BBH", frame[:4])
+                    if length != len(frame) - 8 or struct.unpack("<I", frame[-4:])[0] != crc32c(frame[:-4]):
+                        continue
+                    return chr(ftype), seq, frame[4:-4]
+                if b == ESC:
+                    self.esc = True
+                    continue
+                if self.esc:
+                    b = END if b == ESC_END else ESC if b == ESC_ESC else b
+                    self.esc = False
+                if len(self.frame) <= CHUNK + 8:
+                    self.frame.append(b)
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            self.rx += self._read_some(left)
+
+
+def send_file(link, name, data):
+    """Go-back-N sender: frame 0 INIT, 1..n DATA, n+1 EOF."""
+    chunks = [data[i:i + CHUNK] for i in range(0, len(data), CHUNK)]
+    nframes = len(chunks) + 2
+    base = nxt = retries = 0
+    while base < nframes:
+        while nxt < nframes and nxt < base + WINDOW:
+            if nxt == 0:
+                link.send_frame("I", 0, struct.pack("<I", len(data)) + name.encode()[:15])
+            elif nxt == nframes - 1:
+                link.send_frame("E", nxt)
+            else:
+                link.send_frame("D", nxt, chunks[nxt - 1])
+            nxt += 1
+        frame = link.recv_frame(TIMEOUT)
+        if frame is None:
+            retries += 1
+            if retries > MAX_RETRIES:
+                raise RuntimeError("no acknowledgement from guest")
+            nxt = base
+            continue
+        ftype, seq, payload = frame
+        if ftype == "X":
+            raise RuntimeError("guest aborted: " + payload.decode(errors="replace"))
+        if ftype != "A":
+            continue
+        acked = base + ((seq - base) & 0xFF)
+        if base < acked <= nxt:
+            base, retries = acked, 0
+
+
+def recv_file(link):
+    """Receiver with cumulative ACKs; returns the file contents."""
+    expected, size, out, retries = 0, 0, bytearray(), 0
+    deadline = time.monotonic() + START_TIMEOUT
+    while True:
+        frame = link.recv_frame(TIMEOUT)
+        if frame is None:
+            if expected == 0 and time.monotonic() > deadline:
+                raise RuntimeError("guest did not start sending")
+            if expected:
+                retries += 1
+                if retries > MAX_RETRIES:
+                    raise RuntimeError("transfer stalled")
+            continue
+        retries = 0
+        ftype, seq, payload = frame
+        if ftype == "X":
+            raise RuntimeError("guest aborted: " + payload.decode(errors="replace"))
+        if ftype in ("A", "R"):
+            continue
+        if seq != expected & 0xFF:
+            link.send_frame("A", expected)
+            continue
+        if expected == 0:
+            if ftype != "I":
+                continue
+            size = struct.unpack("<I", payload[:4])[0]
+        elif ftype == "D":
+            out += payload
+        elif ftype == "E":
+            link.send_frame("A", expected + 1)
+            if len(out) != size:
+                raise RuntimeError("short transfer: %d of %d bytes" % (len(out), size))
+            return bytes(out)
+        expected += 1
+        link.send_frame("A", expected)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("link", help="tcp:HOST:PORT or a serial device path")
+    ap.add_argument("op", choices=["put", "get"])
+    ap.add_argument("src")
+    ap.add_argument("dst", nargs="?")
+    args = ap.parse_args()
+
+    link = Link(args.link)
+    start = time.monotonic()
+    if args.op == "put":
+        data = open(args.src, "rb").read()
+        remote = args.dst or os.path.basename(args.src)
+        link.write(("recv %s\r" % remote).encode())
+        # wait for the guest to announce it is ready
+        while True:
+            frame = link.recv_frame(START_TIMEOUT)
+            if frame is None:
+                raise SystemExit("guest did not answer; is it at the shell prompt?")
+            if frame[0] == "R":
+                break
+        send_file(link, remote, data)
+        nbytes = len(data)
+    else:
+        link.write(("send %s\r" % args.src).encode())
+        data = recv_file(link)
+        with open(args.dst or args.src, "wb") as f:
+            f.write(data)
+        nbytes = len(data)
+    elapsed = time.monotonic() - start
+    print("%s: %d bytes in %.2f s (%.1f KiB/s)" % (args.op, nbytes, elapsed, nbytes / 1024.0 / max(elapsed, 1e-6)))
+
+
+if __name__ == "__main__":
+    main()